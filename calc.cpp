@@ -4,6 +4,8 @@
 #include <stdexcept>
 #include <string>
 
+#include "trace.hpp"
+
 enum Token
 {
     Eof,
@@ -49,6 +51,7 @@ int ParseInteger()
 // エラー時には std::runtime_error を投げる
 void AnalyzeNextToken(void)
 {
+    TRACE_SPAN("calc", "AnalyzeNextToken");
     // 空白の読み飛ばし
     while (std::isspace(GetCurrentChar()))
     {
@@ -199,6 +202,7 @@ int factor(void)
 // エラー時には std::runtime_error を投げる
 void toplevel(void)
 {
+    TRACE_SPAN("calc", "toplevel");
     int val = expression();
     if (token == Semic)
     {
@@ -212,6 +216,9 @@ void toplevel(void)
 
 int main(void)
 {
+    // SYNTAXANALYSIS_TRACE を定義してビルドした場合は、終了時にトレースを書き出す
+    TRACE_SESSION();
+
     printf("Calc> ");
     ReadNextChar();
 
@@ -1,21 +1,417 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <mutex>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
-#include <filesystem>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__SSE2__) || defined(__PCLMUL__)
+#include <immintrin.h>
+#endif
+
+#include "trace.hpp"
+
+extern char **environ;
 
 /*
 # bash の構文を BNF っぽく定義してみる
 * 右辺には正規表現を用いる
-* 文字列のクォーテーションには対応しない
-* `<JOB>       = <CMD>{'|'<CMD>}*{'>'<STR>}?'\n'`
+* `<LIST>      = <JOB>{<LIST_OP><JOB>}*'\n'`
+* `<LIST_OP>   = ';'|'&'|'&&'|'||'`
+* `<JOB>       = <CMD>{'|'<CMD>}*{'>'<STR>}?`
 * `<CMD>       = <STR>{' '<STR>}*`
-* `<STR>       = [^ ]+`
+* `<STR>       = {[^ |>;&\n'"\\]|<QUOTED>}+`
+* `<QUOTED>    = '[^']*'|"{[^"\\]|\\.}*"|\\.`
+* クォーテーションの中の ' ', '|', '>', ';', '&' は <STR> の一部になる
+* ParseJob などの <JOB> を返すパーサーは、最初の <LIST_OP> の手前までを解析する
+* `"` の中の `\` は、次の文字が `"` か `\` の場合だけエスケープになる
+* 閉じられていないクォーテーションは、文字列末尾まで続いているものとして扱う
 */
 
+enum Token
+{
+    Pipe,
+    Redirect,
+    StrSeparator,
+    // <LIST_OP> の 1 文字目
+    ListSeparator,
+    Str,
+    End,
+};
+
+Token ToToken(const char c)
+{
+    switch (c)
+    {
+    case '|':
+    {
+        return Token::Pipe;
+    }
+    case '>':
+    {
+        return Token::Redirect;
+    }
+    case ' ':
+    {
+        return Token::StrSeparator;
+    }
+    case ';':
+    case '&':
+    {
+        return Token::ListSeparator;
+    }
+    case '\n':
+    {
+        return Token::End;
+    }
+    default:
+    {
+        return Token::Str;
+    }
+    }
+}
+
+// クォーテーションの解析状態
+enum class QuoteState
+{
+    None,
+    Single,
+    Double,
+    // クォーテーションの外の '\' の直後
+    Escape,
+    // "" の中の '\' の直後
+    DoubleEscape,
+};
+
+// 文字列を 64 文字ずつのブロックに分けて、クォーテーションの情報をビットマスクで表す
+// masks[2 * i] と masks[2 * i + 1] が i 番目のブロックを表し、ブロックの n 文字目が n ビット目に対応する
+// masks[2 * i]     : クォーテーションの中の文字やエスケープされた文字など、トークンの種類によらず <STR> の一部になる文字
+// masks[2 * i + 1] : クォーテーションや '\' など、<STR> の値には含まれない文字
+using QuoteMasks = std::vector<uint64_t>;
+
+// begin ビット目から end ビット目までが 1 のマスク
+inline uint64_t BitRange(const unsigned begin, const unsigned end)
+{
+    const uint64_t upper = end >= 63 ? ~uint64_t(0) : (uint64_t(1) << (end + 1)) - 1;
+    return upper & ~((uint64_t(1) << begin) - 1);
+}
+
+// 各ビットを、そのビット以下のビットの XOR にする
+// クォーテーションの位置のマスクから、クォーテーションの中を表すマスクが得られる
+inline uint64_t PrefixXor(uint64_t x)
+{
+#if defined(__PCLMUL__)
+    const auto product = _mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<int64_t>(x)), _mm_set1_epi8(static_cast<char>(0xFF)), 0);
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(product));
+#else
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+#endif
+}
+
+// 64 文字のブロックから c と一致する文字のマスクを求める
+inline uint64_t MatchMask(const char *block, const char c)
+{
+#if defined(__SSE2__)
+    const auto needle = _mm_set1_epi8(c);
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i));
+        mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)))) << (16 * i);
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        mask |= static_cast<uint64_t>(block[i] == c) << i;
+    }
+    return mask;
+#endif
+}
+
+// s のクォーテーションの情報を 64 文字ずつ求める
+// クォーテーションが 1 種類だけで '\' を含まないブロックは、PrefixXor でまとめて求める
+// それ以外のブロックは、クォーテーションと '\' の位置だけを順番に調べる
+// 結果は masks に書き込み、masks の容量は再利用する
+void BuildQuoteMasks(const std::string_view s, QuoteMasks &masks)
+{
+    TRACE_SPAN("parse", "BuildQuoteMasks");
+    const size_t blockCount = (s.size() + 63) / 64;
+    masks.assign(blockCount * 2, 0);
+
+    auto state = QuoteState::None;
+    for (size_t block = 0; block < blockCount; block++)
+    {
+        // 最後のブロックは 64 文字に満たない場合があるので、コピーして埋める
+        const char *p = s.data() + block * 64;
+        char tail[64];
+        if (s.size() - block * 64 < 64)
+        {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p, s.size() - block * 64);
+            p = tail;
+        }
+
+        const auto singleQuotes = MatchMask(p, '\'');
+        const auto doubleQuotes = MatchMask(p, '"');
+        const auto backslashes = MatchMask(p, '\\');
+        uint64_t quoted = 0;
+        uint64_t syntax = 0;
+        auto special = singleQuotes | doubleQuotes | backslashes;
+
+        // 前のブロックの末尾の '\' でエスケープされた文字
+        if (state == QuoteState::Escape || state == QuoteState::DoubleEscape)
+        {
+            if (state == QuoteState::DoubleEscape && (p[0] == '"' || p[0] == '\\'))
+            {
+                masks[2 * (block - 1) + 1] |= uint64_t(1) << 63;
+            }
+            quoted |= 1;
+            special &= ~uint64_t(1);
+            state = state == QuoteState::Escape ? QuoteState::None : QuoteState::Double;
+        }
+
+        if (special == 0)
+        {
+            // クォーテーションの開始も終了も存在しない
+            if (state != QuoteState::None)
+            {
+                quoted = ~uint64_t(0);
+            }
+        }
+        else if (backslashes == 0 && (singleQuotes == 0 || doubleQuotes == 0) &&
+                 (state == QuoteState::None || (state == QuoteState::Single) == (singleQuotes != 0)))
+        {
+            // 1 種類のクォーテーションだけなので、開始と終了が交互に現れる
+            const auto quotes = special;
+            const auto inside = PrefixXor(quotes) ^ (state == QuoteState::None ? 0 : ~uint64_t(0));
+            quoted |= inside | quotes;
+            syntax |= quotes;
+            if (inside >> 63)
+            {
+                state = singleQuotes != 0 ? QuoteState::Single : QuoteState::Double;
+            }
+            else
+            {
+                state = QuoteState::None;
+            }
+        }
+        else
+        {
+            // クォーテーションが開始した位置
+            unsigned quoteBegin = 0;
+            while (special != 0)
+            {
+                const unsigned i = __builtin_ctzll(special);
+                special &= special - 1;
+                const auto bit = uint64_t(1) << i;
+                const char c = p[i];
+
+                if (state == QuoteState::None)
+                {
+                    quoted |= bit;
+                    syntax |= bit;
+                    if (c == '\\')
+                    {
+                        // 次の文字はエスケープされる
+                        if (i == 63)
+                        {
+                            state = QuoteState::Escape;
+                        }
+                        else
+                        {
+                            quoted |= bit << 1;
+                            special &= ~(bit << 1);
+                        }
+                    }
+                    else
+                    {
+                        state = c == '\'' ? QuoteState::Single : QuoteState::Double;
+                        quoteBegin = i;
+                    }
+                }
+                else if (state == QuoteState::Single)
+                {
+                    // '' の中では ' 以外に特別な文字は存在しない
+                    if (c == '\'')
+                    {
+                        quoted |= BitRange(quoteBegin, i);
+                        syntax |= bit;
+                        state = QuoteState::None;
+                    }
+                }
+                else if (c == '"')
+                {
+                    quoted |= BitRange(quoteBegin, i);
+                    syntax |= bit;
+                    state = QuoteState::None;
+                }
+                else if (c == '\\')
+                {
+                    if (i == 63)
+                    {
+                        state = QuoteState::DoubleEscape;
+                    }
+                    else
+                    {
+                        // エスケープされた文字は、'\' の有無によらずクォーテーションの中になる
+                        if (p[i + 1] == '"' || p[i + 1] == '\\')
+                        {
+                            syntax |= bit;
+                        }
+                        special &= ~(bit << 1);
+                    }
+                }
+            }
+
+            // ブロックの末尾までクォーテーションが続いている
+            if (state == QuoteState::Single || state == QuoteState::Double || state == QuoteState::DoubleEscape)
+            {
+                quoted |= BitRange(quoteBegin, 63);
+            }
+            else if (state == QuoteState::Escape)
+            {
+                quoted |= uint64_t(1) << 63;
+            }
+        }
+
+        // 文字列末尾より後ろのビットは使わない
+        if (p == tail)
+        {
+            const auto valid = BitRange(0, s.size() - block * 64 - 1);
+            quoted &= valid;
+            syntax &= valid;
+        }
+        masks[2 * block] = quoted;
+        masks[2 * block + 1] = syntax;
+    }
+}
+
+QuoteMasks BuildQuoteMasks(const std::string_view s)
+{
+    QuoteMasks masks;
+    BuildQuoteMasks(s, masks);
+    return masks;
+}
+
+// BuildQuoteMasks と同じ結果を 1 文字ずつの状態遷移で求める
+// テストとベンチマークの比較対象に使う
+QuoteMasks BuildQuoteMasksScalar(const std::string_view s)
+{
+    QuoteMasks masks((s.size() + 63) / 64 * 2);
+    const auto mark = [&](const size_t pos, const size_t offset) { masks[pos / 64 * 2 + offset] |= uint64_t(1) << (pos % 64); };
+
+    auto state = QuoteState::None;
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        const char c = s[i];
+        switch (state)
+        {
+        case QuoteState::None:
+            if (c == '\\' || c == '\'' || c == '"')
+            {
+                mark(i, 0);
+                mark(i, 1);
+                state = c == '\\' ? QuoteState::Escape : c == '\'' ? QuoteState::Single : QuoteState::Double;
+            }
+            break;
+        case QuoteState::Escape:
+            mark(i, 0);
+            state = QuoteState::None;
+            break;
+        case QuoteState::Single:
+            mark(i, 0);
+            if (c == '\'')
+            {
+                mark(i, 1);
+                state = QuoteState::None;
+            }
+            break;
+        case QuoteState::Double:
+            mark(i, 0);
+            if (c == '"')
+            {
+                mark(i, 1);
+                state = QuoteState::None;
+            }
+            else if (c == '\\')
+            {
+                if (i + 1 < s.size() && (s[i + 1] == '"' || s[i + 1] == '\\'))
+                {
+                    mark(i, 1);
+                }
+                state = QuoteState::DoubleEscape;
+            }
+            break;
+        case QuoteState::DoubleEscape:
+            mark(i, 0);
+            state = QuoteState::Double;
+            break;
+        }
+    }
+    return masks;
+}
+
 // 解析される文字列を表す
 class StringToBeParsed final
 {
 public:
-    StringToBeParsed(const char *s) : m_string(s){};
+    StringToBeParsed(const char *s) : StringToBeParsed(std::string_view(s)){};
+    StringToBeParsed(std::string_view s) : m_string(s), m_quoteMasks(BuildQuoteMasks(m_string)){};
+
+    // s を先頭から解析し直す
+    // 確保済みのメモリを再利用するので、s が長くならない限りメモリを確保しない
+    void Assign(const std::string_view s)
+    {
+        m_string.assign(s);
+        BuildQuoteMasks(m_string, m_quoteMasks);
+        m_currentPos = 0;
+    };
 
     // 次の文字に移動し、移動した結果を返す
     // すでに文字列末尾に到達していて、移動できない場合は '\n' を返す
@@ -41,105 +437,155 @@ public:
         return m_string.at(m_currentPos);
     };
 
-public:
-    const std::string m_string;
+    // 現在の文字のトークンを返す
+    // クォーテーションの中の文字は、'\n' 以外は Token::Str になる
+    // "||" の 1 文字目は '|' ではなく Token::ListSeparator になる
+    Token CurrentToken() const
+    {
+        const auto c = CurrentChar();
+        if (c != '\n' && TestMask(m_currentPos, 0))
+        {
+            return Token::Str;
+        }
+        const auto next = m_currentPos + 1;
+        if (c == '|' && next < m_string.size() && m_string[next] == '|' && !TestMask(next, 0))
+        {
+            return Token::ListSeparator;
+        }
+        return ToToken(c);
+    };
+
+    // 現在の文字がクォーテーションやエスケープの '\' で、<STR> の値に含まれない場合は true を返す
+    bool IsQuoteSyntax() const
+    {
+        return m_currentPos < m_string.size() && TestMask(m_currentPos, 1);
+    };
+
+    size_t Position() const
+    {
+        return m_currentPos;
+    };
+
+    const std::string &String() const
+    {
+        return m_string;
+    };
 
 private:
+    bool TestMask(const size_t pos, const size_t offset) const
+    {
+        return (m_quoteMasks[pos / 64 * 2 + offset] >> (pos % 64)) & 1;
+    };
+
+    std::string m_string;
+    QuoteMasks m_quoteMasks;
     size_t m_currentPos = 0;
 };
 
+// Command と Job は std::pmr のアロケータに対応する
+// monotonic_buffer_resource などを渡してパースすると、まとめて一度に解放できる
 struct Command final
 {
-    std::vector<std::string> args;
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    Command() = default;
+    explicit Command(const allocator_type &alloc) : args(alloc){};
+    Command(const Command &other, const allocator_type &alloc) : args(other.args, alloc){};
+    Command(Command &&other, const allocator_type &alloc) : args(std::move(other.args), alloc){};
+    Command(const Command &) = default;
+    Command(Command &&) = default;
+    Command &operator=(const Command &) = default;
+    Command &operator=(Command &&) = default;
+
+    allocator_type get_allocator() const { return args.get_allocator(); };
+
+    std::pmr::vector<std::pmr::string> args;
 };
 
 struct Job final
 {
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    // spareCommands と spareArgs は Job の値ではないので、コピーしない
+    Job() = default;
+    explicit Job(const allocator_type &alloc) : commands(alloc), redirectFilename(alloc), spareCommands(alloc), spareArgs(alloc){};
+    Job(const Job &other, const allocator_type &alloc) : commands(other.commands, alloc), redirectFilename(other.redirectFilename, alloc), spareCommands(alloc), spareArgs(alloc){};
+    Job(Job &&other, const allocator_type &alloc)
+        : commands(std::move(other.commands), alloc), redirectFilename(std::move(other.redirectFilename), alloc), spareCommands(std::move(other.spareCommands), alloc),
+          spareArgs(std::move(other.spareArgs), alloc){};
+    Job(const Job &other) : commands(other.commands), redirectFilename(other.redirectFilename){};
+    Job(Job &&) = default;
+    Job &operator=(const Job &other)
+    {
+        commands = other.commands;
+        redirectFilename = other.redirectFilename;
+        return *this;
+    };
+    Job &operator=(Job &&) = default;
+
+    allocator_type get_allocator() const { return commands.get_allocator(); };
+
     // コマンドが複数存在する場合は、パイプで連結する
     // リダイレクトが指定されていない場合、最後のコマンド結果は標準出力に出力する
-    std::vector<Command> commands;
+    std::pmr::vector<Command> commands;
 
     // リダイレクトが指定されている場合に設定される
     // リダイレクトが指定されていない場合は空になる
-    std::filesystem::path redirectFilename;
-};
+    // pmr のアロケータを使うため std::filesystem::path ではなく文字列で持つ
+    std::pmr::string redirectFilename;
 
-enum Token
-{
-    Pipe,
-    Redirect,
-    StrSeparator,
-    Str,
-    End,
+    // ParseJob(StringToBeParsed &, Job &) が、前の結果より少なくなったコマンドと引数を容量ごと取っておく場所
+    // Job の値には含まれず、比較やハッシュ、エンコードでは使わない
+    std::pmr::vector<Command> spareCommands;
+    std::pmr::vector<std::pmr::string> spareArgs;
 };
 
-Token ToToken(const char c)
-{
-    switch (c)
-    {
-    case '|':
-    {
-        return Token::Pipe;
-    }
-    case '>':
-    {
-        return Token::Redirect;
-    }
-    case ' ':
-    {
-        return Token::StrSeparator;
-    }
-    case '\n':
-    {
-        return Token::End;
-    }
-    default:
-    {
-        return Token::Str;
-    }
-    }
-}
-
 // p の現在の解析位置から <STR> を取得する
 // <STR> を取得できた場合、p の解析地点も移動する
-std::string ParseStr(StringToBeParsed &p)
+// 取得した文字列のメモリは alloc から確保する
+std::pmr::string ParseStr(StringToBeParsed &p, const Job::allocator_type &alloc = {})
 {
-    std::string str;
+    std::pmr::string str(alloc);
     while (true)
     {
-        const auto c = p.CurrentChar();
-        if (ToToken(c) != Token::Str)
+        if (p.CurrentToken() != Token::Str)
         {
             return str;
         }
 
-        str += c;
+        // クォーテーションとエスケープの '\' は値に含めない
+        if (!p.IsQuoteSyntax())
+        {
+            str += p.CurrentChar();
+        }
         p.NextChar();
     }
 }
 
-Command NextCmd(StringToBeParsed &p)
+Command NextCmd(StringToBeParsed &p, const Job::allocator_type &alloc = {})
 {
-    Command cmd;
+    Command cmd(alloc);
 
     // <STR> をすべて読み込む
     while (true)
     {
         // 連続するスペースを飛ばす
-        while (ToToken(p.CurrentChar()) == Token::StrSeparator)
+        while (p.CurrentToken() == Token::StrSeparator)
         {
             p.NextChar();
         }
 
-        const auto str = ParseStr(p);
-        if (!str.empty())
+        // '' のように、値が空文字列の <STR> も存在する
+        const auto begin = p.Position();
+        auto str = ParseStr(p, alloc);
+        if (p.Position() != begin)
         {
-            cmd.args.push_back(str);
+            cmd.args.push_back(std::move(str));
         }
 
         // <STR> の次のトークンを調べる
         // スペースが存在するなら次の <STR> が存在するかもしれないので続行する
-        if (ToToken(p.CurrentChar()) == Token::StrSeparator)
+        if (p.CurrentToken() == Token::StrSeparator)
         {
             // 次の <STR> の初めの文字に移動させる
             p.NextChar();
@@ -151,23 +597,25 @@ Command NextCmd(StringToBeParsed &p)
     }
 }
 
-Job ParseJob(StringToBeParsed &p)
+// 返される Job のメモリはすべて alloc から確保する
+Job ParseJob(StringToBeParsed &p, const Job::allocator_type &alloc = {})
 {
-    Job job;
+    TRACE_SPAN("parse", "ParseJob");
+    Job job(alloc);
 
     // <CMD> をすべて読み込む
     while (true)
     {
         // 連続するスペースを飛ばす
-        while (ToToken(p.CurrentChar()) == Token::StrSeparator)
+        while (p.CurrentToken() == Token::StrSeparator)
         {
             p.NextChar();
         }
 
-        Command cmd(NextCmd(p));
+        Command cmd(NextCmd(p, alloc));
         if (!cmd.args.empty())
         {
-            job.commands.push_back(cmd);
+            job.commands.push_back(std::move(cmd));
         }
 
         // NextCmd は スペース+<STR> が連続する箇所を読み取るので、NextCmd 後に出現するトークンはスペース以外になる
@@ -175,7 +623,7 @@ Job ParseJob(StringToBeParsed &p)
 
         // <CMD> の次のトークンを調べる
         // '|' が存在するなら次の <CMD> が存在するかもしれないので続行する
-        if (ToToken(p.CurrentChar()) == Token::Pipe)
+        if (p.CurrentToken() == Token::Pipe)
         {
             // 次の <CMD> の初めの文字に移動させる
             p.NextChar();
@@ -187,74 +635,7754 @@ Job ParseJob(StringToBeParsed &p)
     }
 
     // リダイレクトを読み込む
-    if (ToToken(p.CurrentChar()) == Token::Redirect)
+    if (p.CurrentToken() == Token::Redirect)
     {
         // '>' の次の文字に移動させる
         p.NextChar();
 
         // 連続するスペースを飛ばす
-        while (ToToken(p.CurrentChar()) == Token::StrSeparator)
+        while (p.CurrentToken() == Token::StrSeparator)
         {
             p.NextChar();
         }
 
-        job.redirectFilename = ParseStr(p);
+        job.redirectFilename = ParseStr(p, alloc);
     }
 
     return job;
 }
 
-void TestParseJob(const char *in, const std::vector<std::vector<std::string>> expectCommands, const std::filesystem::path expectRedirectFilename)
+// p の現在の解析位置から <STR> を取得して str に設定する
+// str の容量は再利用する
+// <STR> を取得できた場合は true を返し、p の解析地点も移動する
+bool ParseStr(StringToBeParsed &p, std::pmr::string &str)
 {
-    StringToBeParsed str(in);
-    const auto testeeJob = ParseJob(str);
+    str.clear();
+    const auto begin = p.Position();
+    while (p.CurrentToken() == Token::Str)
+    {
+        if (!p.IsQuoteSyntax())
+        {
+            str += p.CurrentChar();
+        }
+        p.NextChar();
+    }
+    return p.Position() != begin;
+}
 
-    // コマンド一覧をテストする
-    std::vector<std::vector<std::string>> testeeCommands;
-    for (const auto &cmd : testeeJob.commands)
+// NextCmd と同じように <CMD> を読み込み、cmd に設定する
+// cmd.args とその文字列の容量は再利用する
+// 引数が足りなければ spareArgs から取り出し、余った引数は破棄せずに spareArgs に移す
+void NextCmd(StringToBeParsed &p, Command &cmd, std::pmr::vector<std::pmr::string> &spareArgs)
+{
+    size_t argCount = 0;
+    while (true)
     {
-        std::vector<std::string> args;
-        for (const auto &arg : cmd.args)
+        while (p.CurrentToken() == Token::StrSeparator)
         {
-            args.push_back(arg);
+            p.NextChar();
+        }
+
+        if (argCount == cmd.args.size())
+        {
+            if (spareArgs.empty())
+            {
+                cmd.args.emplace_back();
+            }
+            else
+            {
+                cmd.args.push_back(std::move(spareArgs.back()));
+                spareArgs.pop_back();
+            }
+        }
+        if (ParseStr(p, cmd.args[argCount]))
+        {
+            argCount++;
+        }
+
+        if (p.CurrentToken() == Token::StrSeparator)
+        {
+            p.NextChar();
+        }
+        else
+        {
+            break;
         }
-        testeeCommands.push_back(args);
     }
-    if (testeeCommands != expectCommands)
+
+    while (cmd.args.size() > argCount)
     {
-        fprintf(stderr, "コマンドテスト失敗, \"%s\"\n", in);
-        return;
+        spareArgs.push_back(std::move(cmd.args.back()));
+        cmd.args.pop_back();
     }
+}
 
-    // リダイレクトをテストする
-    if (testeeJob.redirectFilename != expectRedirectFilename)
+// ParseJob と同じように p を解析し、結果を job に設定する
+// job.commands や引数の文字列は中身を消して容量を再利用するので、
+// 行を繰り返しパースすると、一度に必要なコマンドや引数の数と長さに達した後はメモリを確保しなくなる
+// 前の結果よりコマンドや引数が少ない場合、余った要素は job.spareCommands と job.spareArgs に移して、後の行で再利用する
+void ParseJob(StringToBeParsed &p, Job &job)
+{
+    size_t commandCount = 0;
+    while (true)
     {
-        fprintf(stderr, "リダイレクトテスト失敗, \"%s\"\n", in);
-        return;
+        while (p.CurrentToken() == Token::StrSeparator)
+        {
+            p.NextChar();
+        }
+
+        if (commandCount == job.commands.size())
+        {
+            if (job.spareCommands.empty())
+            {
+                job.commands.emplace_back();
+            }
+            else
+            {
+                job.commands.push_back(std::move(job.spareCommands.back()));
+                job.spareCommands.pop_back();
+            }
+        }
+        NextCmd(p, job.commands[commandCount], job.spareArgs);
+        if (!job.commands[commandCount].args.empty())
+        {
+            commandCount++;
+        }
+
+        if (p.CurrentToken() == Token::Pipe)
+        {
+            p.NextChar();
+        }
+        else
+        {
+            break;
+        }
+    }
+    while (job.commands.size() > commandCount)
+    {
+        job.spareCommands.push_back(std::move(job.commands.back()));
+        job.commands.pop_back();
     }
 
-    // OK
-    printf("テスト成功, \"%s\"\n", in);
+    job.redirectFilename.clear();
+    if (p.CurrentToken() == Token::Redirect)
+    {
+        p.NextChar();
+        while (p.CurrentToken() == Token::StrSeparator)
+        {
+            p.NextChar();
+        }
+        ParseStr(p, job.redirectFilename);
+    }
 }
 
-int main()
+// <LIST> の <JOB> の後ろに置かれる <LIST_OP>
+enum class ListOperator
 {
-    // 連続したスペースやトークンの間にスペースが出現する
-    TestParseJob("cmd1 aaa    bbb     | cmd2 |cmd3|cmd4 xxx>out.txt", {{"cmd1", "aaa", "bbb"}, {"cmd2"}, {"cmd3"}, {"cmd4", "xxx"}}, "out.txt");
-    TestParseJob(" cmd1 > out.txt", {{"cmd1"}}, "out.txt");
+    // <LIST> の最後の <JOB>
+    None,
+    // ';'
+    Sequence,
+    // '&'
+    Background,
+    // "&&"
+    And,
+    // "||"
+    Or,
+};
 
-    // パイプの右側にコマンドが存在しない
-    TestParseJob("cmd1|", {{"cmd1"}}, "");
+// <LIST> の 1 つの <JOB> と、その後ろの <LIST_OP>
+struct ListEntry final
+{
+    Job job;
+    ListOperator op = ListOperator::None;
+};
 
-    // パイプの右側にリダイレクトが来る
-    TestParseJob("cmd1|>out.txt", {{"cmd1"}}, "out.txt");
-    TestParseJob("cmd1| > out.txt", {{"cmd1"}}, "out.txt");
+// <LIST> を <JOB> の順に並べたもの
+using CommandList = std::vector<ListEntry>;
 
-    // パイプの左側にコマンドが存在しない
-    TestParseJob("|cmd1", {{"cmd1"}}, "");
+// p の現在の解析位置から '\n' までの <LIST> を解析する
+// コマンドもリダイレクトも存在しない <JOB> は、後ろの <LIST_OP> と一緒に取り除く
+CommandList ParseCommandList(StringToBeParsed &p)
+{
+    CommandList list;
+    while (true)
+    {
+        ListEntry entry{ParseJob(p), ListOperator::None};
 
-    // パイプの左側にリダイレクトが来るとそこで読み込みは終わる
-    TestParseJob("cmd1>out.txt|cmd2", {{"cmd1"}}, "out.txt");
+        // リダイレクト先の後ろなど、ParseJob が読まなかった部分を <LIST_OP> まで読み飛ばす
+        while (p.CurrentToken() != Token::ListSeparator && p.CurrentToken() != Token::End)
+        {
+            p.NextChar();
+        }
+
+        const bool isEnd = p.CurrentToken() == Token::End;
+        if (!isEnd)
+        {
+            const auto c = p.CurrentChar();
+            p.NextChar();
+            if (c == ';')
+            {
+                entry.op = ListOperator::Sequence;
+            }
+            else if (c == '|')
+            {
+                // "||" の 2 文字目を飛ばす
+                entry.op = ListOperator::Or;
+                p.NextChar();
+            }
+            else if (p.CurrentToken() == Token::ListSeparator && p.CurrentChar() == '&')
+            {
+                entry.op = ListOperator::And;
+                p.NextChar();
+            }
+            else
+            {
+                entry.op = ListOperator::Background;
+            }
+        }
+
+        if (!entry.job.commands.empty() || !entry.job.redirectFilename.empty())
+        {
+            list.push_back(std::move(entry));
+        }
+        if (isEnd)
+        {
+            return list;
+        }
+    }
+}
+
+// <JOB> を 1 文字ずつ状態遷移して解析する
+// StringToBeParsed を使う ParseJob と同じ結果になるように、解析した内容を Sink に通知する
+// 前の文字に戻って読み直すことはないので、分割されて届く入力を続きから解析できる
+// Sink には次のメンバ関数が必要になる
+// * OnArgBegin()          : <CMD> の <STR> の開始
+// * OnArgChar(char)       : <CMD> の <STR> の値の 1 文字
+// * OnArgEnd()            : <CMD> の <STR> の終了
+// * OnPipe()              : '|'
+// * OnRedirect()          : '>'
+// * OnRedirectBegin()     : リダイレクト先の <STR> の開始
+// * OnRedirectChar(char)  : リダイレクト先の値の 1 文字
+// * OnListOperator()      : クォーテーションの外の最初の <LIST_OP>
+// * OnJobEnd()            : '\n'
+// ParseJob と同じく、最初の <LIST_OP> から '\n' までは読み飛ばす
+// <LIST> を扱えない Sink は、OnListOperator で後ろの <JOB> が失われることを検出する
+template <typename Sink>
+class JobStateMachine final
+{
+public:
+    // c を解析し、解析した内容を sink に通知する
+    constexpr void Feed(const char c, Sink &sink)
+    {
+        if (c == '\n')
+        {
+            EndLine(sink);
+            return;
+        }
+
+        switch (m_phase)
+        {
+        case Phase::Command:
+        {
+            // '|' が "||" の 1 文字目かどうかは、次の文字を見るまで分からない
+            if (m_pipePending)
+            {
+                m_pipePending = false;
+                if (c == '|')
+                {
+                    EnterList(sink);
+                    return;
+                }
+                sink.OnPipe();
+            }
+
+            if (IsStrChar(c))
+            {
+                if (!m_inStr)
+                {
+                    m_inStr = true;
+                    sink.OnArgBegin();
+                }
+                FeedStr(c, sink);
+                return;
+            }
+
+            if (m_inStr)
+            {
+                m_inStr = false;
+                sink.OnArgEnd();
+            }
+            if (c == '|')
+            {
+                m_pipePending = true;
+            }
+            else if (c == '>')
+            {
+                sink.OnRedirect();
+                m_phase = Phase::RedirectSpaces;
+            }
+            else if (c == ';' || c == '&')
+            {
+                EnterList(sink);
+            }
+            return;
+        }
+        case Phase::RedirectSpaces:
+        {
+            if (c == ' ')
+            {
+                return;
+            }
+            // '>' の後に <STR> が存在しなければ、リダイレクト先は空になる
+            if (IsStrChar(c))
+            {
+                m_phase = Phase::Redirect;
+                sink.OnRedirectBegin();
+                FeedStr(c, sink);
+            }
+            else
+            {
+                m_phase = Phase::Ignore;
+                FeedIgnored(c, sink);
+            }
+            return;
+        }
+        case Phase::Redirect:
+        {
+            if (IsStrChar(c))
+            {
+                FeedStr(c, sink);
+            }
+            else
+            {
+                m_phase = Phase::Ignore;
+                FeedIgnored(c, sink);
+            }
+            return;
+        }
+        case Phase::Ignore:
+        {
+            FeedIgnored(c, sink);
+            return;
+        }
+        case Phase::List:
+        {
+            // <LIST_OP> の後ろは '\n' まで読み飛ばす
+            return;
+        }
+        }
+    };
+
+    // クォーテーションの中や '\' の直後であれば true を返す
+    constexpr bool InQuote() const { return m_quote != QuoteState::None; };
+
+    // 現在の行を '\n' で終わったものとして扱う
+    constexpr void EndLine(Sink &sink)
+    {
+        // "" の中の '\' が行末にある場合は、'\' は値に含まれる
+        if (m_quote == QuoteState::DoubleEscape)
+        {
+            EmitChar('\\', sink);
+        }
+        if (m_inStr && m_phase == Phase::Command)
+        {
+            sink.OnArgEnd();
+        }
+        if (m_pipePending && m_phase == Phase::Command)
+        {
+            sink.OnPipe();
+        }
+        sink.OnJobEnd();
+        *this = JobStateMachine();
+    };
+
+private:
+    enum class Phase
+    {
+        // <CMD> を解析している
+        Command,
+        // '>' の後のスペースを読み飛ばしている
+        RedirectSpaces,
+        // リダイレクト先を解析している
+        Redirect,
+        // リダイレクト先の後ろを、<LIST_OP> を探しながら読み飛ばしている
+        Ignore,
+        // <LIST_OP> の後ろを読み飛ばしている
+        List,
+    };
+
+    constexpr void EnterList(Sink &sink)
+    {
+        m_phase = Phase::List;
+        sink.OnListOperator();
+    };
+
+    // リダイレクト先の後ろの c を読み飛ばす
+    // ParseCommandList と同じく、クォーテーションの中の ';' などは <LIST_OP> として扱わない
+    constexpr void FeedIgnored(const char c, Sink &sink)
+    {
+        if (m_pipePending)
+        {
+            m_pipePending = false;
+            if (c == '|')
+            {
+                EnterList(sink);
+                return;
+            }
+        }
+        if (IsStrChar(c))
+        {
+            // Ignore では値を通知しないので、クォーテーションの状態だけが変わる
+            FeedStr(c, sink);
+        }
+        else if (c == '|')
+        {
+            m_pipePending = true;
+        }
+        else if (c == ';' || c == '&')
+        {
+            EnterList(sink);
+        }
+    };
+
+    // c が <STR> の一部であれば true を返す
+    constexpr bool IsStrChar(const char c) const
+    {
+        return m_quote != QuoteState::None || (c != ' ' && c != '|' && c != '>' && c != ';' && c != '&');
+    };
+
+    // <STR> の一部である c を、クォーテーションとエスケープを取り除いて通知する
+    constexpr void FeedStr(const char c, Sink &sink)
+    {
+        switch (m_quote)
+        {
+        case QuoteState::None:
+            if (c == '\'')
+            {
+                m_quote = QuoteState::Single;
+            }
+            else if (c == '"')
+            {
+                m_quote = QuoteState::Double;
+            }
+            else if (c == '\\')
+            {
+                m_quote = QuoteState::Escape;
+            }
+            else
+            {
+                EmitChar(c, sink);
+            }
+            return;
+        case QuoteState::Single:
+            if (c == '\'')
+            {
+                m_quote = QuoteState::None;
+            }
+            else
+            {
+                EmitChar(c, sink);
+            }
+            return;
+        case QuoteState::Double:
+            if (c == '"')
+            {
+                m_quote = QuoteState::None;
+            }
+            else if (c == '\\')
+            {
+                m_quote = QuoteState::DoubleEscape;
+            }
+            else
+            {
+                EmitChar(c, sink);
+            }
+            return;
+        case QuoteState::Escape:
+            EmitChar(c, sink);
+            m_quote = QuoteState::None;
+            return;
+        case QuoteState::DoubleEscape:
+            // '"' と '\' 以外の前の '\' はエスケープではない
+            if (c != '"' && c != '\\')
+            {
+                EmitChar('\\', sink);
+            }
+            EmitChar(c, sink);
+            m_quote = QuoteState::Double;
+            return;
+        }
+    };
+
+    constexpr void EmitChar(const char c, Sink &sink)
+    {
+        if (m_phase == Phase::Command)
+        {
+            sink.OnArgChar(c);
+        }
+        else if (m_phase == Phase::Redirect)
+        {
+            sink.OnRedirectChar(c);
+        }
+    };
+
+    Phase m_phase = Phase::Command;
+    QuoteState m_quote = QuoteState::None;
+    bool m_inStr = false;
+
+    // クォーテーションの外の '|' の直後
+    bool m_pipePending = false;
+};
+
+// JobStateMachine の通知から Job を組み立てる
+class JobBuilder final
+{
+public:
+    explicit JobBuilder(const Job::allocator_type &alloc = {}) : m_job(alloc){};
+
+    void OnArgBegin()
+    {
+        if (!m_commandOpen)
+        {
+            m_job.commands.emplace_back();
+            m_commandOpen = true;
+        }
+        m_job.commands.back().args.emplace_back();
+    };
+    void OnArgChar(const char c) { m_job.commands.back().args.back() += c; };
+    void OnArgEnd(){};
+    void OnPipe() { m_commandOpen = false; };
+    void OnRedirect() { m_commandOpen = false; };
+    void OnRedirectBegin(){};
+    void OnRedirectChar(const char c) { m_job.redirectFilename += c; };
+    void OnListOperator() { m_hasListOperator = true; };
+    void OnJobEnd() { m_commandOpen = false; };
+
+    // 組み立てている Job の行に <LIST_OP> が存在し、後ろの <JOB> を読み飛ばした場合は true を返す
+    bool HasListOperator() const { return m_hasListOperator; };
+
+    // 組み立てた Job を取り出し、次の Job を組み立てられるようにする
+    Job Take()
+    {
+        Job job(std::move(m_job), m_job.get_allocator());
+        m_job.commands.clear();
+        m_job.redirectFilename.clear();
+        m_hasListOperator = false;
+        return job;
+    };
+
+private:
+    Job m_job;
+
+    // 最後のコマンドに引数を追加できる場合は true
+    bool m_commandOpen = false;
+
+    bool m_hasListOperator = false;
+};
+
+// 任意の位置で分割されて届く入力を、続きから解析するパーサー
+// 受け取った文字は一度だけ調べ、'\n' を受け取るたびに Job を完成させる
+class JobStreamParser final
+{
+public:
+    explicit JobStreamParser(const Job::allocator_type &alloc = {}) : m_builder(alloc){};
+
+    // chunk を解析し、完成した Job ごとに onJob(Job &&) を呼ぶ
+    template <typename F>
+    void Feed(const std::string_view chunk, F &&onJob)
+    {
+        for (const auto c : chunk)
+        {
+            m_machine.Feed(c, m_builder);
+            m_scannedBytes++;
+            m_lineStarted = c != '\n';
+            if (!m_lineStarted)
+            {
+                m_hasListOperator = m_builder.HasListOperator();
+                onJob(m_builder.Take());
+            }
+        }
+    };
+
+    // 入力の終わりに '\n' のない行が残っていれば、その Job を完成させて onJob(Job &&) を呼ぶ
+    template <typename F>
+    void Finish(F &&onJob)
+    {
+        if (m_lineStarted)
+        {
+            m_machine.EndLine(m_builder);
+            m_lineStarted = false;
+            m_hasListOperator = m_builder.HasListOperator();
+            onJob(m_builder.Take());
+        }
+    };
+
+    // onJob に渡している Job の行に <LIST_OP> が存在すれば true を返す
+    // ParseJob と同じく、その Job には最初の <LIST_OP> の前の <JOB> だけが含まれる
+    bool HasListOperator() const { return m_hasListOperator; };
+
+    // これまでに状態機械へ渡した文字数
+    // 途中の行を解析し直すと、受け取った文字数より大きくなる
+    size_t ScannedBytes() const { return m_scannedBytes; };
+
+private:
+    JobStateMachine<JobBuilder> m_machine;
+    JobBuilder m_builder;
+    bool m_lineStarted = false;
+    bool m_hasListOperator = false;
+    size_t m_scannedBytes = 0;
+};
+
+// 固定長の配列だけで表した Job
+// ヒープを使わないので、constexpr な変数にしてコンパイル時にパースできる
+// MaxCommands はコマンド数、MaxArgs はすべてのコマンドの引数の合計、MaxChars はすべての文字列の長さの合計の上限になる
+template <size_t MaxCommands, size_t MaxArgs, size_t MaxChars>
+class StaticJob final
+{
+public:
+    constexpr size_t CommandCount() const { return m_commandCount; };
+
+    constexpr size_t ArgCount(const size_t command) const
+    {
+        return m_commands[command].argEnd - m_commands[command].argBegin;
+    };
+
+    constexpr std::string_view Arg(const size_t command, const size_t index) const
+    {
+        return View(m_args[m_commands[command].argBegin + index]);
+    };
+
+    // リダイレクトが指定されていない場合は空になる
+    constexpr std::string_view RedirectFilename() const { return View(m_redirect); };
+
+    // 実行時に Job に変換する
+    Job ToJob(const Job::allocator_type &alloc = {}) const
+    {
+        Job job(alloc);
+        for (size_t i = 0; i < CommandCount(); i++)
+        {
+            auto &cmd = job.commands.emplace_back();
+            for (size_t j = 0; j < ArgCount(i); j++)
+            {
+                cmd.args.emplace_back(Arg(i, j));
+            }
+        }
+        job.redirectFilename = RedirectFilename();
+        return job;
+    };
+
+private:
+    template <size_t, size_t, size_t>
+    friend class StaticJobBuilder;
+
+    // m_chars の範囲
+    struct Range final
+    {
+        size_t begin = 0;
+        size_t size = 0;
+    };
+
+    // m_args の範囲
+    struct StaticCommand final
+    {
+        size_t argBegin = 0;
+        size_t argEnd = 0;
+    };
+
+    constexpr std::string_view View(const Range &range) const
+    {
+        return std::string_view(m_chars + range.begin, range.size);
+    };
+
+    char m_chars[MaxChars == 0 ? 1 : MaxChars]{};
+    size_t m_charCount = 0;
+    Range m_args[MaxArgs == 0 ? 1 : MaxArgs]{};
+    size_t m_argCount = 0;
+    StaticCommand m_commands[MaxCommands == 0 ? 1 : MaxCommands]{};
+    size_t m_commandCount = 0;
+    Range m_redirect{};
+};
+
+// JobStateMachine の通知から StaticJob を組み立てる
+// 上限を超えた場合や、不正な文字列の場合は std::invalid_argument を投げる
+// constexpr な変数の初期化中に投げられた場合はコンパイルエラーになる
+template <size_t MaxCommands, size_t MaxArgs, size_t MaxChars>
+class StaticJobBuilder final
+{
+public:
+    constexpr void OnArgBegin()
+    {
+        CheckNotEnded();
+        if (!m_commandOpen)
+        {
+            if (m_job.m_commandCount == MaxCommands)
+            {
+                throw std::invalid_argument("コマンドが多すぎます");
+            }
+            m_job.m_commands[m_job.m_commandCount++] = {m_job.m_argCount, m_job.m_argCount};
+            m_commandOpen = true;
+        }
+        if (m_job.m_argCount == MaxArgs)
+        {
+            throw std::invalid_argument("引数が多すぎます");
+        }
+        m_job.m_args[m_job.m_argCount++] = {m_job.m_charCount, 0};
+        m_job.m_commands[m_job.m_commandCount - 1].argEnd = m_job.m_argCount;
+    };
+    constexpr void OnArgChar(const char c)
+    {
+        AppendChar(c);
+        m_job.m_args[m_job.m_argCount - 1].size++;
+    };
+    constexpr void OnArgEnd(){};
+    constexpr void OnPipe()
+    {
+        CheckNotEnded();
+        m_commandOpen = false;
+    };
+    constexpr void OnRedirect()
+    {
+        CheckNotEnded();
+        m_commandOpen = false;
+        m_redirected = true;
+        m_job.m_redirect = {m_job.m_charCount, 0};
+    };
+    // "> ''" のように値が空でも、<STR> があればリダイレクト先は存在する
+    constexpr void OnRedirectBegin() { m_hasRedirectStr = true; };
+    constexpr void OnRedirectChar(const char c)
+    {
+        AppendChar(c);
+        m_job.m_redirect.size++;
+    };
+    constexpr void OnListOperator()
+    {
+        throw std::invalid_argument("';' や \"&&\" などの <LIST_OP> は使えません");
+    };
+    constexpr void OnJobEnd()
+    {
+        CheckNotEnded();
+        if (m_redirected && !m_hasRedirectStr)
+        {
+            throw std::invalid_argument("リダイレクト先が存在しません");
+        }
+        m_ended = true;
+    };
+
+    constexpr const StaticJob<MaxCommands, MaxArgs, MaxChars> &Get() const { return m_job; };
+
+    // '\n' を受け取っていれば true を返す
+    constexpr bool Ended() const { return m_ended; };
+
+private:
+    constexpr void CheckNotEnded() const
+    {
+        if (m_ended)
+        {
+            throw std::invalid_argument("'\\n' の後ろに文字列が存在します");
+        }
+    };
+
+    constexpr void AppendChar(const char c)
+    {
+        if (m_job.m_charCount == MaxChars)
+        {
+            throw std::invalid_argument("文字列が長すぎます");
+        }
+        m_job.m_chars[m_job.m_charCount++] = c;
+    };
+
+    StaticJob<MaxCommands, MaxArgs, MaxChars> m_job{};
+    bool m_commandOpen = false;
+    bool m_redirected = false;
+    bool m_hasRedirectStr = false;
+    bool m_ended = false;
+};
+
+// 文字列リテラルの <JOB> を StaticJob にパースする
+// constexpr な変数を初期化すると、コンパイル時にパースされて実行時のコストもヒープの使用もなくなる
+//     constexpr auto job = ParseStaticJob("sort data.txt | uniq -c > counts.txt");
+// クォーテーションが閉じられていない、'>' の後にリダイレクト先がない、';' などの <LIST_OP> がある、'\n' の後ろに文字がある、
+// 上限を超えるなどの場合は std::invalid_argument を投げるので、constexpr な変数の初期化ではコンパイルエラーになる
+// ParseJob と同じく、"> ''" はリダイレクト先が空のジョブとして受け付ける
+template <size_t MaxCommands = 16, size_t MaxArgs = 64, size_t N>
+constexpr StaticJob<MaxCommands, MaxArgs, N> ParseStaticJob(const char (&s)[N])
+{
+    JobStateMachine<StaticJobBuilder<MaxCommands, MaxArgs, N>> machine;
+    StaticJobBuilder<MaxCommands, MaxArgs, N> builder;
+
+    // 末尾の '\0' は解析しない
+    for (size_t i = 0; i + 1 < N; i++)
+    {
+        // "a\n|" の '|' のように、通知されない文字も受け付けない
+        if (builder.Ended())
+        {
+            throw std::invalid_argument("'\\n' の後ろに文字列が存在します");
+        }
+        // '\n' を渡すと行が終わってクォーテーションの状態も戻るので、先に調べる
+        if (s[i] == '\n' && machine.InQuote())
+        {
+            throw std::invalid_argument("クォーテーションかエスケープが閉じられていません");
+        }
+        machine.Feed(s[i], builder);
+    }
+    if (machine.InQuote())
+    {
+        throw std::invalid_argument("クォーテーションかエスケープが閉じられていません");
+    }
+    // 末尾の '\n' で終わっている場合は、すでに行が完成している
+    if (!builder.Ended())
+    {
+        machine.EndLine(builder);
+    }
+    return builder.Get();
+}
+
+// ParseJobEvents に渡すビジターの基底クラス
+// 必要な関数だけを派生クラスで定義すればよい
+struct JobVisitorBase
+{
+    // 引数が 1 つ以上存在するコマンドの開始
+    void OnCommandBegin(){};
+
+    // コマンドの引数
+    // 呼び出しの間だけ有効な文字列なので、必要であればコピーする
+    void OnArg(std::string_view){};
+
+    // 前のコマンドの出力を、次のコマンドにパイプで渡す
+    // 引数が 1 つ以上存在するコマンドの間でだけ通知される
+    void OnPipe(){};
+
+    // リダイレクト先
+    // 呼び出しの間だけ有効な文字列なので、必要であればコピーする
+    void OnRedirect(std::string_view){};
+
+    void OnJobEnd(){};
+};
+
+// p の現在の解析位置から <STR> を取得し、値を返す
+// クォーテーションもエスケープも含まない場合は p の文字列をそのまま参照し、含む場合は scratch に値を作る
+std::string_view ParseStrView(StringToBeParsed &p, std::string &scratch)
+{
+    const auto begin = p.Position();
+    bool hasSyntax = false;
+    while (p.CurrentToken() == Token::Str)
+    {
+        if (p.IsQuoteSyntax() && !hasSyntax)
+        {
+            // ここまでの値を scratch に移し、以降は 1 文字ずつ追加する
+            hasSyntax = true;
+            scratch.assign(p.String(), begin, p.Position() - begin);
+        }
+        else if (hasSyntax && !p.IsQuoteSyntax())
+        {
+            scratch += p.CurrentChar();
+        }
+        p.NextChar();
+    }
+
+    if (hasSyntax)
+    {
+        return scratch;
+    }
+    return std::string_view(p.String()).substr(begin, p.Position() - begin);
+}
+
+// ParseJob と同じように p を解析し、Job を作らずに内容を visitor に通知する
+// visitor は JobVisitorBase を継承したクラスで、テンプレートなので呼び出しはインライン展開される
+template <typename Visitor>
+void ParseJobEvents(StringToBeParsed &p, Visitor &&visitor)
+{
+    // クォーテーションを含む <STR> の値を作るための領域
+    std::string scratch;
+    bool hasCommand = false;
+
+    // <CMD> をすべて読み込む
+    while (true)
+    {
+        // <STR> をすべて読み込む
+        bool commandBegan = false;
+        while (true)
+        {
+            // 連続するスペースを飛ばす
+            while (p.CurrentToken() == Token::StrSeparator)
+            {
+                p.NextChar();
+            }
+
+            // '' のように、値が空文字列の <STR> も存在する
+            const auto begin = p.Position();
+            const auto arg = ParseStrView(p, scratch);
+            if (p.Position() != begin)
+            {
+                if (!commandBegan)
+                {
+                    if (hasCommand)
+                    {
+                        visitor.OnPipe();
+                    }
+                    visitor.OnCommandBegin();
+                    commandBegan = true;
+                    hasCommand = true;
+                }
+                visitor.OnArg(arg);
+            }
+
+            if (p.CurrentToken() != Token::StrSeparator)
+            {
+                break;
+            }
+        }
+
+        // '|' が存在するなら次の <CMD> が存在するかもしれないので続行する
+        if (p.CurrentToken() != Token::Pipe)
+        {
+            break;
+        }
+        p.NextChar();
+    }
+
+    // リダイレクトを読み込む
+    if (p.CurrentToken() == Token::Redirect)
+    {
+        p.NextChar();
+        while (p.CurrentToken() == Token::StrSeparator)
+        {
+            p.NextChar();
+        }
+        visitor.OnRedirect(ParseStrView(p, scratch));
+    }
+
+    visitor.OnJobEnd();
+}
+
+// ParseJobFixed の結果
+enum class FixedParseResult
+{
+    Ok,
+    // コマンドが MaxCommands を超えた
+    TooManyCommands,
+    // 1 つのコマンドの引数が MaxArgs を超えた
+    TooManyArgs,
+    // ';' などの <LIST_OP> が存在し、後ろの <JOB> を解析できない
+    ListOperator,
+};
+
+// 固定長の配列だけで表した Job
+// 引数とリダイレクト先は、ParseJobFixed に渡した文字列の範囲を指す
+template <size_t MaxCommands, size_t MaxArgs>
+struct FixedJob final
+{
+    struct FixedCommand final
+    {
+        std::string_view args[MaxArgs];
+        size_t argCount = 0;
+    };
+
+    FixedCommand commands[MaxCommands];
+    size_t commandCount = 0;
+
+    // リダイレクトが指定されていない場合は空になる
+    std::string_view redirectFilename;
+};
+
+// JobStateMachine の通知から、文字列を書き換えて FixedJob を組み立てる
+// クォーテーションを取り除いた値は元の文字列より長くならないので、元の文字列の先頭から上書きしていく
+template <size_t MaxCommands, size_t MaxArgs>
+class FixedJobBuilder final
+{
+public:
+    FixedJobBuilder(char *buffer, FixedJob<MaxCommands, MaxArgs> &job) : m_buffer(buffer), m_job(job){};
+
+    void OnArgBegin()
+    {
+        if (m_result != FixedParseResult::Ok)
+        {
+            return;
+        }
+        if (!m_commandOpen)
+        {
+            if (m_job.commandCount == MaxCommands)
+            {
+                m_result = FixedParseResult::TooManyCommands;
+                return;
+            }
+            m_job.commands[m_job.commandCount++].argCount = 0;
+            m_commandOpen = true;
+        }
+        auto &cmd = m_job.commands[m_job.commandCount - 1];
+        if (cmd.argCount == MaxArgs)
+        {
+            m_result = FixedParseResult::TooManyArgs;
+            return;
+        }
+        cmd.args[cmd.argCount++] = std::string_view(m_buffer + m_written, 0);
+    };
+    void OnArgChar(const char c)
+    {
+        if (m_result == FixedParseResult::Ok)
+        {
+            auto &arg = m_job.commands[m_job.commandCount - 1].args[m_job.commands[m_job.commandCount - 1].argCount - 1];
+            m_buffer[m_written++] = c;
+            arg = std::string_view(arg.data(), arg.size() + 1);
+        }
+    };
+    void OnArgEnd(){};
+    void OnPipe() { m_commandOpen = false; };
+    void OnRedirect()
+    {
+        m_commandOpen = false;
+        m_job.redirectFilename = std::string_view(m_buffer + m_written, 0);
+    };
+    void OnRedirectBegin(){};
+    void OnRedirectChar(const char c)
+    {
+        if (m_result == FixedParseResult::Ok)
+        {
+            m_buffer[m_written++] = c;
+            m_job.redirectFilename = std::string_view(m_job.redirectFilename.data(), m_job.redirectFilename.size() + 1);
+        }
+    };
+    void OnListOperator()
+    {
+        if (m_result == FixedParseResult::Ok)
+        {
+            m_result = FixedParseResult::ListOperator;
+        }
+    };
+    void OnJobEnd(){};
+
+    FixedParseResult Result() const { return m_result; };
+
+private:
+    char *m_buffer;
+    size_t m_written = 0;
+    FixedJob<MaxCommands, MaxArgs> &m_job;
+    bool m_commandOpen = false;
+    FixedParseResult m_result = FixedParseResult::Ok;
+};
+
+// line の size 文字を ParseJob と同じように解析し、結果を job に書き込む
+// ParseJob と同じく最初の '\n' までを 1 つの <JOB> として解析し、'\n' の後ろは "a\n|" の '|' なども含めて読まない
+// メモリを確保せず、例外も投げないので、fork 後の子プロセスやシグナルハンドラの中でも使える
+// クォーテーションやエスケープを取り除くために line を書き換え、job の文字列は line の範囲を指す
+// コマンド数や引数の数が上限を超えた場合や、<LIST_OP> が存在する場合は、その時点までの内容を job に残してエラーを返す
+template <size_t MaxCommands, size_t MaxArgs>
+FixedParseResult ParseJobFixed(char *line, const size_t size, FixedJob<MaxCommands, MaxArgs> &job) noexcept
+{
+    job.commandCount = 0;
+    job.redirectFilename = {};
+
+    JobStateMachine<FixedJobBuilder<MaxCommands, MaxArgs>> machine;
+    FixedJobBuilder<MaxCommands, MaxArgs> builder(line, job);
+    for (size_t i = 0; i < size && line[i] != '\n' && builder.Result() == FixedParseResult::Ok; i++)
+    {
+        machine.Feed(line[i], builder);
+    }
+    machine.EndLine(builder);
+    return builder.Result();
+}
+
+// line の中の、クォーテーションの外にある '|' の位置を SIMD で求める
+// 最初のクォーテーションの外の '>' か <LIST_OP> か、最初の '\n' か、文字列末尾で探索を終え、その位置を end に設定する
+std::vector<size_t> FindUnquotedPipes(const std::string_view line, const QuoteMasks &masks, size_t &end)
+{
+    std::vector<size_t> pipes;
+    end = line.size();
+
+    // 前のブロックの最後の文字がクォーテーションの外の '|' であれば true
+    bool pipeAtBlockEnd = false;
+    for (size_t block = 0; block * 64 < line.size(); block++)
+    {
+        const char *p = line.data() + block * 64;
+        char tail[64];
+        if (line.size() - block * 64 < 64)
+        {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p, line.size() - block * 64);
+            p = tail;
+        }
+
+        // '\n' はクォーテーションの中でも終端になる
+        const auto unquoted = ~masks[2 * block];
+        auto blockPipes = MatchMask(p, '|') & unquoted;
+
+        // "||" はブロックの境界をまたぐ場合がある
+        if (pipeAtBlockEnd && (blockPipes & 1))
+        {
+            pipes.pop_back();
+            end = block * 64 - 1;
+            break;
+        }
+        pipeAtBlockEnd = blockPipes >> 63;
+
+        // "||" は 1 文字目の位置で終わる
+        const auto orOperators = blockPipes & (blockPipes >> 1);
+        const auto terminators = ((MatchMask(p, '>') | MatchMask(p, ';') | MatchMask(p, '&')) & unquoted) | orOperators | MatchMask(p, '\n');
+        if (terminators != 0)
+        {
+            const unsigned first = __builtin_ctzll(terminators);
+            blockPipes &= (uint64_t(1) << first) - 1;
+            end = block * 64 + first;
+        }
+
+        while (blockPipes != 0)
+        {
+            pipes.push_back(block * 64 + __builtin_ctzll(blockPipes));
+            blockPipes &= blockPipes - 1;
+        }
+        if (terminators != 0)
+        {
+            break;
+        }
+    }
+    return pipes;
+}
+
+// 1 行がとても長い場合に、<CMD> ごとに並列にパースする
+// SIMD でクォーテーションの外の '|' と '>' と <LIST_OP> を探し、その間を別々のスレッドで NextCmd でパースして連結する
+// 結果は ParseJob と同じになる
+// threadCount が 1 以下の場合や '|' が存在しない場合は、ParseJob で直列にパースする
+Job ParseJobParallel(const std::string_view line, unsigned threadCount = std::thread::hardware_concurrency())
+{
+    const auto masks = BuildQuoteMasks(line);
+    size_t end = 0;
+    const auto pipes = FindUnquotedPipes(line, masks, end);
+    if (threadCount <= 1 || pipes.empty())
+    {
+        StringToBeParsed str(line);
+        return ParseJob(str);
+    }
+
+    // '|' の位置で区切った <CMD> の範囲
+    // '|' はクォーテーションの外にあるので、それぞれの範囲はクォーテーションの外から始まる
+    std::vector<std::pair<size_t, size_t>> segments;
+    size_t begin = 0;
+    for (const auto pipe : pipes)
+    {
+        segments.emplace_back(begin, pipe);
+        begin = pipe + 1;
+    }
+    segments.emplace_back(begin, end);
+
+    std::vector<Command> commands(segments.size());
+    const auto parseSegments = [&](const size_t first, const size_t last) {
+        for (size_t i = first; i < last; i++)
+        {
+            StringToBeParsed str(line.substr(segments[i].first, segments[i].second - segments[i].first));
+            while (str.CurrentToken() == Token::StrSeparator)
+            {
+                str.NextChar();
+            }
+            commands[i] = NextCmd(str);
+        }
+    };
+
+    // 連続した範囲をスレッドごとに割り当てる
+    threadCount = std::min<size_t>(threadCount, segments.size());
+    std::vector<std::thread> threads;
+    const size_t perThread = (segments.size() + threadCount - 1) / threadCount;
+    for (size_t first = perThread; first < segments.size(); first += perThread)
+    {
+        threads.emplace_back(parseSegments, first, std::min(first + perThread, segments.size()));
+    }
+    parseSegments(0, std::min(perThread, segments.size()));
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    Job job;
+    for (auto &cmd : commands)
+    {
+        if (!cmd.args.empty())
+        {
+            job.commands.push_back(std::move(cmd));
+        }
+    }
+
+    // リダイレクトを読み込む
+    if (end < line.size() && line[end] == '>')
+    {
+        StringToBeParsed str(line.substr(end + 1));
+        while (str.CurrentToken() == Token::StrSeparator)
+        {
+            str.NextChar();
+        }
+        job.redirectFilename = ParseStr(str);
+    }
+    return job;
+}
+
+// StringInterner に登録された文字列を指すハンドル
+// 同じ StringInterner から得たハンドルは、ポインタの比較だけで等しいか判定できる
+class InternedString final
+{
+public:
+    InternedString() = default;
+    explicit InternedString(const std::string_view *entry) : m_entry(entry){};
+
+    std::string_view View() const { return m_entry == nullptr ? std::string_view() : *m_entry; };
+
+    bool operator==(const InternedString &other) const { return m_entry == other.m_entry; };
+    bool operator!=(const InternedString &other) const { return m_entry != other.m_entry; };
+
+private:
+    // 空文字列は nullptr で表す
+    const std::string_view *m_entry = nullptr;
+};
+
+// 同じ文字列を 1 つだけ保持する表
+// 登録した文字列は StringInterner を破棄するまで移動しないので、ハンドルはそれまで有効になる
+// 複数のスレッドから同時に使える
+class StringInterner final
+{
+public:
+    StringInterner() = default;
+    StringInterner(const StringInterner &) = delete;
+    StringInterner &operator=(const StringInterner &) = delete;
+
+    // s を登録し、そのハンドルを返す
+    // すでに登録されている場合は、登録済みの文字列のハンドルを返す
+    InternedString Intern(const std::string_view s)
+    {
+        m_requestedBytes.fetch_add(s.size(), std::memory_order_relaxed);
+        if (s.empty())
+        {
+            return InternedString();
+        }
+
+        auto &shard = m_shards[std::hash<std::string_view>()(s) % m_shards.size()];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto it = shard.entries.find(s);
+        if (it != shard.entries.end())
+        {
+            return InternedString(&*it);
+        }
+
+        // 文字列はまとめて確保した領域に格納し、表にはその領域を指す string_view を登録する
+        if (shard.chunks.empty() || shard.chunkUsed + s.size() > shard.chunkSize)
+        {
+            shard.chunkSize = std::max<size_t>(s.size(), 64 * 1024);
+            shard.chunks.push_back(std::make_unique<char[]>(shard.chunkSize));
+            shard.chunkBytes += shard.chunkSize;
+            shard.chunkUsed = 0;
+        }
+        char *data = shard.chunks.back().get() + shard.chunkUsed;
+        memcpy(data, s.data(), s.size());
+        shard.chunkUsed += s.size();
+        m_storedBytes.fetch_add(s.size(), std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        return InternedString(&*shard.entries.emplace(data, s.size()).first);
+    };
+
+    // Intern に渡された文字列の長さの合計
+    size_t RequestedBytes() const { return m_requestedBytes.load(std::memory_order_relaxed); };
+
+    // 登録されている異なる文字列の長さの合計
+    size_t StoredBytes() const { return m_storedBytes.load(std::memory_order_relaxed); };
+
+    // 登録されている異なる文字列の数
+    size_t Count() const { return m_count.load(std::memory_order_relaxed); };
+
+    // 文字列を格納した領域と、表のバケットと要素が使っているおおよそのバイト数
+    // 要素 1 つあたり、次の要素へのポインタとキャッシュされたハッシュ値も使うものとして数える
+    size_t FootprintBytes()
+    {
+        constexpr size_t nodeBytes = sizeof(void *) + sizeof(std::string_view) + sizeof(size_t);
+        size_t bytes = sizeof(*this);
+        for (auto &shard : m_shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            bytes += shard.chunkBytes + shard.chunks.capacity() * sizeof(shard.chunks[0]);
+            bytes += shard.entries.bucket_count() * sizeof(void *) + shard.entries.size() * nodeBytes;
+        }
+        return bytes;
+    };
+
+private:
+    // ロックの競合を減らすため、ハッシュ値でシャードに分ける
+    struct Shard final
+    {
+        std::mutex mutex;
+        // unordered_set の要素のアドレスは再ハッシュしても変わらないので、ハンドルに使える
+        std::unordered_set<std::string_view> entries;
+        std::vector<std::unique_ptr<char[]>> chunks;
+        size_t chunkSize = 0;
+        size_t chunkUsed = 0;
+        // chunks の領域の合計
+        size_t chunkBytes = 0;
+    };
+
+    std::array<Shard, 16> m_shards;
+    std::atomic<size_t> m_requestedBytes{0};
+    std::atomic<size_t> m_storedBytes{0};
+    std::atomic<size_t> m_count{0};
+};
+
+// 文字列を StringInterner に登録した Job
+// 同じ StringInterner から作った InternedJob は、文字列をポインタで比較できる
+struct InternedJob final
+{
+    std::vector<std::vector<InternedString>> commands;
+    InternedString redirectFilename;
+
+    bool operator==(const InternedJob &other) const
+    {
+        return redirectFilename == other.redirectFilename && commands == other.commands;
+    };
+    bool operator!=(const InternedJob &other) const { return !(*this == other); };
+};
+
+// job の引数とリダイレクト先を interner に登録する
+InternedJob InternJob(const Job &job, StringInterner &interner)
+{
+    InternedJob interned;
+    interned.commands.reserve(job.commands.size());
+    for (const auto &cmd : job.commands)
+    {
+        auto &args = interned.commands.emplace_back();
+        args.reserve(cmd.args.size());
+        for (const auto &arg : cmd.args)
+        {
+            args.push_back(interner.Intern(arg));
+        }
+    }
+    interned.redirectFilename = interner.Intern(job.redirectFilename);
+    return interned;
+}
+
+bool operator==(const Command &a, const Command &b)
+{
+    return a.args == b.args;
+}
+
+bool operator!=(const Command &a, const Command &b)
+{
+    return !(a == b);
+}
+
+bool operator==(const Job &a, const Job &b)
+{
+    return a.redirectFilename == b.redirectFilename && a.commands == b.commands;
+}
+
+bool operator!=(const Job &a, const Job &b)
+{
+    return !(a == b);
+}
+
+// wyhash (final4) の方式で計算する 64 ビットのハッシュ値
+// 64 ビットの乗算を使い、一度に 48 バイトずつ処理する
+namespace wyhash
+{
+constexpr uint64_t secret[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+
+inline void Mum(uint64_t &a, uint64_t &b)
+{
+    const auto r = static_cast<unsigned __int128>(a) * b;
+    a = static_cast<uint64_t>(r);
+    b = static_cast<uint64_t>(r >> 64);
+}
+
+inline uint64_t Mix(uint64_t a, uint64_t b)
+{
+    Mum(a, b);
+    return a ^ b;
+}
+
+inline uint64_t Read8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t Read4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint64_t Hash(const void *data, const size_t len, uint64_t seed = 0)
+{
+    auto p = static_cast<const uint8_t *>(data);
+    seed ^= Mix(seed ^ secret[0], secret[1]);
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = (Read4(p) << 32) | Read4(p + ((len >> 3) << 2));
+            b = (Read4(p + len - 4) << 32) | Read4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[len >> 1]) << 8) | p[len - 1];
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i > 48)
+        {
+            auto seed1 = seed;
+            auto seed2 = seed;
+            do
+            {
+                seed = Mix(Read8(p) ^ secret[1], Read8(p + 8) ^ seed);
+                seed1 = Mix(Read8(p + 16) ^ secret[2], Read8(p + 24) ^ seed1);
+                seed2 = Mix(Read8(p + 32) ^ secret[3], Read8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16)
+        {
+            seed = Mix(Read8(p) ^ secret[1], Read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = Read8(p + i - 16);
+        b = Read8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    Mum(a, b);
+    return Mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+} // namespace wyhash
+
+// n を 4 バイトのリトルエンディアンで p に書き込み、次の位置を返す
+inline char *WriteU32(char *p, const uint32_t n)
+{
+    p[0] = static_cast<char>(n);
+    p[1] = static_cast<char>(n >> 8);
+    p[2] = static_cast<char>(n >> 16);
+    p[3] = static_cast<char>(n >> 24);
+    return p + 4;
+}
+
+// s を長さの後に続けて p に書き込み、次の位置を返す
+inline char *WriteLengthPrefixed(char *p, const std::string_view s)
+{
+    p = WriteU32(p, s.size());
+    memcpy(p, s.data(), s.size());
+    return p + s.size();
+}
+
+// job を一意なバイト列にして out に追加する
+// リダイレクト先、コマンド数、各コマンドの引数の数の順に並べ、各文字列には長さを前に置くので、異なる Job が同じバイト列になることはない
+// パースした Job なので、元の文字列の空白の数の違いは含まれない
+void AppendCanonicalEncoding(const Job &job, std::string &out)
+{
+    // 先に全体の長さを求め、一度だけ伸ばしてから書き込む
+    size_t size = 4 + 4 + job.redirectFilename.size();
+    for (const auto &cmd : job.commands)
+    {
+        size += 4 + 4 * cmd.args.size();
+        for (const auto &arg : cmd.args)
+        {
+            size += arg.size();
+        }
+    }
+    const auto offset = out.size();
+    out.resize(offset + size);
+
+    // 可変長のコマンドを読み飛ばさずにリダイレクト先を取り出せるように、リダイレクト先を先に置く
+    auto p = WriteLengthPrefixed(out.data() + offset, job.redirectFilename);
+    p = WriteU32(p, job.commands.size());
+    for (const auto &cmd : job.commands)
+    {
+        p = WriteU32(p, cmd.args.size());
+        for (const auto &arg : cmd.args)
+        {
+            p = WriteLengthPrefixed(p, arg);
+        }
+    }
+}
+
+// job のすべての引数、パイプの構造、リダイレクト先から計算したハッシュ値を返す
+// 空白の数だけが異なる文字列をパースした Job は、同じハッシュ値になる
+uint64_t HashJob(const Job &job)
+{
+    // 毎回確保しないように、スレッドごとの領域を再利用する
+    thread_local std::string encoded;
+    encoded.clear();
+    AppendCanonicalEncoding(job, encoded);
+    return wyhash::Hash(encoded.data(), encoded.size());
+}
+
+// ハッシュ値を一緒に保持する Job
+// 比較するときはハッシュ値を先に比較し、異なれば中身を比較しない
+struct HashedJob final
+{
+    explicit HashedJob(Job j) : job(std::move(j)), hash(HashJob(job)){};
+
+    bool operator==(const HashedJob &other) const { return hash == other.hash && job == other.job; };
+    bool operator!=(const HashedJob &other) const { return !(*this == other); };
+
+    // 代入とムーブができるように const にはしないので、job を変更した場合は hash も計算し直す
+    Job job;
+    uint64_t hash;
+};
+
+namespace std
+{
+template <>
+struct hash<Job>
+{
+    size_t operator()(const Job &job) const { return HashJob(job); };
+};
+
+template <>
+struct hash<HashedJob>
+{
+    size_t operator()(const HashedJob &job) const { return job.hash; };
+};
+} // namespace std
+
+// 4 バイトのリトルエンディアンで書かれた数値を読み出す
+inline uint32_t ReadU32(const char *p)
+{
+    const auto u = reinterpret_cast<const unsigned char *>(p);
+    return static_cast<uint32_t>(u[0]) | (static_cast<uint32_t>(u[1]) << 8) | (static_cast<uint32_t>(u[2]) << 16) |
+           (static_cast<uint32_t>(u[3]) << 24);
+}
+
+// job を長さ付きのバイナリ形式で out に追加する
+// 形式は [レコードのバイト数][AppendCanonicalEncoding のバイト列] で、
+// レコードを並べたファイルを mmap し、EncodedJobReader でコピーせずに読み出せる
+void AppendEncodedJob(const Job &job, std::string &out)
+{
+    const auto offset = out.size();
+    out.resize(offset + 4);
+    AppendCanonicalEncoding(job, out);
+    WriteU32(out.data() + offset, out.size() - offset - 4);
+}
+
+// バイナリ形式の 1 つのコマンド
+// 引数は元のバッファを指す string_view として取り出す
+class EncodedCommand final
+{
+public:
+    class Iterator final
+    {
+    public:
+        Iterator(const char *p, const uint32_t remaining) : m_p(p), m_remaining(remaining){};
+
+        std::string_view operator*() const { return std::string_view(m_p + 4, ReadU32(m_p)); };
+        Iterator &operator++()
+        {
+            m_p += 4 + ReadU32(m_p);
+            m_remaining--;
+            return *this;
+        };
+        bool operator==(const Iterator &other) const { return m_remaining == other.m_remaining; };
+        bool operator!=(const Iterator &other) const { return !(*this == other); };
+
+    private:
+        const char *m_p;
+        uint32_t m_remaining;
+    };
+
+    EncodedCommand(const char *args, const uint32_t argCount) : m_args(args), m_argCount(argCount){};
+
+    size_t ArgCount() const { return m_argCount; };
+    Iterator begin() const { return Iterator(m_args, m_argCount); };
+    Iterator end() const { return Iterator(nullptr, 0); };
+
+private:
+    const char *m_args;
+    uint32_t m_argCount;
+};
+
+// バイナリ形式の 1 つの Job
+// EncodedJobReader が範囲を検証したバッファを指し、バッファより長く使ってはいけない
+class EncodedJob final
+{
+public:
+    class Iterator final
+    {
+    public:
+        Iterator(const char *p, const uint32_t remaining) : m_p(p), m_remaining(remaining){};
+
+        EncodedCommand operator*() const { return EncodedCommand(m_p + 4, ReadU32(m_p)); };
+        Iterator &operator++()
+        {
+            // 引数の長さをたどって次のコマンドへ進む
+            auto argCount = ReadU32(m_p);
+            m_p += 4;
+            for (; argCount > 0; argCount--)
+            {
+                m_p += 4 + ReadU32(m_p);
+            }
+            m_remaining--;
+            return *this;
+        };
+        bool operator==(const Iterator &other) const { return m_remaining == other.m_remaining; };
+        bool operator!=(const Iterator &other) const { return !(*this == other); };
+
+    private:
+        const char *m_p;
+        uint32_t m_remaining;
+    };
+
+    EncodedJob() = default;
+    explicit EncodedJob(const std::string_view bytes) : m_bytes(bytes){};
+
+    size_t CommandCount() const { return ReadU32(m_bytes.data() + 4 + RedirectFilename().size()); };
+    Iterator begin() const { return Iterator(m_bytes.data() + 8 + RedirectFilename().size(), CommandCount()); };
+    Iterator end() const { return Iterator(nullptr, 0); };
+
+    std::string_view RedirectFilename() const { return std::string_view(m_bytes.data() + 4, ReadU32(m_bytes.data())); };
+
+    // AppendCanonicalEncoding と同じバイト列
+    std::string_view Bytes() const { return m_bytes; };
+
+    // HashJob と同じハッシュ値
+    uint64_t Hash() const { return wyhash::Hash(m_bytes.data(), m_bytes.size()); };
+
+    // Job に戻す
+    Job ToJob(const Job::allocator_type &alloc = {}) const
+    {
+        Job job(alloc);
+        job.redirectFilename = RedirectFilename();
+        job.commands.reserve(CommandCount());
+        for (const auto &encodedCmd : *this)
+        {
+            auto &cmd = job.commands.emplace_back();
+            cmd.args.reserve(encodedCmd.ArgCount());
+            for (const auto arg : encodedCmd)
+            {
+                cmd.args.emplace_back(arg);
+            }
+        }
+        return job;
+    };
+
+private:
+    std::string_view m_bytes;
+};
+
+// AppendEncodedJob で書き込んだレコードの並びを、先頭から順に読み出す
+// 読み出すときにレコードの範囲を検証し、壊れている場合は std::runtime_error を投げる
+class EncodedJobReader final
+{
+public:
+    explicit EncodedJobReader(const std::string_view data) : m_data(data){};
+
+    // 次の Job を job に設定する
+    // 終わりに達した場合は false を返す
+    bool Next(EncodedJob &job)
+    {
+        if (m_pos == m_data.size())
+        {
+            return false;
+        }
+        const auto rest = m_data.size() - m_pos;
+        if (rest < 4 || ReadU32(m_data.data() + m_pos) > rest - 4)
+        {
+            throw std::runtime_error("エンコードされた Job のレコードが途中で終わっています");
+        }
+        const auto record = m_data.substr(m_pos + 4, ReadU32(m_data.data() + m_pos));
+        Validate(record);
+        job = EncodedJob(record);
+        m_pos += 4 + record.size();
+        return true;
+    };
+
+    // 次に読み出すレコードの位置
+    size_t Position() const { return m_pos; };
+
+private:
+    // record の中のすべての長さが、record の範囲に収まっていることを確認する
+    static void Validate(const std::string_view record)
+    {
+        size_t pos = 0;
+        const auto readU32 = [&] {
+            if (record.size() - pos < 4)
+            {
+                throw std::runtime_error("エンコードされた Job が壊れています");
+            }
+            const auto n = ReadU32(record.data() + pos);
+            pos += 4;
+            return n;
+        };
+        const auto skip = [&](const uint32_t n) {
+            if (record.size() - pos < n)
+            {
+                throw std::runtime_error("エンコードされた Job が壊れています");
+            }
+            pos += n;
+        };
+
+        skip(readU32());
+        for (auto commandCount = readU32(); commandCount > 0; commandCount--)
+        {
+            for (auto argCount = readU32(); argCount > 0; argCount--)
+            {
+                skip(readU32());
+            }
+        }
+        if (pos != record.size())
+        {
+            throw std::runtime_error("エンコードされた Job の後ろに余分なバイトがあります");
+        }
+    };
+
+    std::string_view m_data;
+    size_t m_pos = 0;
+};
+
+// ファイルを読み込み専用で mmap する
+// 開けない場合は std::runtime_error を投げる
+class MappedFile final
+{
+public:
+    explicit MappedFile(const std::filesystem::path &path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            throw std::runtime_error("ファイルを開けませんでした, " + path.string() + ", " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+        {
+            const auto error = errno;
+            close(fd);
+            throw std::runtime_error("ファイルの情報を取得できませんでした, " + path.string() + ", " + strerror(error));
+        }
+        m_size = st.st_size;
+        if (m_size > 0)
+        {
+            void *map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+            {
+                const auto error = errno;
+                close(fd);
+                throw std::runtime_error(std::string("mmap に失敗しました, ") + strerror(error));
+            }
+            m_map = map;
+        }
+        // mmap した後はファイルディスクリプタは不要
+        close(fd);
+    };
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile()
+    {
+        if (m_map != nullptr)
+        {
+            munmap(m_map, m_size);
+        }
+    };
+
+    std::string_view View() const { return m_map == nullptr ? std::string_view() : std::string_view(static_cast<const char *>(m_map), m_size); };
+
+private:
+    void *m_map = nullptr;
+    size_t m_size = 0;
+};
+
+// 同じ文字列のパース結果を再利用するキャッシュ
+// 文字列のハッシュ値をキーにして、変更できない Job を共有する
+// 複数のスレッドから同時に使える
+// 保持する件数が capacity を超えた場合は、最も長く使われていないものから削除する
+class ParseJobCache final
+{
+public:
+    explicit ParseJobCache(const size_t capacity)
+        : m_shards(std::clamp<size_t>(capacity / 64, 1, 16))
+    {
+        // 各シャードの上限の合計が capacity を超えないようにする
+        for (auto &shard : m_shards)
+        {
+            shard.capacity = std::max<size_t>(capacity / m_shards.size(), 1);
+        }
+    };
+
+    // line をパースした結果を返す
+    // キャッシュに存在しない場合はパースしてキャッシュに追加する
+    std::shared_ptr<const Job> Parse(const std::string_view line)
+    {
+        const auto hash = std::hash<std::string_view>()(line);
+        auto &shard = m_shards[hash % m_shards.size()];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            const auto it = shard.index.find(hash);
+            // ハッシュ値が衝突している場合は、文字列も比較して確認する
+            if (it != shard.index.end() && it->second->line == line)
+            {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                m_hits.fetch_add(1, std::memory_order_relaxed);
+                return it->second->job;
+            }
+        }
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+
+        // パースしている間は他のスレッドを待たせない
+        StringToBeParsed str(line);
+        std::shared_ptr<const Job> job = std::make_shared<const Job>(ParseJob(str));
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto it = shard.index.find(hash);
+        if (it != shard.index.end())
+        {
+            // 別のスレッドが追加した、もしくは衝突した古いものを置き換える
+            shard.lru.erase(it->second);
+            shard.index.erase(it);
+        }
+        else if (shard.lru.size() >= shard.capacity)
+        {
+            shard.index.erase(shard.lru.back().hash);
+            shard.lru.pop_back();
+        }
+        shard.lru.push_front(Entry{hash, std::string(line), job});
+        shard.index.emplace(hash, shard.lru.begin());
+        return job;
+    };
+
+    uint64_t Hits() const { return m_hits.load(std::memory_order_relaxed); };
+    uint64_t Misses() const { return m_misses.load(std::memory_order_relaxed); };
+
+    // ヒット率を返す
+    // まだ一度も使われていない場合は 0 を返す
+    double HitRate() const
+    {
+        const auto hits = Hits();
+        const auto total = hits + Misses();
+        return total == 0 ? 0 : static_cast<double>(hits) / total;
+    };
+
+private:
+    struct Entry final
+    {
+        size_t hash;
+        std::string line;
+        std::shared_ptr<const Job> job;
+    };
+
+    // ロックの競合を減らすため、ハッシュ値でシャードに分ける
+    struct Shard final
+    {
+        std::mutex mutex;
+        size_t capacity = 0;
+
+        // 先頭ほど最近使われている
+        std::list<Entry> lru;
+        std::unordered_map<size_t, std::list<Entry>::iterator> index;
+    };
+
+    std::vector<Shard> m_shards;
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+};
+
+// dir の中に実行できる name が存在すればそのパスを返す
+// 存在しない場合は空文字列を返す
+std::string FindExecutableIn(const std::string_view dir, const std::string_view name)
+{
+    // $PATH の空の要素はカレントディレクトリを表す
+    std::string candidate(dir.empty() ? "." : dir);
+    candidate += '/';
+    candidate += name;
+
+    struct stat st;
+    if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0)
+    {
+        return candidate;
+    }
+    return {};
+}
+
+// path を ':' で区切ったディレクトリの一覧を返す
+std::vector<std::string> SplitPath(const std::string_view path)
+{
+    std::vector<std::string> dirs;
+    size_t begin = 0;
+    while (true)
+    {
+        const auto end = path.find(':', begin);
+        dirs.emplace_back(path.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin));
+        if (end == std::string_view::npos)
+        {
+            return dirs;
+        }
+        begin = end + 1;
+    }
+}
+
+// $PATH の書式の path から name を検索し、実行ファイルのパスを返す
+// name に '/' が含まれる場合は検索せずにそのまま返す
+// 見つからない場合は空文字列を返す
+std::string FindExecutable(const std::string_view name, const std::string_view path)
+{
+    if (name.find('/') != std::string_view::npos)
+    {
+        return std::string(name);
+    }
+    for (const auto &dir : SplitPath(path))
+    {
+        auto found = FindExecutableIn(dir, name);
+        if (!found.empty())
+        {
+            return found;
+        }
+    }
+    return {};
+}
+
+// コマンド名から実行ファイルのパスを求めるキャッシュ
+// bash の hash 組み込みコマンドのように、$PATH を検索した結果を覚えておく
+// $PATH のディレクトリを inotify で監視し、ファイルの追加や削除があればキャッシュを破棄する
+// inotify を使えない場合は、ディレクトリの更新時刻が変わったときに破棄する
+// 複数のスレッドから同時に使える
+class PathCache final
+{
+public:
+    PathCache() : m_inotifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)){};
+    PathCache(const PathCache &) = delete;
+    PathCache &operator=(const PathCache &) = delete;
+    ~PathCache()
+    {
+        if (m_inotifyFd != -1)
+        {
+            close(m_inotifyFd);
+        }
+    };
+
+    // 現在の $PATH から name を検索し、実行ファイルのパスを返す
+    // name に '/' が含まれる場合は検索せずにそのまま返す
+    // 見つからない場合は空文字列を返す
+    std::string Lookup(const std::string_view name)
+    {
+        if (name.find('/') != std::string_view::npos)
+        {
+            return std::string(name);
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Validate();
+
+        const std::string key(name);
+        const auto it = m_table.find(key);
+        if (it != m_table.end())
+        {
+            return it->second;
+        }
+
+        // 見つからなかった結果もキャッシュする
+        auto found = FindExecutable(name, m_path);
+        m_table.emplace(key, found);
+        return found;
+    };
+
+private:
+    // $PATH やディレクトリが変更されていればキャッシュを破棄する
+    void Validate()
+    {
+        const char *path = getenv("PATH");
+        const std::string_view currentPath = path == nullptr ? "" : path;
+        if (!m_initialized || currentPath != m_path)
+        {
+            Watch(currentPath);
+            return;
+        }
+
+        if (m_inotifyFd != -1)
+        {
+            // 何かイベントが届いていれば破棄する
+            alignas(inotify_event) char buf[4096];
+            bool changed = false;
+            while (read(m_inotifyFd, buf, sizeof(buf)) > 0)
+            {
+                changed = true;
+            }
+            if (changed)
+            {
+                // 存在しなかったディレクトリが作られた場合に、そのディレクトリを監視し直す
+                Watch(m_path);
+            }
+            return;
+        }
+
+        if (ReadModifiedTimes() != m_modifiedTimes)
+        {
+            m_table.clear();
+            m_modifiedTimes = ReadModifiedTimes();
+        }
+    };
+
+    // path のディレクトリの監視を始めて、キャッシュを空にする
+    void Watch(const std::string_view path)
+    {
+        m_path = path;
+        m_dirs = SplitPath(path);
+        m_table.clear();
+        m_initialized = true;
+
+        if (m_inotifyFd != -1)
+        {
+            // 古い監視をすべて解除するため作り直す
+            close(m_inotifyFd);
+            m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+        if (m_inotifyFd != -1)
+        {
+            constexpr uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+            for (const auto &dir : m_dirs)
+            {
+                // 存在しないディレクトリは監視できないので、存在する最も近い親ディレクトリを監視する
+                // 作られたときにイベントが届くので、見つからなかった結果をキャッシュしても古くならない
+                std::filesystem::path target = dir.empty() ? "." : dir;
+                while (inotify_add_watch(m_inotifyFd, target.c_str(), mask) == -1)
+                {
+                    auto parent = target.parent_path();
+                    if (parent.empty())
+                    {
+                        parent = ".";
+                    }
+                    if (parent == target)
+                    {
+                        break;
+                    }
+                    target = std::move(parent);
+                }
+            }
+        }
+        else
+        {
+            m_modifiedTimes = ReadModifiedTimes();
+        }
+    };
+
+    std::vector<int64_t> ReadModifiedTimes() const
+    {
+        std::vector<int64_t> times;
+        for (const auto &dir : m_dirs)
+        {
+            struct stat st;
+            times.push_back(stat(dir.empty() ? "." : dir.c_str(), &st) == 0 ? st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec : -1);
+        }
+        return times;
+    };
+
+    std::mutex m_mutex;
+    int m_inotifyFd;
+    bool m_initialized = false;
+    std::string m_path;
+    std::vector<std::string> m_dirs;
+    std::vector<int64_t> m_modifiedTimes;
+    std::unordered_map<std::string, std::string> m_table;
+};
+
+class ExecCache;
+class JobStats;
+
+// ジョブを実行するときの設定
+struct ExecOptions final
+{
+    // 最初のコマンドの標準入力
+    // 呼び出し元が所有する fd で、ジョブの実行では閉じない
+    int stdinFd = STDIN_FILENO;
+
+    // nullptr でなければ、コマンドの検索に使う
+    // nullptr の場合は posix_spawnp が毎回 $PATH を検索する
+    PathCache *pathCache = nullptr;
+
+    // true の場合、ExecuteJob は cat や head などをプロセスを起動せずにスレッドで実行する
+    // 対応するコマンドは IsBuiltin を参照
+    bool builtins = false;
+
+    // nullptr でなければ、ExecuteJob と CaptureJob は実行結果をキャッシュし、ヒットした場合はプロセスを起動せずに再現する
+    // 引数と入力ファイルだけで出力と終了ステータスが決まるジョブにだけ使う
+    // ExecuteJob は出力をすべて取得してから書き込むので、逐次出力されなくなる
+    ExecCache *execCache = nullptr;
+
+    // nullptr でなければ、ExecuteJob と CaptureJob は各コマンドの統計を記録する
+    // 組み込みコマンドを使って実行したジョブと、キャッシュにヒットしたジョブは記録しない
+    JobStats *stats = nullptr;
+};
+
+// waitpid で得られたステータスを bash と同じ終了ステータスに変換する
+// シグナルで終了した場合は 128 + シグナル番号になる
+int ToExitStatus(const int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return status;
+}
+
+// 標準入力を inFd、標準出力を outFd にして cmd を起動し、プロセス ID を返す
+// 起動できなかった場合と、引数が空の場合は -1 を返す
+pid_t SpawnCommand(const Command &cmd, const int inFd, const int outFd, const ExecOptions &options)
+{
+    if (cmd.args.empty())
+    {
+        return -1;
+    }
+    TRACE_SPAN_DETAIL("exec", "SpawnCommand", cmd.args[0]);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (inFd != STDIN_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+    }
+    if (outFd != STDOUT_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    }
+
+    std::vector<char *> argv;
+    for (const auto &arg : cmd.args)
+    {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = -1;
+    if (options.pathCache != nullptr)
+    {
+        const auto executable = options.pathCache->Lookup(argv[0]);
+        if (executable.empty() || posix_spawn(&pid, executable.c_str(), &actions, nullptr, argv.data(), environ) != 0)
+        {
+            pid = -1;
+        }
+    }
+    else if (posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ) != 0)
+    {
+        pid = -1;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (pid != -1)
+    {
+        // プロセスが終了するまでの区間は、回収したところで終える
+        TRACE_ASYNC_BEGIN("exec", "stage", pid, cmd.args[0]);
+    }
+    return pid;
+}
+
+// job のコマンドを起動し、プロセス ID をコマンドの順に返す
+// コマンドはパイプで連結し、最後のコマンドの標準出力は outFd にする
+// 起動できなかったコマンドのプロセス ID は -1 になる
+// パイプを作成できない場合は、起動済みのコマンドを待ってから std::runtime_error を投げる
+std::vector<pid_t> SpawnJob(const Job &job, const int outFd, const ExecOptions &options = {})
+{
+    TRACE_SPAN("exec", "SpawnJob");
+    std::vector<pid_t> pids;
+
+    // 前のコマンドの出力を読み込むパイプ
+    // 最初のコマンドは options.stdinFd を使う
+    int inFd = options.stdinFd;
+    for (size_t i = 0; i < job.commands.size(); i++)
+    {
+        // 最後のコマンド以外は次のコマンドへのパイプに出力する
+        // O_CLOEXEC なので、dup2 していない側は子プロセスに引き継がれない
+        int pipeFds[2] = {-1, -1};
+        const bool isLast = i + 1 == job.commands.size();
+        if (!isLast && pipe2(pipeFds, O_CLOEXEC) != 0)
+        {
+            const auto error = std::string("pipe2 に失敗しました, ") + strerror(errno);
+            if (inFd != options.stdinFd)
+            {
+                close(inFd);
+            }
+            for (const auto pid : pids)
+            {
+                if (pid != -1)
+                {
+                    waitpid(pid, nullptr, 0);
+                    TRACE_ASYNC_END("exec", "stage", pid);
+                }
+            }
+            throw std::runtime_error(error);
+        }
+        const int cmdOutFd = isLast ? outFd : pipeFds[1];
+        pids.push_back(SpawnCommand(job.commands[i], inFd, cmdOutFd, options));
+
+        // 子プロセスに渡したパイプは親プロセスでは不要になる
+        if (inFd != options.stdinFd)
+        {
+            close(inFd);
+        }
+        if (!isLast)
+        {
+            close(pipeFds[1]);
+            inFd = pipeFds[0];
+        }
+    }
+
+    return pids;
+}
+
+// SpawnJob で起動したコマンドの終了を待ち、終了ステータスをコマンドの順に返す
+// 起動できなかったコマンドの終了ステータスは bash と同じく 127 になる
+std::vector<int> WaitJob(const std::vector<pid_t> &pids)
+{
+    TRACE_SPAN("exec", "WaitJob");
+    std::vector<int> statuses;
+    for (const auto pid : pids)
+    {
+        if (pid == -1)
+        {
+            statuses.push_back(127);
+            continue;
+        }
+
+        int status = 0;
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        {
+        }
+        TRACE_ASYNC_END("exec", "stage", pid);
+        statuses.push_back(ToExitStatus(status));
+    }
+    return statuses;
+}
+
+// 実行したコマンド 1 つの統計
+struct StageStats final
+{
+    // JobStats に記録した順のジョブの番号と、ジョブの中のコマンドの位置
+    size_t job = 0;
+    size_t index = 0;
+    std::string command;
+    pid_t pid = -1;
+    int status = 127;
+
+    // 起動してから終了を確認するまでの時間
+    // 前のコマンドから順に待つので、先に終了した後ろのコマンドは待っていた時間も含む
+    std::chrono::nanoseconds wall{0};
+
+    // wait4 で得られるリソース使用量
+    std::chrono::microseconds userCpu{0};
+    std::chrono::microseconds systemCpu{0};
+    long maxRssKb = 0;
+
+    // /proc/<pid>/io の rchar と wchar
+    // パイプだけでなく、プロセスのすべての read と write のバイト数なので、
+    // ローダーが読む共有ライブラリやロケールのファイル、引数で指定したファイルなども含む
+    uint64_t rcharBytes = 0;
+    uint64_t wcharBytes = 0;
+};
+
+// JobStats に記録したすべてのコマンドの合計
+// maxRssKb だけは最大値
+struct JobStatsTotals final
+{
+    size_t jobs = 0;
+    size_t stages = 0;
+    std::chrono::nanoseconds wall{0};
+    std::chrono::microseconds userCpu{0};
+    std::chrono::microseconds systemCpu{0};
+    long maxRssKb = 0;
+    uint64_t rcharBytes = 0;
+    uint64_t wcharBytes = 0;
+};
+
+// 実行したジョブの統計を集める
+// 複数のスレッドから同時に使える
+class JobStats final
+{
+public:
+    // 1 つのジョブの各コマンドの統計を記録する
+    void Add(std::vector<StageStats> &&stages)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto &stage : stages)
+        {
+            stage.job = m_totals.jobs;
+            m_totals.stages++;
+            m_totals.wall += stage.wall;
+            m_totals.userCpu += stage.userCpu;
+            m_totals.systemCpu += stage.systemCpu;
+            m_totals.maxRssKb = std::max(m_totals.maxRssKb, stage.maxRssKb);
+            m_totals.rcharBytes += stage.rcharBytes;
+            m_totals.wcharBytes += stage.wcharBytes;
+            m_stages.push_back(std::move(stage));
+        }
+        m_totals.jobs++;
+    };
+
+    std::vector<StageStats> Stages() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stages;
+    };
+
+    // 記録した各コマンドの統計を取り出して空にする
+    // 長く動かす場合に、記録が増え続けないように使う
+    // 合計はそのまま残る
+    std::vector<StageStats> TakeStages()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<StageStats> stages;
+        stages.swap(m_stages);
+        return stages;
+    };
+
+    JobStatsTotals Totals() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_totals;
+    };
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<StageStats> m_stages;
+    JobStatsTotals m_totals;
+};
+
+// /proc/<pid>/io から rchar と wchar を読み込む
+// 読み込めない場合は 0 のままにする
+void ReadProcIo(const pid_t pid, uint64_t &rcharBytes, uint64_t &wcharBytes)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/io", static_cast<int>(pid));
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return;
+    }
+    // 小さなファイルなので 1 回で読み込める
+    char buf[512];
+    const auto n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[std::max<ssize_t>(n, 0)] = '\0';
+
+    const char *rchar = strstr(buf, "rchar: ");
+    const char *wchar = strstr(buf, "wchar: ");
+    if (rchar != nullptr)
+    {
+        rcharBytes = strtoull(rchar + 7, nullptr, 10);
+    }
+    if (wchar != nullptr)
+    {
+        wcharBytes = strtoull(wchar + 7, nullptr, 10);
+    }
+}
+
+// WaitJob と同じく job のプロセスの終了を待ち、各コマンドの統計を stats に記録する
+// start は SpawnJob を呼ぶ前の時刻
+// 起動する側では時刻を 1 回読むだけで、残りはすべて終了を待つ側で集める
+std::vector<int> WaitJobWithStats(const Job &job, const std::vector<pid_t> &pids, const std::chrono::steady_clock::time_point start, JobStats &stats)
+{
+    TRACE_SPAN("exec", "WaitJobWithStats");
+    std::vector<int> statuses;
+    std::vector<StageStats> stages(pids.size());
+    for (size_t i = 0; i < pids.size(); i++)
+    {
+        auto &stage = stages[i];
+        stage.index = i;
+        if (i < job.commands.size() && !job.commands[i].args.empty())
+        {
+            stage.command = job.commands[i].args[0];
+        }
+        stage.pid = pids[i];
+        if (pids[i] == -1)
+        {
+            statuses.push_back(127);
+            continue;
+        }
+
+        // 回収すると /proc/<pid> が消えるので、終了を確認してから回収する前に読み込む
+        siginfo_t info;
+        while (waitid(P_PID, pids[i], &info, WEXITED | WNOWAIT) == -1 && errno == EINTR)
+        {
+        }
+        stage.wall = std::chrono::steady_clock::now() - start;
+        ReadProcIo(pids[i], stage.rcharBytes, stage.wcharBytes);
+
+        int status = 0;
+        rusage usage{};
+        while (wait4(pids[i], &status, 0, &usage) == -1 && errno == EINTR)
+        {
+        }
+        TRACE_ASYNC_END("exec", "stage", pids[i]);
+        stage.status = ToExitStatus(status);
+        stage.userCpu = std::chrono::seconds(usage.ru_utime.tv_sec) + std::chrono::microseconds(usage.ru_utime.tv_usec);
+        stage.systemCpu = std::chrono::seconds(usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_stime.tv_usec);
+        stage.maxRssKb = usage.ru_maxrss;
+        statuses.push_back(stage.status);
+    }
+    stats.Add(std::move(stages));
+    return statuses;
+}
+
+// JobStats の合計を一定の間隔で fd に 1 行の JSON で書き込む
+// 合計を読むだけなので、ジョブを実行しているスレッドはほとんど待たない
+// 破棄するときに最後の合計も書き込む
+class JobStatsDumper final
+{
+public:
+    JobStatsDumper(const JobStats &stats, const int fd, const std::chrono::milliseconds interval)
+        : m_stats(stats), m_fd(fd), m_interval(interval), m_thread([this] { Run(); }){};
+    JobStatsDumper(const JobStatsDumper &) = delete;
+    JobStatsDumper &operator=(const JobStatsDumper &) = delete;
+    ~JobStatsDumper()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_stopped.notify_all();
+        m_thread.join();
+    };
+
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stopped.wait_for(lock, m_interval, [&] { return m_stop; }))
+        {
+            Dump();
+        }
+        Dump();
+    };
+
+    void Dump() const
+    {
+        const auto totals = m_stats.Totals();
+        char line[512];
+        const int n = snprintf(line, sizeof(line),
+                               "{\"jobs\":%zu,\"stages\":%zu,\"wall_ms\":%.3f,\"user_ms\":%.3f,\"system_ms\":%.3f,\"max_rss_kb\":%ld,\"rchar_bytes\":%llu,\"wchar_bytes\":%llu}\n",
+                               totals.jobs, totals.stages, totals.wall.count() / 1e6, totals.userCpu.count() / 1e3, totals.systemCpu.count() / 1e3, totals.maxRssKb,
+                               static_cast<unsigned long long>(totals.rcharBytes), static_cast<unsigned long long>(totals.wcharBytes));
+        // 書き込めなくてもジョブの実行には影響させない
+        [[maybe_unused]] const auto written = write(m_fd, line, n);
+    };
+
+    const JobStats &m_stats;
+    const int m_fd;
+    const std::chrono::milliseconds m_interval;
+    std::mutex m_mutex;
+    std::condition_variable m_stopped;
+    bool m_stop = false;
+    // 他のメンバーを初期化してから開始する
+    std::thread m_thread;
+};
+
+// リダイレクト先のファイルを書き込み用に開く
+// 開けない場合は std::runtime_error を投げる
+int OpenRedirectFile(const std::pmr::string &filename)
+{
+    const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1)
+    {
+        throw std::runtime_error("リダイレクト先を開けません, " + std::string(filename) + ", " + strerror(errno));
+    }
+    return fd;
+}
+
+// 1 つのスレッドが書き込み、別の 1 つのスレッドが読み込むバイト列のリングバッファ
+// ロックを使わず、読み込み位置と書き込み位置をそれぞれの側だけが更新する
+// 空や満杯で待つ間は、しばらくスレッドを譲りながら調べ、それでも相手が進まなければ条件変数で眠る
+class SpscRing final
+{
+public:
+    // capacity は 2 のべき乗に切り上げる
+    explicit SpscRing(const size_t capacity = 1 << 16)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        m_buffer = std::make_unique<char[]>(size);
+        m_mask = size - 1;
+    };
+
+    // data をすべて書き込む
+    // 読み込み側が閉じた場合は false を返す
+    bool Write(const char *data, size_t size)
+    {
+        const auto capacity = m_mask + 1;
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        while (size > 0)
+        {
+            const auto head = m_head.load(std::memory_order_acquire);
+            const auto space = capacity - (tail - head);
+            if (space == 0)
+            {
+                if (m_readClosed.load(std::memory_order_acquire))
+                {
+                    return false;
+                }
+                WaitUntil([&] { return m_head.load(std::memory_order_acquire) != head || m_readClosed.load(std::memory_order_acquire); });
+                continue;
+            }
+
+            // バッファの末尾で折り返す場合は 2 回に分けてコピーする
+            const auto n = std::min(size, space);
+            const auto offset = tail & m_mask;
+            const auto first = std::min(n, capacity - offset);
+            memcpy(m_buffer.get() + offset, data, first);
+            memcpy(m_buffer.get(), data + first, n - first);
+            tail += n;
+            m_tail.store(tail, std::memory_order_release);
+            Notify();
+            data += n;
+            size -= n;
+        }
+        return !m_readClosed.load(std::memory_order_acquire);
+    };
+
+    // 最大 size バイトを読み込み、読み込んだバイト数を返す
+    // 空の場合は書き込まれるまで待ち、書き込み側が閉じて空になった場合は 0 を返す
+    size_t Read(char *data, const size_t size)
+    {
+        const auto capacity = m_mask + 1;
+        const auto head = m_head.load(std::memory_order_relaxed);
+        while (true)
+        {
+            // 閉じたことを先に調べ、閉じる前に書き込まれた内容を読み落とさないようにする
+            const bool closed = m_writeClosed.load(std::memory_order_acquire);
+            const auto tail = m_tail.load(std::memory_order_acquire);
+            if (tail != head)
+            {
+                const auto n = std::min(size, tail - head);
+                const auto offset = head & m_mask;
+                const auto first = std::min(n, capacity - offset);
+                memcpy(data, m_buffer.get() + offset, first);
+                memcpy(data + first, m_buffer.get(), n - first);
+                m_head.store(head + n, std::memory_order_release);
+                Notify();
+                return n;
+            }
+            if (closed)
+            {
+                return 0;
+            }
+            WaitUntil([&] { return m_tail.load(std::memory_order_acquire) != head || m_writeClosed.load(std::memory_order_acquire); });
+        }
+    };
+
+    // 閉じたことを待っている相手に伝える
+    void CloseWrite()
+    {
+        m_writeClosed.store(true, std::memory_order_release);
+        Notify();
+    };
+    void CloseRead()
+    {
+        m_readClosed.store(true, std::memory_order_release);
+        Notify();
+    };
+
+private:
+    // 眠る前に yield で相手を待つ回数
+    static constexpr int SpinCount = 64;
+
+    // ready() が true を返すまで待つ
+    // 相手はすぐに進むことが多いので SpinCount 回までは yield で待ち、それでも進まなければ m_changed で眠る
+    // 遅い外部コマンドの出力などを待つ間に CPU を使い続けないようにする
+    template <typename Ready>
+    void WaitUntil(Ready &&ready)
+    {
+        for (int i = 0; i < SpinCount; i++)
+        {
+            if (ready())
+            {
+                return;
+            }
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_waiters.fetch_add(1, std::memory_order_relaxed);
+        // Notify のフェンスと対になり、m_waiters の更新より前に ready() を調べないようにする
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_changed.wait(lock, ready);
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    };
+
+    // 眠っている相手がいれば起こす
+    // 相手が眠っていなければ mutex は使わない
+    void Notify()
+    {
+        // WaitUntil のフェンスと対になり、m_head や m_tail などの更新より前に m_waiters を調べないようにする
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_relaxed) > 0)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_changed.notify_all();
+        }
+    };
+
+    std::unique_ptr<char[]> m_buffer;
+    size_t m_mask = 0;
+
+    // 読み込み側と書き込み側が別のキャッシュラインを更新するようにする
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+    std::atomic<bool> m_writeClosed{false};
+    std::atomic<bool> m_readClosed{false};
+
+    // 空や満杯で眠っているスレッドの数と、それを起こすための条件変数
+    std::atomic<int> m_waiters{0};
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+};
+
+// 組み込みコマンドの入力
+// 隣のコマンドも組み込みコマンドなら SpscRing から、そうでなければ fd から読み込む
+class BuiltinInput final
+{
+public:
+    // owned が false の場合は、Close で fd を閉じない
+    BuiltinInput(const int fd, const bool owned) : m_fd(fd), m_owned(owned){};
+    explicit BuiltinInput(SpscRing *ring) : m_ring(ring){};
+
+    // 最大 size バイトを読み込み、読み込んだバイト数を返す
+    // 終わりに達した場合や、読み込めない場合は 0 を返す
+    size_t Read(char *data, const size_t size)
+    {
+        if (m_ring != nullptr)
+        {
+            return m_ring->Read(data, size);
+        }
+        while (true)
+        {
+            const auto n = read(m_fd, data, size);
+            if (n >= 0)
+            {
+                return n;
+            }
+            if (errno != EINTR)
+            {
+                return 0;
+            }
+        }
+    };
+
+    // 読み込みをやめたことを前のコマンドに伝える
+    // ジョブの最初のコマンドの入力は呼び出し元が所有するので閉じない
+    void Close()
+    {
+        if (m_ring != nullptr)
+        {
+            m_ring->CloseRead();
+        }
+        else if (m_owned && m_fd != -1)
+        {
+            close(m_fd);
+        }
+        m_fd = -1;
+        m_ring = nullptr;
+    };
+
+private:
+    int m_fd = -1;
+    bool m_owned = false;
+    SpscRing *m_ring = nullptr;
+};
+
+// 組み込みコマンドの出力
+// 小さな書き込みをまとめてから、SpscRing か fd に書き込む
+class BuiltinOutput final
+{
+public:
+    BuiltinOutput(const int fd, const bool ownsFd) : m_fd(fd), m_ownsFd(ownsFd){};
+    explicit BuiltinOutput(SpscRing *ring) : m_ring(ring){};
+
+    // 次のコマンドが読み込みをやめた場合は false を返す
+    bool Write(const char *data, const size_t size)
+    {
+        if (m_broken)
+        {
+            return false;
+        }
+        if (m_buffer.size() + size > bufferSize)
+        {
+            Flush();
+        }
+        if (size > bufferSize)
+        {
+            WriteDirect(data, size);
+        }
+        else
+        {
+            m_buffer.append(data, size);
+        }
+        return !m_broken;
+    };
+    bool Write(const std::string_view s) { return Write(s.data(), s.size()); };
+
+    bool Flush()
+    {
+        if (!m_buffer.empty())
+        {
+            WriteDirect(m_buffer.data(), m_buffer.size());
+            m_buffer.clear();
+        }
+        return !m_broken;
+    };
+
+    // 書き込みの終わりを次のコマンドに伝える
+    void Close()
+    {
+        Flush();
+        if (m_ring != nullptr)
+        {
+            m_ring->CloseWrite();
+        }
+        else if (m_ownsFd)
+        {
+            close(m_fd);
+        }
+        m_ring = nullptr;
+        m_ownsFd = false;
+    };
+
+    // 次のコマンドが読み込みをやめていれば true
+    bool Broken() const { return m_broken; };
+
+private:
+    static constexpr size_t bufferSize = 1 << 16;
+
+    void WriteDirect(const char *data, size_t size)
+    {
+        if (m_ring != nullptr)
+        {
+            m_broken = m_broken || !m_ring->Write(data, size);
+            return;
+        }
+        while (size > 0 && !m_broken)
+        {
+            // スレッドで SIGPIPE をブロックしているので、読み込み側が閉じると EPIPE になる
+            const auto n = write(m_fd, data, size);
+            if (n == -1)
+            {
+                m_broken = errno != EINTR;
+                continue;
+            }
+            data += n;
+            size -= n;
+        }
+    };
+
+    int m_fd = -1;
+    bool m_ownsFd = false;
+    SpscRing *m_ring = nullptr;
+    std::string m_buffer;
+    bool m_broken = false;
+};
+
+// s を 10 進数の行数として解釈する
+// 解釈できない場合は false を返す
+bool ParseLineCount(const std::string_view s, size_t &count)
+{
+    if (s.empty() || s.size() > 18 || !std::all_of(s.begin(), s.end(), [](const char c) { return c >= '0' && c <= '9'; }))
+    {
+        return false;
+    }
+    count = 0;
+    for (const auto c : s)
+    {
+        count = count * 10 + (c - '0');
+    }
+    return true;
+}
+
+// cmd がこのプログラムの中で実行できる組み込みコマンドなら true を返す
+// 外部コマンドと同じ結果になる形式だけを組み込みコマンドとして扱い、それ以外のオプションなどは外部コマンドで実行する
+// * cat [ファイル]...
+// * head [-n 行数]
+// * wc [-l|-w|-c]
+// * grep [-v] 固定文字列
+// * tee [ファイル]...
+bool IsBuiltin(const Command &cmd)
+{
+    const auto &args = cmd.args;
+    if (args.empty())
+    {
+        return false;
+    }
+    const std::string_view name = args[0];
+    const auto noOptions = [&](const size_t from) {
+        return std::all_of(args.begin() + from, args.end(), [](const std::pmr::string &arg) { return arg == "-" || arg.empty() || arg[0] != '-'; });
+    };
+    size_t count = 0;
+    if (name == "cat")
+    {
+        return noOptions(1);
+    }
+    if (name == "tee")
+    {
+        return noOptions(1) && std::find(args.begin(), args.end(), "-") == args.end();
+    }
+    if (name == "head")
+    {
+        return args.size() == 1 || (args.size() == 3 && args[1] == "-n" && ParseLineCount(args[2], count));
+    }
+    if (name == "wc")
+    {
+        return args.size() == 1 || (args.size() == 2 && (args[1] == "-l" || args[1] == "-w" || args[1] == "-c"));
+    }
+    if (name == "grep")
+    {
+        const bool invert = args.size() == 3 && args[1] == "-v";
+        const std::string_view pattern = args.size() == 2 || invert ? std::string_view(args.back()) : std::string_view("-");
+        // 正規表現の特殊文字を含むパターンは外部コマンドで実行する
+        return (args.size() == 2 || invert) && (pattern.empty() || pattern[0] != '-') && pattern.find_first_of(".[]*^$\\") == std::string_view::npos;
+    }
+    return false;
+}
+
+// 組み込みコマンドを実行し、終了ステータスを返す
+// 次のコマンドが読み込みをやめた場合は、外部コマンドと同じく 128 + SIGPIPE を返す
+int RunBuiltin(const Command &cmd, BuiltinInput &in, BuiltinOutput &out)
+{
+    const auto &args = cmd.args;
+    const std::string_view name = args[0];
+    std::vector<char> chunk(1 << 16);
+    int status = 0;
+
+    // in の内容をすべて f(const char *, size_t) に渡す
+    // f が false を返した場合は、途中でやめる
+    const auto forEachChunk = [&](BuiltinInput &input, auto f) {
+        while (true)
+        {
+            const auto n = input.Read(chunk.data(), chunk.size());
+            if (n == 0 || !f(chunk.data(), n))
+            {
+                return;
+            }
+        }
+    };
+    const auto copy = [&](const char *data, const size_t size) { return out.Write(data, size); };
+
+    if (name == "cat")
+    {
+        if (args.size() == 1)
+        {
+            forEachChunk(in, copy);
+        }
+        for (size_t i = 1; i < args.size() && !out.Broken(); i++)
+        {
+            if (args[i] == "-")
+            {
+                forEachChunk(in, copy);
+                continue;
+            }
+            const int fd = open(args[i].c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                fprintf(stderr, "cat: %s: %s\n", args[i].c_str(), strerror(errno));
+                status = 1;
+                continue;
+            }
+            BuiltinInput file(fd, true);
+            forEachChunk(file, copy);
+            file.Close();
+        }
+    }
+    else if (name == "head")
+    {
+        size_t rest = 10;
+        if (args.size() == 3)
+        {
+            ParseLineCount(args[2], rest);
+        }
+        if (rest > 0)
+        {
+            forEachChunk(in, [&](const char *data, const size_t size) {
+                size_t end = 0;
+                while (end < size && rest > 0)
+                {
+                    const auto newline = static_cast<const char *>(memchr(data + end, '\n', size - end));
+                    end = newline == nullptr ? size : newline - data + 1;
+                    rest -= newline != nullptr;
+                }
+                return out.Write(data, end) && rest > 0;
+            });
+        }
+    }
+    else if (name == "wc")
+    {
+        size_t lines = 0;
+        size_t words = 0;
+        size_t bytes = 0;
+        bool inWord = false;
+        forEachChunk(in, [&](const char *data, const size_t size) {
+            bytes += size;
+            for (size_t i = 0; i < size; i++)
+            {
+                const auto c = data[i];
+                lines += c == '\n';
+                const bool space = c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+                words += !space && !inWord;
+                inWord = !space;
+            }
+            return true;
+        });
+        char line[80];
+        if (args.size() == 1)
+        {
+            snprintf(line, sizeof(line), "%7zu %7zu %7zu\n", lines, words, bytes);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "%zu\n", args[1] == "-l" ? lines : args[1] == "-w" ? words : bytes);
+        }
+        out.Write(line);
+    }
+    else if (name == "grep")
+    {
+        const bool invert = args.size() == 3;
+        const std::string_view pattern = args.back();
+        bool matched = false;
+        std::string partial;
+        const auto onLine = [&](const std::string_view line) {
+            if ((line.find(pattern) != std::string_view::npos) != invert)
+            {
+                matched = true;
+                return out.Write(line) && out.Write("\n");
+            }
+            return true;
+        };
+        forEachChunk(in, [&](const char *data, const size_t size) {
+            std::string_view rest(data, size);
+            for (auto newline = rest.find('\n'); newline != std::string_view::npos; newline = rest.find('\n'))
+            {
+                bool ok = true;
+                if (partial.empty())
+                {
+                    ok = onLine(rest.substr(0, newline));
+                }
+                else
+                {
+                    partial.append(rest.substr(0, newline));
+                    ok = onLine(partial);
+                    partial.clear();
+                }
+                if (!ok)
+                {
+                    return false;
+                }
+                rest.remove_prefix(newline + 1);
+            }
+            partial.append(rest);
+            return true;
+        });
+        // '\n' で終わらない最後の行も 1 行として扱う
+        if (!partial.empty() && !out.Broken())
+        {
+            onLine(partial);
+        }
+        status = matched ? 0 : 1;
+    }
+    else if (name == "tee")
+    {
+        std::vector<BuiltinOutput> files;
+        for (size_t i = 1; i < args.size(); i++)
+        {
+            const int fd = open(args[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (fd == -1)
+            {
+                fprintf(stderr, "tee: %s: %s\n", args[i].c_str(), strerror(errno));
+                status = 1;
+                continue;
+            }
+            files.emplace_back(fd, true);
+        }
+        forEachChunk(in, [&](const char *data, const size_t size) {
+            for (auto &file : files)
+            {
+                file.Write(data, size);
+            }
+            return out.Write(data, size);
+        });
+        for (auto &file : files)
+        {
+            file.Close();
+        }
+    }
+
+    out.Flush();
+    return out.Broken() ? 128 + SIGPIPE : status;
+}
+
+// 組み込みコマンドをスレッドで、それ以外のコマンドを別のプロセスで実行する
+// 隣り合う組み込みコマンドは SpscRing で、プロセスとの間はパイプで連結し、最後のコマンドの標準出力は outFd にする
+// 各コマンドの終了ステータスをコマンドの順に返す
+// パイプを作成できない場合は、起動済みのコマンドを待ってから std::runtime_error を投げる
+std::vector<int> ExecuteJobWithBuiltins(const Job &job, const int outFd, const ExecOptions &options)
+{
+    const auto count = job.commands.size();
+    std::vector<int> statuses(count, 127);
+    std::vector<pid_t> pids(count, -1);
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<SpscRing>> rings;
+
+    // 組み込みコマンドの終了時に SIGPIPE で終了しないように、スレッドでは SIGPIPE をブロックする
+    // write が EPIPE を返したときに保留された SIGPIPE は、スレッドの終了とともに破棄される
+    const auto runBuiltin = [&](const size_t i, BuiltinInput in, BuiltinOutput out) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        TRACE_SPAN_DETAIL("exec", "RunBuiltin", job.commands[i].args[0]);
+        statuses[i] = RunBuiltin(job.commands[i], in, out);
+        out.Close();
+        in.Close();
+    };
+
+    // 前のコマンドからの入力
+    // 前のコマンドが組み込みコマンドで、このコマンドも組み込みコマンドなら ring を使う
+    int inFd = options.stdinFd;
+    SpscRing *inRing = nullptr;
+    std::string error;
+    for (size_t i = 0; i < count; i++)
+    {
+        const bool builtin = IsBuiltin(job.commands[i]);
+        const bool isLast = i + 1 == count;
+        const bool nextBuiltin = !isLast && IsBuiltin(job.commands[i + 1]);
+
+        // 次のコマンドへの出力
+        int pipeFds[2] = {-1, -1};
+        SpscRing *outRing = nullptr;
+        if (!isLast && builtin && nextBuiltin)
+        {
+            rings.push_back(std::make_unique<SpscRing>());
+            outRing = rings.back().get();
+        }
+        else if (!isLast && pipe2(pipeFds, O_CLOEXEC) != 0)
+        {
+            error = std::string("pipe2 に失敗しました, ") + strerror(errno);
+            if (inFd != options.stdinFd)
+            {
+                close(inFd);
+            }
+            // 起動済みの組み込みコマンドが入力を待ち続けないように、ring を閉じる
+            if (inRing != nullptr)
+            {
+                inRing->CloseWrite();
+                inRing->CloseRead();
+            }
+            break;
+        }
+        const int cmdOutFd = isLast ? outFd : pipeFds[1];
+
+        if (builtin)
+        {
+            auto in = inRing != nullptr ? BuiltinInput(inRing) : BuiltinInput(inFd, inFd != options.stdinFd);
+            auto out = outRing != nullptr ? BuiltinOutput(outRing) : BuiltinOutput(cmdOutFd, !isLast);
+            threads.emplace_back(runBuiltin, i, in, out);
+        }
+        else
+        {
+            pids[i] = SpawnCommand(job.commands[i], inFd, cmdOutFd, options);
+
+            // 子プロセスに渡したパイプは親プロセスでは不要になる
+            if (inFd != options.stdinFd)
+            {
+                close(inFd);
+            }
+            if (!isLast)
+            {
+                close(pipeFds[1]);
+            }
+        }
+        inFd = isLast ? options.stdinFd : pipeFds[0];
+        inRing = outRing;
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (pids[i] != -1)
+        {
+            statuses[i] = WaitJob({pids[i]})[0];
+        }
+    }
+    if (!error.empty())
+    {
+        throw std::runtime_error(error);
+    }
+    return statuses;
+}
+
+// bash を介さずに job を実行する
+// 各コマンドの終了ステータスをコマンドの順に返す
+// エラー時には std::runtime_error を投げる
+std::vector<int> ExecuteJobCached(const Job &job, const ExecOptions &options);
+
+std::vector<int> ExecuteJob(const Job &job, const ExecOptions &options = {})
+{
+    TRACE_SPAN("exec", "ExecuteJob");
+    if (options.execCache != nullptr)
+    {
+        return ExecuteJobCached(job, options);
+    }
+
+    // bash と同じく、コマンドが存在しなくてもリダイレクト先は作成する
+    int outFd = STDOUT_FILENO;
+    if (!job.redirectFilename.empty())
+    {
+        outFd = OpenRedirectFile(job.redirectFilename);
+    }
+
+    const bool useBuiltins = options.builtins && std::any_of(job.commands.begin(), job.commands.end(), IsBuiltin);
+    const auto start = options.stats != nullptr ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    std::vector<pid_t> pids;
+    std::vector<int> statuses;
+    try
+    {
+        if (useBuiltins)
+        {
+            statuses = ExecuteJobWithBuiltins(job, outFd, options);
+        }
+        else
+        {
+            pids = SpawnJob(job, outFd, options);
+        }
+    }
+    catch (...)
+    {
+        if (outFd != STDOUT_FILENO)
+        {
+            close(outFd);
+        }
+        throw;
+    }
+    if (outFd != STDOUT_FILENO)
+    {
+        close(outFd);
+    }
+
+    if (useBuiltins)
+    {
+        return statuses;
+    }
+    return options.stats != nullptr ? WaitJobWithStats(job, pids, start, *options.stats) : WaitJob(pids);
+}
+
+// ジョブの出力を保持する
+// 出力はユーザー空間を経由せずに memfd に書き込まれ、View で mmap して参照する
+class CapturedOutput final
+{
+public:
+    CapturedOutput() = default;
+    CapturedOutput(const int fd, const size_t size) : m_fd(fd), m_size(size){};
+    CapturedOutput(const CapturedOutput &) = delete;
+    CapturedOutput &operator=(const CapturedOutput &) = delete;
+    CapturedOutput(CapturedOutput &&other) noexcept { *this = std::move(other); };
+    CapturedOutput &operator=(CapturedOutput &&other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+            std::swap(m_fd, other.m_fd);
+            std::swap(m_size, other.m_size);
+            std::swap(m_map, other.m_map);
+        }
+        return *this;
+    };
+    ~CapturedOutput() { Reset(); };
+
+    // 出力を保持している memfd
+    // 出力が存在しない場合は -1 になる
+    int Fd() const { return m_fd; };
+
+    size_t Size() const { return m_size; };
+
+    // 出力を mmap して返す
+    // mmap できない場合は std::runtime_error を投げる
+    std::string_view View()
+    {
+        if (m_size == 0)
+        {
+            return {};
+        }
+        if (m_map == nullptr)
+        {
+            void *map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+            if (map == MAP_FAILED)
+            {
+                throw std::runtime_error(std::string("mmap に失敗しました, ") + strerror(errno));
+            }
+            m_map = map;
+        }
+        return std::string_view(static_cast<const char *>(m_map), m_size);
+    };
+
+private:
+    void Reset()
+    {
+        if (m_map != nullptr)
+        {
+            munmap(m_map, m_size);
+            m_map = nullptr;
+        }
+        if (m_fd != -1)
+        {
+            close(m_fd);
+            m_fd = -1;
+        }
+        m_size = 0;
+    };
+
+    int m_fd = -1;
+    size_t m_size = 0;
+    void *m_map = nullptr;
+};
+
+struct CaptureResult final
+{
+    // 各コマンドの終了ステータス
+    std::vector<int> statuses;
+
+    // 最後のコマンドの出力
+    CapturedOutput output;
+};
+
+// パイプ inFd から len バイトを outFd に splice で移動する
+// outOffset が nullptr でない場合は outFd のその位置に書き込み、位置を進める
+// splice に対応していない書き込み先の場合だけ read/write で書き込む
+// エラー時には std::runtime_error を投げる
+void SpliceAll(const int inFd, const int outFd, loff_t *outOffset, size_t len)
+{
+    while (len > 0)
+    {
+        const auto n = splice(inFd, nullptr, outFd, outOffset, len, SPLICE_F_MOVE);
+        if (n > 0)
+        {
+            len -= n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && errno == EINVAL && outOffset == nullptr)
+        {
+            // 端末などの splice できない書き込み先
+            char buf[65536];
+            const auto r = read(inFd, buf, std::min(len, sizeof(buf)));
+            if (r > 0 && write(outFd, buf, r) == r)
+            {
+                len -= r;
+                continue;
+            }
+        }
+        throw std::runtime_error(std::string("splice に失敗しました, ") + strerror(errno));
+    }
+}
+
+// output の内容をすべて fd に書き込む
+// エラー時には std::runtime_error を投げる
+void WriteCapturedOutput(CapturedOutput &output, const int fd)
+{
+    off_t offset = 0;
+    while (static_cast<size_t>(offset) < output.Size())
+    {
+        const auto n = sendfile(fd, output.Fd(), &offset, output.Size() - offset);
+        if (n > 0 || (n == -1 && errno == EINTR))
+        {
+            continue;
+        }
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            // sendfile できない書き込み先
+            const auto view = output.View().substr(offset);
+            const auto w = write(fd, view.data(), view.size());
+            if (w > 0)
+            {
+                offset += w;
+                continue;
+            }
+        }
+        throw std::runtime_error(std::string("出力の書き込みに失敗しました, ") + strerror(errno));
+    }
+}
+
+// 決定的なジョブの実行結果をディレクトリに保存するキャッシュ
+// キーは HashJob に、引数が指すファイルの内容と更新日時、実行ファイルの更新日時、標準入力のファイルを混ぜたもの
+// 標準入力がパイプや端末など、内容をキーにできないものの場合はキャッシュを使わない
+// 1 つの結果を dir/<キーの 16 進数> に [出力][終了ステータス...][ステータスの数][キー][マジックナンバー] の順で保存する
+// 出力をファイルの先頭に置くので、ヒットした場合はファイルを mmap してそのまま出力として返せる
+// 複数のスレッドやプロセスから同時に使える
+// 古い結果は削除しないので、必要ならディレクトリごと削除する
+class ExecCache final
+{
+public:
+    // dir が存在しなければ作成する
+    // 作成できない場合は std::runtime_error を投げる
+    explicit ExecCache(const std::filesystem::path &dir) : m_dir(dir)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec)
+        {
+            throw std::runtime_error("キャッシュのディレクトリを作成できませんでした, " + dir.string() + ", " + ec.message());
+        }
+    };
+    ExecCache(const ExecCache &) = delete;
+    ExecCache &operator=(const ExecCache &) = delete;
+
+    // 最初のコマンドの標準入力を stdinFd にして job を実行する場合のキーを key に設定する
+    // 引数が通常のファイルを指していれば内容のハッシュ値を混ぜ、存在しないことも区別する
+    // stdinFd が /dev/null なら何も混ぜず、通常のファイルなら、どのファイルか、読み込み位置、内容のハッシュ値を混ぜる
+    // ヒットした場合はジョブが標準入力を読まないので、stdinFd の読み込み位置は進まない
+    // stdinFd がパイプや端末などの場合は、同じ入力かどうかを判断できないので false を返す
+    // 内容のハッシュ値は stat の結果が変わるまで再利用する
+    // pathCache が nullptr でなければ、実行ファイルの検索に使う
+    bool Key(const Job &job, const int stdinFd, uint64_t &key, PathCache *pathCache = nullptr)
+    {
+        thread_local std::vector<uint64_t> facts;
+        facts.clear();
+        facts.push_back(HashJob(job));
+        if (!AppendStdinFacts(stdinFd, facts))
+        {
+            return false;
+        }
+        for (const auto &cmd : job.commands)
+        {
+            for (size_t i = 0; i < cmd.args.size(); i++)
+            {
+                const std::string arg(cmd.args[i]);
+                if (i > 0)
+                {
+                    AppendFileFacts(arg, true, facts);
+                    continue;
+                }
+
+                // 実行ファイルは大きいので内容は読まず、更新日時などだけを混ぜる
+                std::string executable;
+                if (pathCache != nullptr)
+                {
+                    executable = pathCache->Lookup(arg);
+                }
+                else
+                {
+                    const char *path = getenv("PATH");
+                    executable = arg.find('/') != std::string::npos ? arg : FindExecutable(arg, path == nullptr ? "" : path);
+                }
+                AppendFileFacts(executable, false, facts);
+            }
+        }
+        key = wyhash::Hash(reinterpret_cast<const uint8_t *>(facts.data()), facts.size() * sizeof(uint64_t));
+        return true;
+    };
+
+    // key の結果が保存されていれば result に読み込んで true を返す
+    // 存在しないか壊れている場合は false を返す
+    bool Lookup(const uint64_t key, CaptureResult &result)
+    {
+        const int fd = open(EntryPath(key).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        struct stat st;
+        char trailer[TrailerSize];
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= TrailerSize &&
+            pread(fd, trailer, TrailerSize, st.st_size - TrailerSize) == static_cast<ssize_t>(TrailerSize))
+        {
+            uint32_t count, magic;
+            uint64_t storedKey;
+            memcpy(&count, trailer, sizeof(count));
+            memcpy(&storedKey, trailer + 4, sizeof(storedKey));
+            memcpy(&magic, trailer + 12, sizeof(magic));
+            const size_t statusesSize = static_cast<size_t>(count) * sizeof(int32_t);
+            if (magic == Magic && storedKey == key && statusesSize <= st.st_size - TrailerSize)
+            {
+                const auto outputSize = st.st_size - TrailerSize - statusesSize;
+                std::vector<int32_t> statuses(count);
+                if (pread(fd, statuses.data(), statusesSize, outputSize) == static_cast<ssize_t>(statusesSize))
+                {
+                    result.statuses.assign(statuses.begin(), statuses.end());
+                    result.output = CapturedOutput(fd, outputSize);
+                    m_hits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        close(fd);
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    };
+
+    // result を key の結果として保存する
+    // 一時ファイルに書き込んでから rename するので、読み込み中のプロセスが途中の状態を見ることはない
+    // 保存できなかった場合は false を返す
+    bool Store(const uint64_t key, CaptureResult &result)
+    {
+        auto tempPath = (m_dir / ".tmp-XXXXXX").string();
+        const int fd = mkostemp(tempPath.data(), O_CLOEXEC);
+        if (fd == -1)
+        {
+            return false;
+        }
+
+        bool ok = true;
+        try
+        {
+            WriteCapturedOutput(result.output, fd);
+        }
+        catch (const std::runtime_error &)
+        {
+            ok = false;
+        }
+
+        std::string trailer;
+        for (const auto status : result.statuses)
+        {
+            const auto value = static_cast<int32_t>(status);
+            trailer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+        const auto count = static_cast<uint32_t>(result.statuses.size());
+        trailer.append(reinterpret_cast<const char *>(&count), sizeof(count));
+        trailer.append(reinterpret_cast<const char *>(&key), sizeof(key));
+        trailer.append(reinterpret_cast<const char *>(&Magic), sizeof(Magic));
+        ok = ok && write(fd, trailer.data(), trailer.size()) == static_cast<ssize_t>(trailer.size());
+        ok = close(fd) == 0 && ok;
+        ok = ok && rename(tempPath.c_str(), EntryPath(key).c_str()) == 0;
+        if (!ok)
+        {
+            unlink(tempPath.c_str());
+        }
+        return ok;
+    };
+
+    uint64_t Hits() const { return m_hits.load(std::memory_order_relaxed); };
+    uint64_t Misses() const { return m_misses.load(std::memory_order_relaxed); };
+
+private:
+    // ステータスの数、キー、マジックナンバー
+    static constexpr size_t TrailerSize = 16;
+    static constexpr uint32_t Magic = 0x31434558; // "XEC1"
+
+    // ファイルの更新日時の精度より短い間に書き換えられると stat の結果が変わらないことがある
+    // ハッシュ値を計算した時刻と更新日時がこれより近い場合は、ハッシュ値を再利用しない
+    static constexpr int64_t RacyNs = 1000000000;
+
+    struct FileState final
+    {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        int64_t mtime;
+        int64_t ctime;
+        bool racy;
+        uint64_t hash;
+    };
+
+    static int64_t ToNs(const timespec &t) { return t.tv_sec * 1000000000LL + t.tv_nsec; };
+
+    std::string EntryPath(const uint64_t key) const
+    {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+        return (m_dir / name).string();
+    };
+
+    // path の種類、大きさ、更新日時を facts に追加する
+    // hashContents が true で通常のファイルの場合は、内容のハッシュ値も追加する
+    void AppendFileFacts(const std::string &path, const bool hashContents, std::vector<uint64_t> &facts)
+    {
+        struct stat st;
+        if (path.empty() || stat(path.c_str(), &st) != 0)
+        {
+            facts.push_back(0);
+            return;
+        }
+        const bool regular = S_ISREG(st.st_mode);
+        facts.push_back(regular ? 1 : 2);
+        facts.push_back(st.st_size);
+        facts.push_back(ToNs(st.st_mtim));
+        if (!regular)
+        {
+            // ディレクトリなどは内容を読まず、どのファイルかだけを区別する
+            facts.push_back(st.st_ino);
+        }
+        else if (hashContents)
+        {
+            facts.push_back(ContentHash(path, st));
+        }
+    };
+
+    // 標準入力の stdinFd をキーに混ぜる
+    // /dev/null と通常のファイル以外の場合は false を返す
+    bool AppendStdinFacts(const int stdinFd, std::vector<uint64_t> &facts)
+    {
+        static const auto devNull = [] {
+            struct stat st;
+            return stat("/dev/null", &st) == 0 ? st.st_rdev : static_cast<dev_t>(-1);
+        }();
+        struct stat st;
+        if (fstat(stdinFd, &st) != 0)
+        {
+            return false;
+        }
+        if (S_ISCHR(st.st_mode) && st.st_rdev == devNull)
+        {
+            facts.push_back(0);
+            return true;
+        }
+        if (!S_ISREG(st.st_mode))
+        {
+            return false;
+        }
+
+        // ジョブは現在の読み込み位置から読むので、位置も混ぜる
+        // 内容のハッシュ値は、fd が指すファイルを /proc/self/fd から開いて計算する
+        const auto offset = lseek(stdinFd, 0, SEEK_CUR);
+        facts.push_back(1);
+        facts.push_back(st.st_dev);
+        facts.push_back(st.st_ino);
+        facts.push_back(st.st_size);
+        facts.push_back(ToNs(st.st_mtim));
+        facts.push_back(static_cast<uint64_t>(offset));
+        facts.push_back(ContentHash("/proc/self/fd/" + std::to_string(stdinFd), st));
+        return true;
+    };
+
+    // 通常のファイル path の内容のハッシュ値を返す
+    uint64_t ContentHash(const std::string &path, const struct stat &st)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const auto it = m_files.find(path);
+            if (it != m_files.end())
+            {
+                const auto &file = it->second;
+                if (!file.racy && file.dev == st.st_dev && file.ino == st.st_ino && file.size == st.st_size &&
+                    file.mtime == ToNs(st.st_mtim) && file.ctime == ToNs(st.st_ctim))
+                {
+                    return file.hash;
+                }
+            }
+        }
+
+        // 読み込んでいる間に書き換えられた場合に備えて、読み込む前の時刻を使う
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t hash;
+        size_t size;
+        try
+        {
+            const MappedFile file(path);
+            hash = wyhash::Hash(reinterpret_cast<const uint8_t *>(file.View().data()), file.View().size());
+            size = file.View().size();
+        }
+        catch (const std::runtime_error &)
+        {
+            // stat の後に削除された
+            return 0;
+        }
+
+        if (size == static_cast<size_t>(st.st_size))
+        {
+            const bool racy = ToNs(now) - ToNs(st.st_mtim) < RacyNs || ToNs(now) - ToNs(st.st_ctim) < RacyNs;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_files[path] = FileState{st.st_dev, st.st_ino, st.st_size, ToNs(st.st_mtim), ToNs(st.st_ctim), racy, hash};
+        }
+        return hash;
+    };
+
+    const std::filesystem::path m_dir;
+    std::mutex m_mutex;
+    std::unordered_map<std::string, FileState> m_files;
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+};
+
+// job を実行し、最後のコマンドの出力を取得する
+// リダイレクトが指定されている場合は、tee でパイプを複製してリダイレクト先にも書き込む
+// データはパイプ、ファイル、memfd の間を splice と tee で移動し、ユーザー空間にはコピーしない
+// エラー時には std::runtime_error を投げる
+CaptureResult CaptureJob(const Job &job, const ExecOptions &options = {})
+{
+    TRACE_SPAN("exec", "CaptureJob");
+    CaptureResult result;
+    if (options.execCache != nullptr)
+    {
+        auto &cache = *options.execCache;
+        ExecOptions uncached = options;
+        uncached.execCache = nullptr;
+        uint64_t key;
+        if (!cache.Key(job, options.stdinFd, key, options.pathCache))
+        {
+            // 標準入力の内容が分からないので、キャッシュを使わずに実行する
+            return CaptureJob(job, uncached);
+        }
+        if (cache.Lookup(key, result))
+        {
+            // プロセスは起動せず、保存した出力をリダイレクト先に書き込む
+            if (!job.redirectFilename.empty())
+            {
+                const int redirectFd = OpenRedirectFile(job.redirectFilename);
+                try
+                {
+                    WriteCapturedOutput(result.output, redirectFd);
+                }
+                catch (...)
+                {
+                    close(redirectFd);
+                    throw;
+                }
+                close(redirectFd);
+            }
+            return result;
+        }
+
+        result = CaptureJob(job, uncached);
+        // 保存できなくてもジョブの結果は返す
+        cache.Store(key, result);
+        return result;
+    }
+
+    // 後始末をまとめて行うため、作成した fd はここに登録する
+    std::vector<int> fds;
+    const auto closeAll = [&] {
+        for (const auto fd : fds)
+        {
+            close(fd);
+        }
+        fds.clear();
+    };
+    const auto throwError = [&](const char *what) {
+        const auto error = std::string(what) + "に失敗しました, " + strerror(errno);
+        closeAll();
+        throw std::runtime_error(error);
+    };
+
+    int redirectFd = -1;
+    if (!job.redirectFilename.empty())
+    {
+        redirectFd = OpenRedirectFile(job.redirectFilename);
+        fds.push_back(redirectFd);
+    }
+    if (job.commands.empty())
+    {
+        closeAll();
+        return result;
+    }
+
+    const int memFd = memfd_create("syntaxanalysis_capture", MFD_CLOEXEC);
+    if (memFd == -1)
+    {
+        throwError("memfd_create ");
+    }
+    fds.push_back(memFd);
+
+    int outPipe[2];
+    if (pipe2(outPipe, O_CLOEXEC) != 0)
+    {
+        throwError("pipe2 ");
+    }
+    fds.push_back(outPipe[0]);
+
+    int teePipe[2] = {-1, -1};
+    if (redirectFd != -1)
+    {
+        if (pipe2(teePipe, O_CLOEXEC) != 0)
+        {
+            close(outPipe[1]);
+            throwError("pipe2 ");
+        }
+        fds.push_back(teePipe[0]);
+        fds.push_back(teePipe[1]);
+    }
+
+    const auto start = options.stats != nullptr ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    std::vector<pid_t> pids;
+    try
+    {
+        pids = SpawnJob(job, outPipe[1], options);
+    }
+    catch (...)
+    {
+        close(outPipe[1]);
+        closeAll();
+        throw;
+    }
+    close(outPipe[1]);
+
+    constexpr size_t chunkSize = 1 << 20;
+    loff_t memOffset = 0;
+    try
+    {
+        TRACE_SPAN("exec", "CaptureJob output");
+        while (true)
+        {
+            ssize_t n;
+            if (redirectFd != -1)
+            {
+                // 読み出さずにパイプの内容を複製し、複製をリダイレクト先に移動する
+                n = tee(outPipe[0], teePipe[1], chunkSize, 0);
+                if (n > 0)
+                {
+                    SpliceAll(teePipe[0], redirectFd, nullptr, n);
+                    SpliceAll(outPipe[0], memFd, &memOffset, n);
+                }
+            }
+            else
+            {
+                n = splice(outPipe[0], nullptr, memFd, &memOffset, chunkSize, SPLICE_F_MOVE);
+            }
+
+            if (n == 0)
+            {
+                break;
+            }
+            if (n == -1 && errno != EINTR)
+            {
+                throw std::runtime_error(std::string("splice に失敗しました, ") + strerror(errno));
+            }
+        }
+    }
+    catch (...)
+    {
+        // 子プロセスが書き込みで止まらないように、パイプを閉じてから待つ
+        closeAll();
+        WaitJob(pids);
+        throw;
+    }
+    fds.erase(std::find(fds.begin(), fds.end(), memFd));
+    closeAll();
+
+    result.output = CapturedOutput(memFd, memOffset);
+    result.statuses = options.stats != nullptr ? WaitJobWithStats(job, pids, start, *options.stats) : WaitJob(pids);
+    return result;
+}
+
+// ExecuteJob でキャッシュを使う場合の実装
+// 出力をすべて取得してから、リダイレクトが無ければ標準出力に書き込む
+std::vector<int> ExecuteJobCached(const Job &job, const ExecOptions &options)
+{
+    auto result = CaptureJob(job, options);
+    if (job.redirectFilename.empty())
+    {
+        WriteCapturedOutput(result.output, STDOUT_FILENO);
+    }
+    return std::move(result.statuses);
+}
+
+// pidfd を開く
+// glibc のバージョンによらず使えるように、システムコールを直接呼び出す
+int OpenPidFd(const pid_t pid)
+{
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+// pidfd が参照するプロセスにシグナルを送る
+// glibc のバージョンによらず使えるように、システムコールを直接呼び出す
+int SendPidFdSignal(const int pidFd, const int sig)
+{
+    return static_cast<int>(syscall(SYS_pidfd_send_signal, pidFd, sig, nullptr, 0));
+}
+
+// バックグラウンドで実行するジョブを管理する
+// 各コマンドのプロセスを pidfd で参照して epoll で待つので、
+// 終了した順に回収でき、waitpid で 1 つのプロセスを待って止まることがない
+// ジョブごとに制限時間と、終了したときに呼ぶ関数を指定できる
+class BackgroundJobScheduler final
+{
+public:
+    // 終了したジョブの番号と、各コマンドの終了ステータス
+    using Finished = std::pair<size_t, std::vector<int>>;
+
+    // ジョブが終了したときに Reap の中で呼ばれる
+    // timedOut は制限時間を過ぎて強制終了した場合に true になる
+    // 例外を投げてはいけない
+    using Completion = std::function<void(size_t id, std::vector<int> &&statuses, bool timedOut)>;
+
+    // epoll を作成できない場合は std::runtime_error を投げる
+    BackgroundJobScheduler() : m_epollFd(epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (m_epollFd == -1)
+        {
+            throw std::runtime_error(std::string("epoll_create1 に失敗しました, ") + strerror(errno));
+        }
+    };
+    BackgroundJobScheduler(const BackgroundJobScheduler &) = delete;
+    BackgroundJobScheduler &operator=(const BackgroundJobScheduler &) = delete;
+
+    // ゾンビプロセスを残さないように、実行中のジョブの終了を待つ
+    ~BackgroundJobScheduler()
+    {
+        for (const auto &[pidFd, stage] : m_stages)
+        {
+            while (waitpid(stage.pid, nullptr, 0) == -1 && errno == EINTR)
+            {
+            }
+            TRACE_ASYNC_END("exec", "stage", stage.pid);
+            close(pidFd);
+        }
+        close(m_epollFd);
+    };
+
+    // job を起動し、ジョブの番号を返す
+    // onComplete を指定した場合、終了したジョブは Reap で返さずに onComplete に渡す
+    // timeout が 0 より大きければ、起動してから timeout を過ぎても終了していないコマンドを SIGKILL で終了させる
+    // シグナルを送るのは各コマンドのプロセスだけで、そこから起動されたプロセスには送らない
+    // リダイレクト先を開けない場合などは std::runtime_error を投げる
+    size_t Launch(const Job &job, const ExecOptions &options = {}, Completion onComplete = nullptr,
+                  const std::chrono::milliseconds timeout = std::chrono::milliseconds::zero())
+    {
+        int outFd = STDOUT_FILENO;
+        if (!job.redirectFilename.empty())
+        {
+            outFd = OpenRedirectFile(job.redirectFilename);
+        }
+        std::vector<pid_t> pids;
+        try
+        {
+            pids = SpawnJob(job, outFd, options);
+        }
+        catch (...)
+        {
+            if (outFd != STDOUT_FILENO)
+            {
+                close(outFd);
+            }
+            throw;
+        }
+        if (outFd != STDOUT_FILENO)
+        {
+            close(outFd);
+        }
+
+        const auto id = m_nextId++;
+        auto &running = m_jobs[id];
+        running.statuses.assign(pids.size(), 127);
+        running.pidFds.assign(pids.size(), -1);
+        running.onComplete = std::move(onComplete);
+        for (size_t i = 0; i < pids.size(); i++)
+        {
+            if (pids[i] == -1)
+            {
+                continue;
+            }
+
+            const int pidFd = OpenPidFd(pids[i]);
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = pidFd;
+            if (pidFd == -1 || epoll_ctl(m_epollFd, EPOLL_CTL_ADD, pidFd, &event) == -1)
+            {
+                // pidfd を使えない場合は、そのコマンドだけここで終了を待つ
+                if (pidFd != -1)
+                {
+                    close(pidFd);
+                }
+                int status = 0;
+                while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+                {
+                }
+                TRACE_ASYNC_END("exec", "stage", pids[i]);
+                running.statuses[i] = ToExitStatus(status);
+                continue;
+            }
+            m_stages[pidFd] = Stage{id, i, pids[i]};
+            running.pidFds[i] = pidFd;
+            running.remaining++;
+        }
+
+        // 起動できたコマンドが存在しなければ、すぐに終了したものとして扱う
+        if (running.remaining == 0)
+        {
+            Complete(id);
+        }
+        else if (timeout > std::chrono::milliseconds::zero())
+        {
+            running.deadline = std::chrono::steady_clock::now() + timeout;
+            m_deadlines.emplace(running.deadline, id);
+        }
+        return id;
+    };
+
+    // 終了していないジョブと、終了したがまだ Reap で返していないジョブの数
+    size_t PendingCount() const { return m_jobs.size() + m_completed.size(); };
+
+    // 終了したジョブを返し、onComplete を指定したジョブは onComplete を呼ぶ
+    // 終了したジョブが存在しなければ、timeoutMs ミリ秒まで待つ
+    // timeoutMs が -1 の場合は、実行中のジョブが存在する限り 1 つ以上終了するまで待つ
+    // 待っている間に制限時間を過ぎたジョブは強制終了させる
+    std::vector<Finished> Reap(const int timeoutMs = -1)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::array<epoll_event, 64> events;
+        while (true)
+        {
+            KillExpired();
+            const bool block = m_completed.empty() && !m_jobs.empty();
+            int n = 0;
+            if (!m_stages.empty())
+            {
+                TRACE_SPAN("exec", "epoll_wait");
+                n = epoll_wait(m_epollFd, events.data(), events.size(), block ? WaitTimeout(start, timeoutMs) : 0);
+            }
+            if (n == -1 && errno != EINTR)
+            {
+                throw std::runtime_error(std::string("epoll_wait に失敗しました, ") + strerror(errno));
+            }
+
+            for (int i = 0; i < n; i++)
+            {
+                // pidfd が読み込み可能になった時点でプロセスは終了しているので、waitpid は止まらない
+                const int pidFd = events[i].data.fd;
+                const auto stage = m_stages.at(pidFd);
+                int status = 0;
+                while (waitpid(stage.pid, &status, 0) == -1 && errno == EINTR)
+                {
+                }
+                TRACE_ASYNC_END("exec", "stage", stage.pid);
+                epoll_ctl(m_epollFd, EPOLL_CTL_DEL, pidFd, nullptr);
+                close(pidFd);
+                m_stages.erase(pidFd);
+
+                auto &running = m_jobs.at(stage.jobId);
+                running.statuses[stage.index] = ToExitStatus(status);
+                running.pidFds[stage.index] = -1;
+                if (--running.remaining == 0)
+                {
+                    Complete(stage.jobId);
+                }
+            }
+
+            const bool expired = timeoutMs >= 0 && std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(timeoutMs);
+            if (!block || !m_completed.empty() || m_jobs.empty() || expired)
+            {
+                break;
+            }
+        }
+
+        // onComplete から Launch を呼んでも良いように、epoll の結果を処理し終えてから呼ぶ
+        std::vector<Completed> completed;
+        completed.swap(m_completed);
+        std::vector<Finished> finished;
+        for (auto &c : completed)
+        {
+            if (c.onComplete)
+            {
+                c.onComplete(c.id, std::move(c.statuses), c.timedOut);
+            }
+            else
+            {
+                finished.emplace_back(c.id, std::move(c.statuses));
+            }
+        }
+        return finished;
+    };
+
+    // すべてのジョブの終了を待つ
+    std::vector<Finished> WaitAll()
+    {
+        std::vector<Finished> finished;
+        while (PendingCount() != 0)
+        {
+            for (auto &f : Reap())
+            {
+                finished.push_back(std::move(f));
+            }
+        }
+        return finished;
+    };
+
+private:
+    // 実行中のジョブのコマンド
+    struct Stage final
+    {
+        size_t jobId;
+        size_t index;
+        pid_t pid;
+    };
+
+    struct RunningJob final
+    {
+        std::vector<int> statuses;
+        // 終了していないコマンドの pidfd で、終了したものは -1
+        std::vector<int> pidFds;
+        // 終了していないコマンドの数
+        size_t remaining = 0;
+        Completion onComplete;
+        // 制限時間が無い場合は初期値のまま
+        std::chrono::steady_clock::time_point deadline;
+        bool timedOut = false;
+    };
+
+    struct Completed final
+    {
+        size_t id;
+        std::vector<int> statuses;
+        bool timedOut;
+        Completion onComplete;
+    };
+
+    // 終了したジョブを m_jobs から m_completed に移す
+    void Complete(const size_t id)
+    {
+        auto &running = m_jobs.at(id);
+        if (running.deadline != std::chrono::steady_clock::time_point())
+        {
+            m_deadlines.erase({running.deadline, id});
+        }
+        m_completed.push_back(Completed{id, std::move(running.statuses), running.timedOut, std::move(running.onComplete)});
+        m_jobs.erase(id);
+    };
+
+    // 制限時間を過ぎたジョブの終了していないコマンドに SIGKILL を送る
+    // プロセスは Reap で回収する
+    void KillExpired()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        while (!m_deadlines.empty() && m_deadlines.begin()->first <= now)
+        {
+            const auto id = m_deadlines.begin()->second;
+            m_deadlines.erase(m_deadlines.begin());
+            auto &running = m_jobs.at(id);
+            running.deadline = {};
+            running.timedOut = true;
+            for (const auto pidFd : running.pidFds)
+            {
+                // 回収するまでは pid が再利用されないので、pidfd を使えなくても kill で送れる
+                if (pidFd != -1 && SendPidFdSignal(pidFd, SIGKILL) == -1)
+                {
+                    kill(m_stages.at(pidFd).pid, SIGKILL);
+                }
+            }
+        }
+    };
+
+    // epoll_wait で待つミリ秒数を返す
+    // Reap の timeoutMs と、最も近い制限時間の短い方になる
+    int WaitTimeout(const std::chrono::steady_clock::time_point start, const int timeoutMs) const
+    {
+        const auto now = std::chrono::steady_clock::now();
+        int timeout = -1;
+        if (timeoutMs >= 0)
+        {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
+            timeout = static_cast<int>(std::max<int64_t>(0, timeoutMs - elapsed));
+        }
+        if (!m_deadlines.empty())
+        {
+            // 早く起きすぎないように切り上げる
+            const auto untilDeadline = std::chrono::ceil<std::chrono::milliseconds>(m_deadlines.begin()->first - now).count();
+            const auto deadlineTimeout = static_cast<int>(std::max<int64_t>(0, untilDeadline));
+            timeout = timeout == -1 ? deadlineTimeout : std::min(timeout, deadlineTimeout);
+        }
+        return timeout;
+    };
+
+    int m_epollFd;
+    size_t m_nextId = 0;
+    std::unordered_map<size_t, RunningJob> m_jobs;
+    // pidfd からコマンドへの対応
+    std::unordered_map<int, Stage> m_stages;
+    // 制限時間の早い順
+    std::set<std::pair<std::chrono::steady_clock::time_point, size_t>> m_deadlines;
+    std::vector<Completed> m_completed;
+};
+
+// list を bash と同じように実行し、<JOB> ごとに各コマンドの終了ステータスを返す
+// "&&" と "||" は、直前に実行した <JOB> の最後のコマンドの終了ステータスで、次の <JOB> を実行するか決める
+// bash と同じく、'&' は "&&" と "||" で連結した <JOB> 全体をバックグラウンドで実行する
+// 連結の各 <JOB> は BackgroundJobScheduler で起動し、終了したときに次の <JOB> を起動して、最後にすべての終了を待つ
+// 実行しなかった <JOB> の終了ステータスは空になる
+// エラー時には、起動済みのジョブの終了を待ってから std::runtime_error を投げる
+std::vector<std::vector<int>> RunCommandList(const CommandList &list, const ExecOptions &options = {})
+{
+    std::vector<std::vector<int>> statuses(list.size());
+    BackgroundJobScheduler scheduler;
+    // onComplete は例外を投げられないので、Launch の例外は保存しておき、Reap から戻ってから投げ直す
+    std::exception_ptr error;
+    const auto rethrowError = [&] {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    };
+    // バックグラウンドで実行中の連結の数
+    size_t runningChains = 0;
+
+    // list[i] を実行して終了ステータスが status になった後に、last までで次に実行する <JOB> の番号を返す
+    // 存在しなければ last + 1 を返す
+    const auto next = [&](size_t i, const size_t last, const int status) {
+        while (++i <= last && ((list[i - 1].op == ListOperator::And && status != 0) || (list[i - 1].op == ListOperator::Or && status == 0)))
+        {
+        }
+        return i;
+    };
+    const auto lastStatusOf = [&](const size_t i) { return statuses[i].empty() ? 0 : statuses[i].back(); };
+
+    // バックグラウンドの連結の list[i] を起動し、終了したら last までの次の <JOB> を起動する
+    std::function<void(size_t, size_t)> launch = [&](const size_t i, const size_t last) {
+        try
+        {
+            scheduler.Launch(list[i].job, options, [&, i, last](size_t, std::vector<int> &&jobStatuses, bool) {
+                statuses[i] = std::move(jobStatuses);
+                const auto j = next(i, last, lastStatusOf(i));
+                if (j <= last)
+                {
+                    launch(j, last);
+                }
+                else
+                {
+                    runningChains--;
+                }
+            });
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+            runningChains--;
+        }
+    };
+
+    // フォアグラウンドの <JOB> を実行する
+    // バックグラウンドの連結が実行中なら、待っている間も連結の次の <JOB> を起動できるように BackgroundJobScheduler で実行する
+    // キャッシュ、統計、組み込みコマンドは ExecuteJob でしか使えないので、その場合は終了するまで連結が先に進まない
+    const auto runForeground = [&](const Job &job) {
+        const bool useBuiltins = options.builtins && std::any_of(job.commands.begin(), job.commands.end(), IsBuiltin);
+        if (runningChains == 0 || options.execCache != nullptr || options.stats != nullptr || useBuiltins)
+        {
+            return ExecuteJob(job, options);
+        }
+
+        bool done = false;
+        std::vector<int> jobStatuses;
+        scheduler.Launch(job, options, [&](size_t, std::vector<int> &&s, bool) {
+            jobStatuses = std::move(s);
+            done = true;
+        });
+        while (!done)
+        {
+            scheduler.Reap();
+            rethrowError();
+        }
+        return jobStatuses;
+    };
+
+    for (size_t begin = 0; begin < list.size();)
+    {
+        // "&&" と "||" で連結した <JOB> の最後
+        auto last = begin;
+        while (last + 1 < list.size() && (list[last].op == ListOperator::And || list[last].op == ListOperator::Or))
+        {
+            last++;
+        }
+
+        if (list[last].op == ListOperator::Background)
+        {
+            runningChains++;
+            launch(begin, last);
+        }
+        else
+        {
+            for (auto i = begin; i <= last; i = next(i, last, lastStatusOf(i)))
+            {
+                statuses[i] = runForeground(list[i].job);
+            }
+        }
+
+        // 終了したバックグラウンドのジョブを回収し、pidfd を閉じる
+        scheduler.Reap(0);
+        rethrowError();
+        begin = last + 1;
+    }
+    scheduler.WaitAll();
+    rethrowError();
+    return statuses;
+}
+
+// RunBatch の設定
+struct BatchOptions final
+{
+    // 同時に実行するジョブの数
+    unsigned parallelism = std::max(1u, std::thread::hardware_concurrency());
+
+    // 読み込んだが onResult に渡していない行の数の上限
+    // 0 の場合は parallelism の 4 倍になる
+    // 上限に達すると、onResult に渡すまで次の行を読み込まないので、保持する出力の量が一定以下になる
+    size_t window = 0;
+
+    // true の場合は行の順に onResult を呼び、false の場合は終了した順に呼ぶ
+    bool ordered = true;
+
+    ExecOptions exec;
+};
+
+// RunBatch で実行した 1 行の結果
+struct BatchResult final
+{
+    // 0 から始まる行番号
+    size_t index = 0;
+
+    // 各コマンドの終了ステータス
+    std::vector<int> statuses;
+
+    // 実行にかかった時間
+    std::chrono::nanoseconds elapsed{};
+
+    // 最後のコマンドの出力
+    CapturedOutput output;
+
+    // 実行できなかった場合のエラー
+    std::string error;
+};
+
+// nextLine(std::string &) で読み込んだ行をパースし、最大 options.parallelism 個を同時に CaptureJob で実行する
+// nextLine は行を読み込めた場合に true を返し、ワーカースレッドから排他的に呼ばれる
+// xargs と同じく、各ジョブの最初のコマンドの標準入力は /dev/null にするので、
+// ジョブの一覧を標準入力から読み込んでいても、ジョブがそれを読んでしまうことはない
+// ';' や "&&" などの <LIST_OP> を含む行は実行せず、BatchResult::error を設定する
+// 実行結果はこの関数を呼んだスレッドで onResult(BatchResult &&) に渡す
+// onResult に渡した結果の数を返す
+// /dev/null を開けない場合は std::runtime_error を投げる
+// onResult が例外を投げた場合は、実行中のジョブの終了を待ってから投げ直す
+// nextLine が例外を投げた場合など、ワーカースレッドで例外が発生した場合も、実行中のジョブの終了を待ってから投げ直す
+template <typename NextLine, typename OnResult>
+size_t RunBatch(NextLine &&nextLine, OnResult &&onResult, const BatchOptions &options = {})
+{
+    const unsigned parallelism = std::max(1u, options.parallelism);
+    const size_t window = std::max<size_t>(options.window == 0 ? 4 * parallelism : options.window, 1);
+
+    const int nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (nullFd == -1)
+    {
+        throw std::runtime_error(std::string("/dev/null を開けませんでした, ") + strerror(errno));
+    }
+    ExecOptions exec = options.exec;
+    exec.stdinFd = nullFd;
+
+    std::mutex mutex;
+    std::condition_variable readable;
+    std::condition_variable finished;
+    size_t readCount = 0;
+    size_t emittedCount = 0;
+    bool inputDone = false;
+    std::map<size_t, BatchResult> results;
+    // ワーカースレッドで最初に発生した、行のエラーとして扱えない例外
+    std::exception_ptr workerError;
+
+    const auto work = [&] {
+        std::string line;
+        try
+        {
+            while (true)
+            {
+                BatchResult result;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    readable.wait(lock, [&] { return inputDone || readCount < emittedCount + window; });
+                    if (inputDone || !nextLine(line))
+                    {
+                        inputDone = true;
+                        readable.notify_all();
+                        finished.notify_all();
+                        return;
+                    }
+                    result.index = readCount++;
+                }
+
+                const auto start = std::chrono::steady_clock::now();
+                try
+                {
+                    // ParseJob は最初の <LIST_OP> の後ろを読み飛ばすので、後ろのジョブを黙って捨てないように <LIST> としてパースする
+                    StringToBeParsed str(line);
+                    auto list = ParseCommandList(str);
+                    if (list.size() > 1 || (!list.empty() && list[0].op != ListOperator::None))
+                    {
+                        throw std::runtime_error("<LIST_OP> を含む行は実行できません");
+                    }
+                    auto captured = CaptureJob(list.empty() ? Job() : std::move(list[0].job), exec);
+                    result.statuses = std::move(captured.statuses);
+                    result.output = std::move(captured.output);
+                }
+                catch (const std::runtime_error &e)
+                {
+                    result.error = e.what();
+                }
+                result.elapsed = std::chrono::steady_clock::now() - start;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                results.emplace(result.index, std::move(result));
+                finished.notify_one();
+            }
+        }
+        catch (...)
+        {
+            // ワーカースレッドから例外が漏れると std::terminate が呼ばれるので、呼び出したスレッドで投げ直す
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!workerError)
+            {
+                workerError = std::current_exception();
+            }
+            inputDone = true;
+            readable.notify_all();
+            finished.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < parallelism; i++)
+    {
+        workers.emplace_back(work);
+    }
+    const auto joinAll = [&] {
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    };
+
+    try
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto it = results.end();
+            finished.wait(lock, [&] {
+                it = options.ordered ? results.find(emittedCount) : results.begin();
+                return workerError || it != results.end() || (inputDone && emittedCount == readCount);
+            });
+            if (workerError)
+            {
+                std::rethrow_exception(workerError);
+            }
+            if (it == results.end())
+            {
+                break;
+            }
+            auto result = std::move(it->second);
+            results.erase(it);
+            emittedCount++;
+            readable.notify_one();
+            lock.unlock();
+
+            onResult(std::move(result));
+        }
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            inputDone = true;
+        }
+        readable.notify_all();
+        joinAll();
+        close(nullFd);
+        throw;
+    }
+    joinAll();
+    close(nullFd);
+    return emittedCount;
+}
+
+// fd に data をすべて書き込む
+// 書き込めない場合は false を返す
+bool WriteAll(const int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        const auto n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// fd から size バイトを読み込む
+// 途中で終わった場合は読み込めたバイト数を返す
+size_t ReadFull(const int fd, char *data, const size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        const auto n = read(fd, data + done, size - done);
+        if (n == 0 || (n == -1 && errno != EINTR))
+        {
+            break;
+        }
+        if (n > 0)
+        {
+            done += n;
+        }
+    }
+    return done;
+}
+
+// 事前に fork したヘルパープロセスでジョブを起動する
+// ヘルパーは、ZygotePool の作成時にこのプログラム自身を exec して起動する小さな zygote プロセスから fork する
+// zygote はスレッドを持たず、close_range で標準入出力と制御用のソケット以外の fd を閉じてあるので、
+// ヘルパーは呼び出し元のスレッドのロックや、CaptureJob などが開いているパイプを引き継がない
+// ヘルパーは Unix ソケットで AppendEncodedJob の形式のジョブを受け取り、パイプとリダイレクト先を用意してコマンドを起動し、
+// 各コマンドの終了ステータスをソケットで返す
+// ヘルパーは zygote を起動した時点のカレントディレクトリ、環境変数、標準入出力を使うので、それらを変えた場合は ZygotePool を作り直す
+// 呼び出し元のスレッドは起動を依頼するだけなので、fork や posix_spawn のコストは呼び出し元の外に移るが、
+// posix_spawn は呼び出し元のページテーブルをコピーしないので、1 つのジョブの起動の遅延は posix_spawn より小さくならない
+class ZygotePool final
+{
+public:
+    // Launch で起動したジョブ
+    // 終了を待つには Wait に渡す
+    struct Launched final
+    {
+        // ヘルパーで起動した場合は、終了ステータスを受け取るソケットとヘルパーのプロセス ID
+        int fd = -1;
+        pid_t helperPid = -1;
+
+        // ヘルパーを使わずに起動した場合は、各コマンドのプロセス ID
+        std::vector<pid_t> pids;
+    };
+
+    // zygote を起動し、size 個のヘルパーを用意する
+    // 起動できない場合は std::runtime_error を投げる
+    explicit ZygotePool(const size_t size) : m_size(size)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+        {
+            throw std::runtime_error(std::string("socketpair に失敗しました, ") + strerror(errno));
+        }
+
+        // zygote には fds[1] を O_CLOEXEC の付かない別の番号に複製して渡す
+        const int zygoteFd = fds[1] == ZygoteFd ? ZygoteFd + 1 : ZygoteFd;
+        const auto fdArg = std::to_string(zygoteFd);
+        char exe[] = "/proc/self/exe";
+        char command[] = "zygote";
+        char *argv[] = {exe, command, const_cast<char *>(fdArg.c_str()), nullptr};
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], zygoteFd);
+        const int error = posix_spawn(&m_zygotePid, exe, &actions, nullptr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        if (error != 0)
+        {
+            close(fds[0]);
+            throw std::runtime_error(std::string("zygote を起動できませんでした, ") + strerror(error));
+        }
+        m_zygoteFd = fds[0];
+
+        try
+        {
+            Replenish();
+        }
+        catch (...)
+        {
+            Close();
+            throw;
+        }
+    };
+    ZygotePool(const ZygotePool &) = delete;
+    ZygotePool &operator=(const ZygotePool &) = delete;
+
+    // ソケットを閉じると、待機中のヘルパーと zygote は終了する
+    ~ZygotePool() { Close(); };
+
+    // 待機中のヘルパーが size 個になるまで、zygote に fork を依頼する
+    // zygote が応答しない場合は std::runtime_error を投げる
+    void Replenish()
+    {
+        if (m_idle.size() >= m_size)
+        {
+            return;
+        }
+        const std::string requests(m_size - m_idle.size(), 'h');
+        if (!WriteAll(m_zygoteFd, requests.data(), requests.size()))
+        {
+            throw std::runtime_error("zygote にヘルパーの起動を依頼できませんでした");
+        }
+        for (size_t i = 0; i < requests.size(); i++)
+        {
+            Helper helper;
+            if (!ReceiveFd(m_zygoteFd, helper.pid, helper.fd))
+            {
+                throw std::runtime_error("zygote からヘルパーを受け取れませんでした");
+            }
+            m_idle.push_back(helper);
+        }
+    };
+
+    // 待機中のヘルパーの数
+    size_t IdleCount() const { return m_idle.size(); };
+
+    // job を起動し、Wait に渡して終了を待てるようにする
+    // ヘルパーでも posix_spawn でも、すべてのコマンドを起動してから返り、Wait はコマンドごとの終了ステータスを返す
+    // ヘルパーは execvp と同じく $PATH を検索する
+    // 待機中のヘルパーが存在しない場合は posix_spawn で起動し、既定の ExecOptions の SpawnJob と同じく起動する
+    // リダイレクト先を開けない場合などは、どちらの場合も同じ内容の std::runtime_error を投げる
+    Launched Launch(const Job &job)
+    {
+        m_message.clear();
+        AppendEncodedJob(job, m_message);
+        while (!m_idle.empty())
+        {
+            const auto helper = m_idle.back();
+            m_idle.pop_back();
+
+            // ヘルパーはすべてのコマンドを起動してから、エラーのメッセージを返す
+            // 起動できた場合のメッセージは空になる
+            char sizeBytes[4];
+            if (!WriteAll(helper.fd, m_message.data(), m_message.size()) || ReadFull(helper.fd, sizeBytes, 4) != 4)
+            {
+                // ヘルパーが終了していれば、次のヘルパーを使う
+                close(helper.fd);
+                continue;
+            }
+            std::string error(ReadU32(sizeBytes), '\0');
+            if (ReadFull(helper.fd, error.data(), error.size()) != error.size() || !error.empty())
+            {
+                close(helper.fd);
+                throw std::runtime_error(error.empty() ? "ヘルパーがジョブを起動せずに終了しました" : error);
+            }
+            TRACE_ASYNC_BEGIN("exec", "stage", helper.pid,
+                              job.commands.empty() || job.commands[0].args.empty() ? std::string_view() : std::string_view(job.commands[0].args[0]));
+            Launched launched;
+            launched.fd = helper.fd;
+            launched.helperPid = helper.pid;
+            return launched;
+        }
+
+        // ヘルパーを使わずに起動する
+        Launched launched;
+        launched.pids = SpawnJobWithRedirect(job);
+        return launched;
+    };
+
+    // Launch で起動したジョブの終了を待ち、コマンドごとの終了ステータスを返す
+    // 起動できなかったコマンドの終了ステータスは 127 になる
+    // ヘルパーが終了ステータスを返さずに終了した場合は std::runtime_error を投げる
+    static std::vector<int> Wait(Launched &&launched)
+    {
+        if (launched.fd == -1)
+        {
+            return WaitJob(launched.pids);
+        }
+
+        char countBytes[4];
+        std::vector<int> statuses;
+        bool ok = ReadFull(launched.fd, countBytes, 4) == 4;
+        if (ok)
+        {
+            std::string statusBytes(4 * static_cast<size_t>(ReadU32(countBytes)), '\0');
+            ok = ReadFull(launched.fd, statusBytes.data(), statusBytes.size()) == statusBytes.size();
+            for (size_t i = 0; ok && i < statusBytes.size(); i += 4)
+            {
+                statuses.push_back(static_cast<int>(ReadU32(statusBytes.data() + i)));
+            }
+        }
+        close(launched.fd);
+        TRACE_ASYNC_END("exec", "stage", launched.helperPid);
+        if (!ok)
+        {
+            throw std::runtime_error("ヘルパーが終了ステータスを返さずに終了しました");
+        }
+        return statuses;
+    };
+
+    // zygote の処理
+    // main から "zygote <fd>" で呼ばれ、fd から 1 バイト読み込むたびにヘルパーを fork し、
+    // ヘルパーのソケットとプロセス ID を fd で返す
+    // ZygotePool が fd を閉じると終了する
+    static int RunZygote(const int fd)
+    {
+        // 標準入出力と fd 以外は、呼び出し元から引き継いだものも閉じる
+        if (fd != ZygoteFd && dup2(fd, ZygoteFd) == -1)
+        {
+            return EXIT_FAILURE;
+        }
+        close_range(ZygoteFd + 1, ~0U, 0);
+
+        // ヘルパーは待たずに回収させる
+        signal(SIGCHLD, SIG_IGN);
+
+        char request;
+        while (ReadFull(ZygoteFd, &request, 1) == 1)
+        {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+            const pid_t pid = fork();
+            if (pid == -1)
+            {
+                return EXIT_FAILURE;
+            }
+            if (pid == 0)
+            {
+                close(ZygoteFd);
+                close(fds[0]);
+                signal(SIGCHLD, SIG_DFL);
+                RunHelper(fds[1]);
+            }
+            close(fds[1]);
+            const bool sent = SendFd(ZygoteFd, pid, fds[0]);
+            close(fds[0]);
+            if (!sent)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        return EXIT_SUCCESS;
+    };
+
+private:
+    struct Helper final
+    {
+        pid_t pid = -1;
+        int fd = -1;
+    };
+
+    // zygote が制御用のソケットに使う fd
+    static constexpr int ZygoteFd = 3;
+
+    void Close()
+    {
+        for (const auto &helper : m_idle)
+        {
+            close(helper.fd);
+        }
+        m_idle.clear();
+        close(m_zygoteFd);
+        while (waitpid(m_zygotePid, nullptr, 0) == -1 && errno == EINTR)
+        {
+        }
+    };
+
+    // job のリダイレクト先を開き、SpawnJob で起動する
+    // 開けない場合は OpenRedirectFile の std::runtime_error を投げる
+    static std::vector<pid_t> SpawnJobWithRedirect(const Job &job)
+    {
+        int outFd = STDOUT_FILENO;
+        if (!job.redirectFilename.empty())
+        {
+            outFd = OpenRedirectFile(job.redirectFilename);
+        }
+        std::vector<pid_t> pids;
+        try
+        {
+            pids = SpawnJob(job, outFd);
+        }
+        catch (...)
+        {
+            if (outFd != STDOUT_FILENO)
+            {
+                close(outFd);
+            }
+            throw;
+        }
+        if (outFd != STDOUT_FILENO)
+        {
+            close(outFd);
+        }
+        return pids;
+    };
+
+    // pid を本文に、fd を SCM_RIGHTS に入れて送る
+    static bool SendFd(const int socket, const pid_t pid, const int fd)
+    {
+        char data[4];
+        WriteU32(data, static_cast<uint32_t>(pid));
+        iovec iov{data, sizeof(data)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        while (true)
+        {
+            const auto n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+            if (n == sizeof(data))
+            {
+                return true;
+            }
+            if (n != -1 || errno != EINTR)
+            {
+                return false;
+            }
+        }
+    };
+
+    // SendFd で送られた pid と fd を受け取る
+    // 受け取った fd には O_CLOEXEC を付ける
+    static bool ReceiveFd(const int socket, pid_t &pid, int &fd)
+    {
+        char data[4];
+        iovec iov{data, sizeof(data)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n;
+        while ((n = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        {
+        }
+        const auto cmsg = CMSG_FIRSTHDR(&msg);
+        if (n != sizeof(data) || cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            return false;
+        }
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        pid = static_cast<pid_t>(ReadU32(data));
+        return true;
+    };
+
+    // ヘルパープロセスの処理
+    // ジョブを 1 つ受け取って起動し、起動の結果と終了ステータスを返してから終了する
+    // zygote から fork するので、メモリの確保や例外を使ってよい
+    [[noreturn]] static void RunHelper(const int fd)
+    {
+        char sizeBytes[4];
+        if (ReadFull(fd, sizeBytes, 4) != 4)
+        {
+            // プールが破棄された
+            _exit(0);
+        }
+        std::string message(4 + static_cast<size_t>(ReadU32(sizeBytes)), '\0');
+        memcpy(message.data(), sizeBytes, 4);
+        if (ReadFull(fd, message.data() + 4, message.size() - 4) != message.size() - 4)
+        {
+            _exit(127);
+        }
+
+        std::vector<pid_t> pids;
+        std::string reply(4, '\0');
+        try
+        {
+            EncodedJobReader reader(message);
+            EncodedJob encoded;
+            reader.Next(encoded);
+            pids = SpawnJobWithRedirect(encoded.ToJob());
+        }
+        catch (const std::runtime_error &e)
+        {
+            reply += e.what();
+        }
+        WriteU32(reply.data(), reply.size() - 4);
+        if (!WriteAll(fd, reply.data(), reply.size()) || reply.size() > 4)
+        {
+            _exit(127);
+        }
+
+        const auto statuses = WaitJob(pids);
+        reply.assign(4 * (statuses.size() + 1), '\0');
+        WriteU32(reply.data(), statuses.size());
+        for (size_t i = 0; i < statuses.size(); i++)
+        {
+            WriteU32(reply.data() + 4 * (i + 1), static_cast<uint32_t>(statuses[i]));
+        }
+        WriteAll(fd, reply.data(), reply.size());
+        _exit(0);
+    };
+
+    size_t m_size;
+    std::vector<Helper> m_idle;
+
+    // zygote のプロセス ID と制御用のソケット
+    pid_t m_zygotePid = -1;
+    int m_zygoteFd = -1;
+
+    // 送信するジョブの領域を再利用する
+    std::string m_message;
+};
+
+// JSON を大きなバッファに書き込み、いっぱいになったら fd に書き出す
+// 書き出しに失敗した場合は std::runtime_error を投げる
+class JsonWriter final
+{
+public:
+    explicit JsonWriter(const int fd, const size_t bufferSize = 1 << 20) : m_fd(fd), m_buffer(std::make_unique<char[]>(bufferSize)), m_bufferSize(bufferSize){};
+    JsonWriter(const JsonWriter &) = delete;
+    JsonWriter &operator=(const JsonWriter &) = delete;
+
+    // デストラクタでは例外を投げられないので、書き出しのエラーを知るには先に Flush を呼ぶ
+    ~JsonWriter()
+    {
+        try
+        {
+            Flush();
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+    };
+
+    // s をそのまま書き込む
+    void Raw(const std::string_view s)
+    {
+        auto data = s.data();
+        auto rest = s.size();
+        while (rest > 0)
+        {
+            if (m_used == m_bufferSize)
+            {
+                Flush();
+            }
+            const auto n = std::min(rest, m_bufferSize - m_used);
+            memcpy(m_buffer.get() + m_used, data, n);
+            m_used += n;
+            data += n;
+            rest -= n;
+        }
+    };
+
+    // s をエスケープし、'"' で囲んで書き込む
+    // エスケープの不要な範囲はまとめてコピーする
+    // 0x80 以上のバイトはそのまま書き込むので、s が UTF-8 でなければ出力も正しい JSON にならない
+    void String(const std::string_view s)
+    {
+        Raw("\"");
+        size_t begin = 0;
+        for (size_t i = 0; i < s.size(); i++)
+        {
+            const auto c = static_cast<unsigned char>(s[i]);
+            if (c >= 0x20 && c != '"' && c != '\\')
+            {
+                continue;
+            }
+            Raw(s.substr(begin, i - begin));
+            begin = i + 1;
+            switch (c)
+            {
+            case '"':
+                Raw("\\\"");
+                break;
+            case '\\':
+                Raw("\\\\");
+                break;
+            case '\n':
+                Raw("\\n");
+                break;
+            case '\t':
+                Raw("\\t");
+                break;
+            case '\r':
+                Raw("\\r");
+                break;
+            default:
+                constexpr char hex[] = "0123456789abcdef";
+                const char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                Raw(std::string_view(escaped, sizeof(escaped)));
+            }
+        }
+        Raw(s.substr(begin));
+        Raw("\"");
+    };
+
+    // job を 1 行の JSON オブジェクトとして書き込む
+    // {"commands":[["cmd1","aaa"],["cmd2"]],"redirect":"out.txt"}
+    void WriteJob(const Job &job)
+    {
+        Raw("{\"commands\":[");
+        for (size_t i = 0; i < job.commands.size(); i++)
+        {
+            Raw(i == 0 ? "[" : ",[");
+            const auto &args = job.commands[i].args;
+            for (size_t j = 0; j < args.size(); j++)
+            {
+                if (j != 0)
+                {
+                    Raw(",");
+                }
+                String(args[j]);
+            }
+            Raw("]");
+        }
+        Raw("],\"redirect\":");
+        String(job.redirectFilename);
+        Raw("}\n");
+    };
+
+    // バッファの内容を fd に書き出す
+    void Flush()
+    {
+        size_t written = 0;
+        while (written < m_used)
+        {
+            const auto n = write(m_fd, m_buffer.get() + written, m_used - written);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                m_used = 0;
+                throw std::runtime_error(std::string("write に失敗しました, ") + strerror(errno));
+            }
+            written += n;
+        }
+        m_writtenBytes += m_used;
+        m_used = 0;
+    };
+
+    // Flush で書き出したバイト数
+    size_t WrittenBytes() const { return m_writtenBytes; };
+
+private:
+    int m_fd;
+    std::unique_ptr<char[]> m_buffer;
+    size_t m_bufferSize;
+    size_t m_used = 0;
+    size_t m_writtenBytes = 0;
+};
+
+// inFd から 1 行に 1 つのジョブを読み込み、パースした Job を 1 行に 1 つの JSON オブジェクトとして outFd に書き出す
+// 書き出したバイト数を返す
+// 読み込みや書き出しに失敗した場合と、<LIST_OP> を含む行がある場合は std::runtime_error を投げる
+// <LIST_OP> の後ろの <JOB> を黙って捨てないように、それまでの行だけを書き出して止める
+size_t WriteJobsAsJson(const int inFd, const int outFd)
+{
+    JobStreamParser parser;
+    JsonWriter writer(outFd);
+    size_t lineNumber = 0;
+    const auto onJob = [&](Job &&job) {
+        lineNumber++;
+        if (parser.HasListOperator())
+        {
+            writer.Flush();
+            throw std::runtime_error(std::to_string(lineNumber) + " 行目に <LIST_OP> が含まれています");
+        }
+        writer.WriteJob(job);
+    };
+
+    std::vector<char> chunk(1 << 16);
+    for (;;)
+    {
+        const auto n = read(inFd, chunk.data(), chunk.size());
+        if (n == 0)
+        {
+            break;
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::runtime_error(std::string("read に失敗しました, ") + strerror(errno));
+        }
+        parser.Feed(std::string_view(chunk.data(), n), onJob);
+    }
+    parser.Finish(onJob);
+    writer.Flush();
+    return writer.WrittenBytes();
+}
+
+// テストとベンチマークで確保回数を数えるため、グローバルな operator new を置き換える
+// インライン展開されると malloc と delete の組み合わせだと誤って警告されるので、展開させない
+std::atomic<size_t> g_allocationCount{0};
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size == 0 ? 1 : size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// std::pmr::new_delete_resource はアライメントを指定して確保するので、こちらも数える
+__attribute__((noinline)) void *operator new(size_t size, std::align_val_t alignment)
+{
+    g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+    const auto align = std::max(static_cast<size_t>(alignment), sizeof(void *));
+    void *p = nullptr;
+    if (posix_memalign(&p, align, size == 0 ? 1 : size) == 0)
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+// テストやベンチマークの入力を再現できるように作る乱数
+class BenchRandom final
+{
+public:
+    size_t Next(const size_t n)
+    {
+        m_state = m_state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (m_state >> 33) % n;
+    };
+
+private:
+    uint64_t m_state = 42;
+};
+
+void TestParseJob(const char *in, const std::vector<std::vector<std::string>> expectCommands, const std::filesystem::path expectRedirectFilename)
+{
+    StringToBeParsed str(in);
+    const auto testeeJob = ParseJob(str);
+
+    // コマンド一覧をテストする
+    std::vector<std::vector<std::string>> testeeCommands;
+    for (const auto &cmd : testeeJob.commands)
+    {
+        std::vector<std::string> args;
+        for (const auto &arg : cmd.args)
+        {
+            args.emplace_back(arg);
+        }
+        testeeCommands.push_back(args);
+    }
+    if (testeeCommands != expectCommands)
+    {
+        fprintf(stderr, "コマンドテスト失敗, \"%s\"\n", in);
+        return;
+    }
+
+    // リダイレクトをテストする
+    if (std::filesystem::path(testeeJob.redirectFilename) != expectRedirectFilename)
+    {
+        fprintf(stderr, "リダイレクトテスト失敗, \"%s\"\n", in);
+        return;
+    }
+
+    // OK
+    printf("テスト成功, \"%s\"\n", in);
+}
+
+// BuildQuoteMasks と BuildQuoteMasksScalar がランダムな文字列で一致することをテストする
+void TestBuildQuoteMasks()
+{
+    // 64 文字のブロックの境界をまたぐように長い文字列も作る
+    const char alphabet[] = "ab '\"\\|";
+    unsigned seed = 1;
+    for (int i = 0; i < 5000; i++)
+    {
+        std::string s(i % 300, ' ');
+        for (auto &c : s)
+        {
+            seed = seed * 1103515245 + 12345;
+            c = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        }
+        if (BuildQuoteMasks(s) != BuildQuoteMasksScalar(s))
+        {
+            fprintf(stderr, "クォーテーションのマスクテスト失敗, \"%s\"\n", s.c_str());
+            return;
+        }
+    }
+
+    // OK
+    printf("クォーテーションのマスクテスト成功\n");
+}
+
+// Job をテストで比較しやすい形に変換する
+std::vector<std::vector<std::string>> ToStrings(const Job &job)
+{
+    std::vector<std::vector<std::string>> commands;
+    for (const auto &cmd : job.commands)
+    {
+        commands.emplace_back(cmd.args.begin(), cmd.args.end());
+    }
+    return commands;
+}
+
+// ParseCommandList の結果をテストする
+// expectJobs は <JOB> ごとのコマンド一覧、リダイレクト先、後ろの <LIST_OP>
+void TestParseCommandList(const char *in, const std::vector<std::tuple<std::vector<std::vector<std::string>>, std::string, ListOperator>> &expectJobs)
+{
+    StringToBeParsed str(in);
+    const auto list = ParseCommandList(str);
+    bool ok = list.size() == expectJobs.size();
+    for (size_t i = 0; ok && i < list.size(); i++)
+    {
+        const auto &[expectCommands, expectRedirectFilename, expectOp] = expectJobs[i];
+        ok = ToStrings(list[i].job) == expectCommands && std::string_view(list[i].job.redirectFilename) == expectRedirectFilename && list[i].op == expectOp;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "リストテスト失敗, \"%s\"\n", in);
+        return;
+    }
+
+    // OK
+    printf("リストテスト成功, \"%s\"\n", in);
+}
+
+// 複数行の in を 1 文字ずつ JobStreamParser に渡し、各行を ParseJob した結果と一致することをテストする
+void TestJobStreamParser(const std::vector<std::string> &lines)
+{
+    std::string in;
+    for (const auto &line : lines)
+    {
+        in += line + "\n";
+    }
+    // 最後の行は '\n' で終わらせない
+    in.pop_back();
+
+    // 受け取った文字はちょうど一度ずつ解析され、行の途中で分割されても前の部分を解析し直さない
+    std::vector<Job> testeeJobs;
+    JobStreamParser parser;
+    bool scannedOnce = true;
+    for (const auto c : in)
+    {
+        const auto scannedBefore = parser.ScannedBytes();
+        parser.Feed(std::string_view(&c, 1), [&](Job &&job) { testeeJobs.push_back(std::move(job)); });
+        scannedOnce &= parser.ScannedBytes() == scannedBefore + 1;
+    }
+    const auto scannedBeforeFinish = parser.ScannedBytes();
+    parser.Finish([&](Job &&job) { testeeJobs.push_back(std::move(job)); });
+
+    if (!scannedOnce || scannedBeforeFinish != in.size() || parser.ScannedBytes() != scannedBeforeFinish || testeeJobs.size() != lines.size())
+    {
+        fprintf(stderr, "ストリームパーサーテスト失敗\n");
+        return;
+    }
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        StringToBeParsed str(lines[i]);
+        const auto expectJob = ParseJob(str);
+        if (ToStrings(testeeJobs[i]) != ToStrings(expectJob) || testeeJobs[i].redirectFilename != expectJob.redirectFilename)
+        {
+            fprintf(stderr, "ストリームパーサーテスト失敗, \"%s\"\n", lines[i].c_str());
+            return;
+        }
+    }
+
+    // OK
+    printf("ストリームパーサーテスト成功\n");
+}
+
+// ParseJobEvents の通知から組み立てた Job が、ParseJob の結果と一致することをテストする
+void TestParseJobEvents(const char *in)
+{
+    struct Visitor : JobVisitorBase
+    {
+        void OnCommandBegin() { commands.emplace_back(); };
+        void OnArg(std::string_view arg) { commands.back().emplace_back(arg); };
+        void OnPipe() { pipes++; };
+        void OnRedirect(std::string_view filename) { redirectFilename = filename; };
+        void OnJobEnd() { ended = true; };
+
+        std::vector<std::vector<std::string>> commands;
+        size_t pipes = 0;
+        std::string redirectFilename;
+        bool ended = false;
+    } visitor;
+
+    StringToBeParsed testeeStr(in);
+    ParseJobEvents(testeeStr, visitor);
+    StringToBeParsed expectStr(in);
+    const auto expectJob = ParseJob(expectStr);
+
+    if (visitor.commands != ToStrings(expectJob) || visitor.redirectFilename != std::string_view(expectJob.redirectFilename) || !visitor.ended ||
+        visitor.pipes + 1 != std::max<size_t>(visitor.commands.size(), 1))
+    {
+        fprintf(stderr, "イベント通知テスト失敗, \"%s\"\n", in);
+        return;
+    }
+
+    // OK
+    printf("イベント通知テスト成功, \"%s\"\n", in);
+}
+
+// 同じ Job に繰り返しパースした結果が ParseJob と一致し、同じ形の行ではメモリを確保しないことをテストする
+void TestParseJobReuse()
+{
+    const std::vector<const char *> lines = {
+        "cmd1 aaa    bbb     | cmd2 |cmd3|cmd4 xxx>out.txt",
+        "cmd1 > out.txt|cmd2",
+        "|cmd1",
+        "",
+        "echo 'a b' \"c|d\" e\\ f '' > 'out file.txt'",
+        "cmd1 aaa    bbb     | cmd2 |cmd3|cmd4 xxx>out.txt",
+    };
+
+    StringToBeParsed str("");
+    Job job;
+    for (const auto line : lines)
+    {
+        str.Assign(line);
+        ParseJob(str, job);
+        StringToBeParsed expectStr(line);
+        const auto expectJob = ParseJob(expectStr);
+        if (ToStrings(job) != ToStrings(expectJob) || job.redirectFilename != expectJob.redirectFilename)
+        {
+            fprintf(stderr, "再利用パーステスト失敗, \"%s\"\n", line);
+            return;
+        }
+    }
+
+    // 一度パースした後は、同じ形で長くない行をパースしてもメモリを確保しない
+    const std::vector<const char *> sameShapeLines = {
+        "grep --ignore-case --fixed-strings 'a long pattern value' /var/log/syslog | sort --numeric-sort > /tmp/result-0001.txt",
+        "grep --invert-match --fixed-strings 'other long pattern!!' /var/log/kern.log | sort --reverse-order > /tmp/result-0002.txt",
+        "grep -v -F x /var/log/auth.log | sort -r > /tmp/r.txt",
+    };
+    for (const auto line : sameShapeLines)
+    {
+        str.Assign(line);
+        ParseJob(str, job);
+    }
+    const auto allocations = g_allocationCount.load();
+    for (int i = 0; i < 1000; i++)
+    {
+        str.Assign(sameShapeLines[i % sameShapeLines.size()]);
+        ParseJob(str, job);
+    }
+    if (g_allocationCount.load() != allocations || job.commands.size() != 2 || job.redirectFilename != "/tmp/result-0001.txt")
+    {
+        fprintf(stderr, "再利用パースの確保回数テスト失敗\n");
+        return;
+    }
+
+    // 形の異なる行を繰り返す場合も、一巡した後はメモリを確保しない
+    const std::vector<const char *> mixedLines = {
+        "grep --ignore-case --fixed-strings 'a long pattern value' /var/log/syslog | sort --numeric-sort | uniq --count > /tmp/result-0001.txt",
+        "cat /var/log/messages",
+        "awk '{ print $1, $2, $3, $4 }' /var/log/nginx/access.log | sort | uniq -c | sort -rn | head -n 20",
+        "tail --lines=100 --follow=name /var/log/application/really-long-file-name.log > /tmp/tail-output-file.txt",
+    };
+    for (int i = 0; i < 3; i++)
+    {
+        for (const auto line : mixedLines)
+        {
+            str.Assign(line);
+            ParseJob(str, job);
+        }
+    }
+    const auto mixedAllocations = g_allocationCount.load();
+    for (int i = 0; i < 400; i++)
+    {
+        str.Assign(mixedLines[i % mixedLines.size()]);
+        ParseJob(str, job);
+    }
+    const auto mixedAllocationCount = g_allocationCount.load() - mixedAllocations;
+    StringToBeParsed expectStr(mixedLines[3]);
+    const auto expectJob = ParseJob(expectStr);
+    if (mixedAllocationCount != 0 || ToStrings(job) != ToStrings(expectJob) || job.redirectFilename != expectJob.redirectFilename)
+    {
+        fprintf(stderr, "再利用パースの形の異なる行の確保回数テスト失敗, %zu 回\n", mixedAllocationCount);
+        return;
+    }
+
+    // OK
+    printf("再利用パーステスト成功\n");
+}
+
+// ParseJobFixed が ParseJob と同じ結果をメモリを確保せずに作ることと、上限を超えた場合のエラーをテストする
+void TestParseJobFixed()
+{
+    const std::vector<std::string> lines = {
+        "cmd1 aaa    bbb     | cmd2 |cmd3|cmd4 xxx>out.txt",
+        "|cmd1| > out.txt|cmd2",
+        "echo 'a b' \"c|d\" e\\ f '' \"x\\y\" > 'out file.txt'",
+        "echo 'a;b' c\\&d > out.txt 'x;y' | z",
+        "echo \"unterminated | grep",
+        "cmd1 aaa\ncmd2",
+        "cmd1 aaa\n|",
+        "cmd1 > ''",
+        "",
+    };
+    for (const auto &line : lines)
+    {
+        std::string buffer = line;
+        FixedJob<4, 8> job;
+        const auto allocations = g_allocationCount.load();
+        const auto result = ParseJobFixed(buffer.data(), buffer.size(), job);
+        if (g_allocationCount.load() != allocations || result != FixedParseResult::Ok)
+        {
+            fprintf(stderr, "固定長パーステスト失敗, \"%s\"\n", line.c_str());
+            return;
+        }
+
+        std::vector<std::vector<std::string>> commands;
+        for (size_t i = 0; i < job.commandCount; i++)
+        {
+            commands.emplace_back(job.commands[i].args, job.commands[i].args + job.commands[i].argCount);
+        }
+        StringToBeParsed str(line);
+        const auto expectJob = ParseJob(str);
+        if (commands != ToStrings(expectJob) || job.redirectFilename != std::string_view(expectJob.redirectFilename))
+        {
+            fprintf(stderr, "固定長パーステスト失敗, \"%s\"\n", line.c_str());
+            return;
+        }
+    }
+
+    char tooManyCommands[] = "a|b|c";
+    char tooManyArgs[] = "a b c | d";
+    char sequence[] = "a; b";
+    char orAfterRedirect[] = "a > out.txt || b";
+    FixedJob<2, 2> smallJob;
+    if (ParseJobFixed(tooManyCommands, strlen(tooManyCommands), smallJob) != FixedParseResult::TooManyCommands ||
+        ParseJobFixed(tooManyArgs, strlen(tooManyArgs), smallJob) != FixedParseResult::TooManyArgs ||
+        ParseJobFixed(sequence, strlen(sequence), smallJob) != FixedParseResult::ListOperator ||
+        ParseJobFixed(orAfterRedirect, strlen(orAfterRedirect), smallJob) != FixedParseResult::ListOperator)
+    {
+        fprintf(stderr, "固定長パースのエラーテスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("固定長パーステスト成功\n");
+}
+
+// ParseJobParallel がランダムな長い行で ParseJob と一致することをテストする
+void TestParseJobParallel()
+{
+    const std::vector<std::string> pieces = {"cmd", " ", "  ", "|", " | ", "'a | b'", "\"c > d\"", "e\\|f", "'", "\"", "\\", ">", "out", "\n", "''", "'x;y&z'", "e\\;f", ";", "&", "||"};
+    BenchRandom random;
+    for (int i = 0; i < 2000; i++)
+    {
+        std::string line;
+        const auto count = random.Next(200);
+        for (size_t j = 0; j < count; j++)
+        {
+            // 終端になる文字は少なくする
+            auto piece = pieces[random.Next(pieces.size())];
+            if ((piece == ">" || piece == "\n" || piece == "'" || piece == "\"" || piece == ";" || piece == "&" || piece == "||") && random.Next(20) != 0)
+            {
+                piece = "x";
+            }
+            line += piece;
+        }
+
+        StringToBeParsed str(line);
+        const auto expectJob = ParseJob(str);
+        const auto testeeJob = ParseJobParallel(line, 4);
+        if (ToStrings(testeeJob) != ToStrings(expectJob) || testeeJob.redirectFilename != expectJob.redirectFilename)
+        {
+            fprintf(stderr, "並列パーステスト失敗, \"%s\"\n", line.c_str());
+            return;
+        }
+    }
+
+    // "||" が 64 文字のブロックの境界をまたぐ
+    for (const auto &line : {"x |" + std::string(60, 'a') + "||b | c", "x |" + std::string(61, 'a') + "||b | c"})
+    {
+        StringToBeParsed str(line);
+        const auto expectJob = ParseJob(str);
+        const auto testeeJob = ParseJobParallel(line, 4);
+        if (ToStrings(testeeJob) != ToStrings(expectJob) || expectJob.commands.size() != 2)
+        {
+            fprintf(stderr, "並列パーステスト失敗, \"%s\"\n", line.c_str());
+            return;
+        }
+    }
+
+    // OK
+    printf("並列パーステスト成功\n");
+}
+
+// StringInterner が同じ文字列を 1 つだけ保持し、InternedJob をポインタで比較できることをテストする
+void TestStringInterner()
+{
+    StringInterner interner;
+    StringToBeParsed str1("grep -v foo /dev/null | sort > /dev/null");
+    StringToBeParsed str2("grep   -v foo /dev/null|sort >/dev/null");
+    StringToBeParsed str3("grep -v bar /dev/null | sort > /dev/null");
+    const auto job1 = InternJob(ParseJob(str1), interner);
+    const auto job2 = InternJob(ParseJob(str2), interner);
+    const auto job3 = InternJob(ParseJob(str3), interner);
+
+    bool ok = job1 == job2 && job1 != job3;
+    ok &= job1.commands[0][3] == job1.redirectFilename && job1.redirectFilename.View() == "/dev/null";
+    ok &= interner.Intern("") == InternedString() && interner.Intern("sort") == job3.commands[1][0];
+    // "grep", "-v", "foo", "/dev/null", "sort", "bar" の 6 つだけが保持される
+    ok &= interner.Count() == 6 && interner.StoredBytes() == 4 + 2 + 3 + 9 + 4 + 3;
+    // 使用量には文字列を格納したチャンクと表も含まれる
+    ok &= interner.FootprintBytes() >= 64 * 1024 + interner.StoredBytes();
+
+    // 複数のスレッドから同時に登録しても、同じ文字列は同じハンドルになる
+    std::vector<std::vector<InternedString>> handles(4);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < handles.size(); t++)
+    {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 1000; i++)
+            {
+                handles[t].push_back(interner.Intern("arg" + std::to_string(i)));
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    for (const auto &h : handles)
+    {
+        ok &= h == handles[0];
+    }
+    ok &= handles[0][42].View() == "arg42";
+
+    if (!ok)
+    {
+        fprintf(stderr, "文字列の共有テスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("文字列の共有テスト成功\n");
+}
+
+// HashJob が空白の違いを無視し、構造の違いを区別することをテストする
+void TestHashJob(const char *a, const char *b, const bool expectEqual)
+{
+    // vector の要素として並べ替えられるように、代入とムーブができる
+    static_assert(std::is_nothrow_move_constructible_v<HashedJob> && std::is_move_assignable_v<HashedJob> && std::is_copy_assignable_v<HashedJob>);
+
+    StringToBeParsed strA(a);
+    StringToBeParsed strB(b);
+    const HashedJob jobA(ParseJob(strA));
+    const HashedJob jobB(ParseJob(strB));
+    const auto hashEqual = jobA.hash == jobB.hash;
+    if (hashEqual != expectEqual || (jobA == jobB) != expectEqual || (jobA.job == jobB.job) != expectEqual ||
+        (std::hash<Job>()(jobA.job) == std::hash<Job>()(jobB.job)) != expectEqual)
+    {
+        fprintf(stderr, "ハッシュテスト失敗, \"%s\", \"%s\"\n", a, b);
+        return;
+    }
+
+    // OK
+    printf("ハッシュテスト成功, \"%s\", \"%s\"\n", a, b);
+}
+
+// ParseStaticJob がコンパイル時にパースできることと、不正な文字列を拒否することをテストする
+void TestParseStaticJob()
+{
+    constexpr auto job = ParseStaticJob("cmd1 'a b'  c|cmd2 \"\"|cmd3 > \"out file.txt\"");
+    static_assert(job.CommandCount() == 3);
+    static_assert(job.ArgCount(0) == 3 && job.Arg(0, 0) == "cmd1" && job.Arg(0, 1) == "a b" && job.Arg(0, 2) == "c");
+    static_assert(job.ArgCount(1) == 2 && job.Arg(1, 1).empty());
+    static_assert(job.ArgCount(2) == 1 && job.Arg(2, 0) == "cmd3");
+    static_assert(job.RedirectFilename() == "out file.txt");
+    static_assert(ParseStaticJob("").CommandCount() == 0);
+    static_assert(ParseStaticJob("cmd a\n").CommandCount() == 1 && ParseStaticJob("cmd a\n").Arg(0, 1) == "a");
+    static_assert(ParseStaticJob("cmd > out.txt\n").RedirectFilename() == "out.txt");
+    static_assert(ParseStaticJob("echo 'a;b' c\\&d \"x||y\"").ArgCount(0) == 4);
+    static_assert(ParseStaticJob("cmd > ''").CommandCount() == 1 && ParseStaticJob("cmd > ''").RedirectFilename().empty());
+
+    // 実行時の ParseJob と同じ結果になる
+    StringToBeParsed str("cmd1 'a b'  c|cmd2 \"\"|cmd3 > \"out file.txt\"");
+    const auto expectJob = ParseJob(str);
+    const auto testeeJob = job.ToJob();
+    if (ToStrings(testeeJob) != ToStrings(expectJob) || testeeJob.redirectFilename != expectJob.redirectFilename)
+    {
+        fprintf(stderr, "静的パーステスト失敗\n");
+        return;
+    }
+
+    // 不正な文字列は constexpr な変数ではコンパイルエラーになり、実行時は例外になる
+    const auto rejects = [](auto parse) {
+        try
+        {
+            parse();
+        }
+        catch (const std::invalid_argument &)
+        {
+            return true;
+        }
+        return false;
+    };
+    if (!rejects([] { ParseStaticJob("echo 'unterminated"); }) ||
+        !rejects([] { ParseStaticJob("echo 'abc\n"); }) ||
+        !rejects([] { ParseStaticJob("echo \"abc\\\n"); }) ||
+        !rejects([] { ParseStaticJob("echo >"); }) ||
+        !rejects([] { ParseStaticJob("a\nb"); }) ||
+        !rejects([] { ParseStaticJob("a\n\n"); }) ||
+        !rejects([] { ParseStaticJob("a\n|"); }) ||
+        !rejects([] { ParseStaticJob("a\n "); }) ||
+        !rejects([] { ParseStaticJob("a; b"); }) ||
+        !rejects([] { ParseStaticJob("a & b"); }) ||
+        !rejects([] { ParseStaticJob("a && b"); }) ||
+        !rejects([] { ParseStaticJob("a || b"); }) ||
+        !rejects([] { ParseStaticJob("a > out.txt 'x' ; b"); }) ||
+        !rejects([] { ParseStaticJob<2>("a|b|c"); }) ||
+        !rejects([] { ParseStaticJob<16, 2>("a b c"); }))
+    {
+        fprintf(stderr, "静的パースのエラーテスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("静的パーステスト成功\n");
+}
+
+// 確保と解放の回数を数える memory_resource
+// 実際の確保は m_upstream に任せる
+class CountingResource final : public std::pmr::memory_resource
+{
+public:
+    explicit CountingResource(std::pmr::memory_resource *upstream = std::pmr::new_delete_resource()) : m_upstream(upstream){};
+
+    size_t allocateCount = 0;
+    size_t deallocateCount = 0;
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        allocateCount++;
+        return m_upstream->allocate(bytes, alignment);
+    };
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        deallocateCount++;
+        m_upstream->deallocate(p, bytes, alignment);
+    };
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    };
+
+    std::pmr::memory_resource *m_upstream;
+};
+
+// monotonic_buffer_resource にパースし、一度に解放できることをテストする
+void TestParseJobPmr(const char *in)
+{
+    CountingResource upstream;
+    std::pmr::monotonic_buffer_resource mono(&upstream);
+    const auto defaultResource = std::pmr::get_default_resource();
+
+    // デフォルトのリソースから確保されていないことを調べるため、デフォルトを数えるリソースに差し替える
+    CountingResource defaultCounter(defaultResource);
+    std::pmr::set_default_resource(&defaultCounter);
+    bool usesMono = true;
+    for (int i = 0; i < 100; i++)
+    {
+        StringToBeParsed str(in);
+        const auto job = ParseJob(str, &mono);
+        usesMono &= job.get_allocator().resource() == &mono && job.redirectFilename.get_allocator().resource() == &mono;
+        for (const auto &cmd : job.commands)
+        {
+            usesMono &= cmd.get_allocator().resource() == &mono;
+            for (const auto &arg : cmd.args)
+            {
+                usesMono &= arg.get_allocator().resource() == &mono;
+            }
+        }
+    }
+    std::pmr::set_default_resource(defaultResource);
+
+    if (!usesMono || defaultCounter.allocateCount != 0)
+    {
+        fprintf(stderr, "pmr テスト失敗, \"%s\"\n", in);
+        return;
+    }
+
+    // Job の破棄では解放されず、release で一度に解放される
+    const auto allocated = upstream.allocateCount;
+    if (allocated == 0 || upstream.deallocateCount != 0)
+    {
+        fprintf(stderr, "pmr テスト失敗, \"%s\"\n", in);
+        return;
+    }
+    mono.release();
+    if (upstream.deallocateCount != allocated)
+    {
+        fprintf(stderr, "pmr 解放テスト失敗, \"%s\"\n", in);
+        return;
+    }
+
+    // OK
+    printf("pmr テスト成功, \"%s\"\n", in);
+}
+
+// 一時ディレクトリを作成して、そのパスを返す
+// 作成できない場合は std::runtime_error を投げる
+std::filesystem::path MakeTempDirectory()
+{
+    auto pattern = (std::filesystem::temp_directory_path() / "syntaxanalysis_XXXXXX").string();
+    if (mkdtemp(pattern.data()) == nullptr)
+    {
+        throw std::runtime_error(std::string("mkdtemp に失敗しました, ") + strerror(errno));
+    }
+    return pattern;
+}
+
+// ファイルの内容をすべて読み込む
+std::string ReadFile(const std::filesystem::path &path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+// Job をバイナリ形式でファイルに書き込み、mmap して読み出した結果が元の Job と一致することをテストする
+void TestEncodedJob()
+{
+    const std::vector<std::string> lines = {
+        "cmd1 aaa    bbb     | cmd2 |cmd3|cmd4 xxx>out.txt",
+        "|cmd1|| > out.txt|cmd2",
+        "echo 'a b' \"c|d\" e\\ f '' \"x\\y\" > 'out file.txt'",
+        "cmd1 aaa\ncmd2",
+        "",
+    };
+    std::vector<Job> jobs;
+    std::string encoded;
+    for (const auto &line : lines)
+    {
+        StringToBeParsed str(line);
+        jobs.push_back(ParseJob(str));
+        AppendEncodedJob(jobs.back(), encoded);
+    }
+
+    const auto tempDir = MakeTempDirectory();
+    const auto path = tempDir / "jobs.bin";
+    std::ofstream(path, std::ios::binary).write(encoded.data(), encoded.size());
+
+    try
+    {
+        MappedFile file(path);
+        EncodedJobReader reader(file.View());
+        EncodedJob encodedJob;
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            // 読み出すときは確保しない
+            const auto allocations = g_allocationCount.load();
+            size_t argBytes = 0;
+            const auto found = reader.Next(encodedJob);
+            for (const auto &cmd : encodedJob)
+            {
+                for (const auto arg : cmd)
+                {
+                    argBytes += arg.size();
+                }
+            }
+            const auto readAllocations = g_allocationCount.load() - allocations;
+
+            size_t expectArgBytes = 0;
+            for (const auto &cmd : jobs[i].commands)
+            {
+                for (const auto &arg : cmd.args)
+                {
+                    expectArgBytes += arg.size();
+                }
+            }
+            if (!found || readAllocations != 0 || argBytes != expectArgBytes || encodedJob.ToJob() != jobs[i] ||
+                encodedJob.RedirectFilename() != std::string_view(jobs[i].redirectFilename) || encodedJob.Hash() != HashJob(jobs[i]))
+            {
+                fprintf(stderr, "バイナリ形式テスト失敗, \"%s\"\n", lines[i].c_str());
+                std::filesystem::remove_all(tempDir);
+                return;
+            }
+        }
+        if (reader.Next(encodedJob))
+        {
+            fprintf(stderr, "バイナリ形式テスト失敗, 余分なレコード\n");
+            std::filesystem::remove_all(tempDir);
+            return;
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        fprintf(stderr, "バイナリ形式テスト失敗, %s\n", e.what());
+        std::filesystem::remove_all(tempDir);
+        return;
+    }
+    std::filesystem::remove_all(tempDir);
+
+    // 途中で切れたデータは例外になるか、切れる前のレコードだけを読み出す
+    // 長さが壊れたデータは例外になるか、別のレコードとして読み出す
+    // どちらもデータの範囲外は読まない。ちょうどの大きさの領域にコピーするので、AddressSanitizer で確認できる
+    const auto readAll = [](const std::string_view data, std::vector<Job> &read) {
+        const auto copy = std::make_unique<char[]>(data.size());
+        std::copy(data.begin(), data.end(), copy.get());
+        EncodedJobReader reader(std::string_view(copy.get(), data.size()));
+        EncodedJob encodedJob;
+        try
+        {
+            while (reader.Next(encodedJob))
+            {
+                read.push_back(encodedJob.ToJob());
+                encodedJob.Hash();
+            }
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+    };
+    for (size_t size = 1; size < encoded.size(); size++)
+    {
+        std::vector<Job> read;
+        readAll(std::string_view(encoded).substr(0, size), read);
+        if (read.size() >= jobs.size() || !std::equal(read.begin(), read.end(), jobs.begin()))
+        {
+            fprintf(stderr, "バイナリ形式テスト失敗, %zu バイトで切れたデータ\n", size);
+            return;
+        }
+
+        std::string broken = encoded;
+        broken[size] ^= 0x7f;
+        read.clear();
+        readAll(broken, read);
+    }
+
+    // OK
+    printf("バイナリ形式テスト成功\n");
+}
+
+// WriteJobsAsJson が 1 行に 1 つの JSON オブジェクトを書き出すことをテストする
+void TestWriteJobsAsJson()
+{
+    const auto tempDir = MakeTempDirectory();
+    const auto convert = [&](const std::string &input, std::string &output, std::string &error) {
+        const auto inPath = tempDir / "in.txt";
+        const auto outPath = tempDir / "out.json";
+        std::ofstream(inPath, std::ios::binary) << input;
+
+        const int inFd = open(inPath.c_str(), O_RDONLY | O_CLOEXEC);
+        const int outFd = open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        try
+        {
+            WriteJobsAsJson(inFd, outFd);
+        }
+        catch (const std::runtime_error &e)
+        {
+            error = e.what();
+        }
+        close(inFd);
+        close(outFd);
+        output = ReadFile(outPath);
+    };
+
+    const std::string input = "cmd1 aaa | cmd2 > out.txt\necho 'a\"b' c\\\\d\tx\x01\n\na";
+    const std::string expectOutput = "{\"commands\":[[\"cmd1\",\"aaa\"],[\"cmd2\"]],\"redirect\":\"out.txt\"}\n"
+                                     "{\"commands\":[[\"echo\",\"a\\\"b\",\"c\\\\d\\tx\\u0001\"]],\"redirect\":\"\"}\n"
+                                     "{\"commands\":[],\"redirect\":\"\"}\n"
+                                     "{\"commands\":[[\"a\"]],\"redirect\":\"\"}\n";
+    std::string output;
+    std::string error;
+    convert(input, output, error);
+    if (!error.empty() || output != expectOutput)
+    {
+        fprintf(stderr, "JSON 出力テスト失敗, %s\n%s", error.c_str(), output.c_str());
+        std::filesystem::remove_all(tempDir);
+        return;
+    }
+
+    // <LIST_OP> の後ろを捨てずに、それまでの行を書き出してエラーにする
+    std::string listError;
+    convert("echo 'a;b'\ncmd1 > out.txt && cmd2\ncmd3\n", output, listError);
+    std::filesystem::remove_all(tempDir);
+    if (listError.find("2 行目") == std::string::npos || output != "{\"commands\":[[\"echo\",\"a;b\"]],\"redirect\":\"\"}\n")
+    {
+        fprintf(stderr, "JSON 出力の <LIST_OP> テスト失敗, %s\n%s", listError.c_str(), output.c_str());
+        return;
+    }
+
+    // OK
+    printf("JSON 出力テスト成功\n");
+}
+
+// RunCommandList の終了ステータスとリダイレクト先の内容をテストする
+void TestRunCommandList(const std::string &in, const std::vector<std::vector<int>> &expectStatuses, const std::string &redirectFilename,
+                        const std::string &expectRedirectContent)
+{
+    StringToBeParsed str(in);
+    const auto list = ParseCommandList(str);
+    std::vector<std::vector<int>> testeeStatuses;
+    try
+    {
+        testeeStatuses = RunCommandList(list);
+    }
+    catch (const std::runtime_error &e)
+    {
+        fprintf(stderr, "リスト実行テスト失敗, \"%s\", %s\n", in.c_str(), e.what());
+        return;
+    }
+    if (testeeStatuses != expectStatuses || (!redirectFilename.empty() && ReadFile(redirectFilename) != expectRedirectContent))
+    {
+        fprintf(stderr, "リスト実行テスト失敗, \"%s\"\n", in.c_str());
+        return;
+    }
+
+    // OK
+    printf("リスト実行テスト成功, \"%s\"\n", in.c_str());
+}
+
+// '&' で起動したジョブが同時に実行されることをテストする
+void TestRunCommandListBackground()
+{
+    StringToBeParsed str("sleep 0.3 & sleep 0.3 & sleep 0.3 & no_such_command_syntaxanalysis & true");
+    const auto list = ParseCommandList(str);
+    const auto start = std::chrono::steady_clock::now();
+    const auto statuses = RunCommandList(list);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (statuses != std::vector<std::vector<int>>{{0}, {0}, {0}, {127}, {0}} || elapsed.count() >= 0.8)
+    {
+        fprintf(stderr, "バックグラウンド実行テスト失敗, %f 秒\n", elapsed.count());
+        return;
+    }
+
+    // '&' は "&&" で連結した <JOB> 全体をバックグラウンドで実行し、フォアグラウンドの <JOB> の実行中も連結が先に進む
+    StringToBeParsed chainStr("sleep 0.2 && sleep 0.2 & sleep 0.2 && false || sleep 0.2 & sleep 0.4");
+    const auto chainList = ParseCommandList(chainStr);
+    const auto chainStart = std::chrono::steady_clock::now();
+    const auto chainStatuses = RunCommandList(chainList);
+    const std::chrono::duration<double> chainElapsed = std::chrono::steady_clock::now() - chainStart;
+    if (chainStatuses != std::vector<std::vector<int>>{{0}, {0}, {0}, {1}, {0}, {0}} || chainElapsed.count() >= 0.7)
+    {
+        fprintf(stderr, "バックグラウンド実行テスト失敗, 連結, %f 秒\n", chainElapsed.count());
+        return;
+    }
+
+    // 多数のジョブを終了した順に回収する
+    BackgroundJobScheduler scheduler;
+    StringToBeParsed trueStr("true | true");
+    const auto trueJob = ParseJob(trueStr);
+    for (int i = 0; i < 200; i++)
+    {
+        scheduler.Launch(trueJob);
+    }
+    const auto finished = scheduler.WaitAll();
+    std::unordered_set<size_t> ids;
+    for (const auto &[id, jobStatuses] : finished)
+    {
+        if (jobStatuses != std::vector<int>{0, 0})
+        {
+            fprintf(stderr, "バックグラウンド実行テスト失敗, ジョブ %zu\n", id);
+            return;
+        }
+        ids.insert(id);
+    }
+    if (ids.size() != 200 || scheduler.PendingCount() != 0)
+    {
+        fprintf(stderr, "バックグラウンド実行テスト失敗, %zu 個のジョブ\n", ids.size());
+        return;
+    }
+
+    // OK
+    printf("バックグラウンド実行テスト成功\n");
+}
+
+// BackgroundJobScheduler の制限時間と、終了したときに呼ぶ関数をテストする
+void TestBackgroundJobSchedulerTimeout()
+{
+    BackgroundJobScheduler scheduler;
+    const auto parse = [](const char *line) {
+        StringToBeParsed str(line);
+        return ParseJob(str);
+    };
+    const auto sleepJob = parse("sleep 5 | sleep 5");
+    const auto trueJob = parse("true");
+
+    std::map<size_t, std::pair<std::vector<int>, bool>> results;
+    const auto record = [&](size_t id, std::vector<int> &&statuses, bool timedOut) { results[id] = {std::move(statuses), timedOut}; };
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto slowId = scheduler.Launch(sleepJob, {}, record, std::chrono::milliseconds(100));
+    const auto fastId = scheduler.Launch(trueJob, {}, record, std::chrono::seconds(5));
+    // onComplete を指定しないジョブは Reap で返す
+    const auto plainId = scheduler.Launch(trueJob, {}, nullptr, std::chrono::seconds(5));
+    // onComplete から次のジョブを起動できる
+    size_t chainedId = 0;
+    const auto chainId = scheduler.Launch(trueJob, {}, [&](size_t id, std::vector<int> &&statuses, bool timedOut) {
+        record(id, std::move(statuses), timedOut);
+        chainedId = scheduler.Launch(trueJob, {}, record);
+    });
+
+    // 制限時間の無い Reap も、制限時間を過ぎたジョブの回収までに止まらない
+    const auto finished = scheduler.WaitAll();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    bool ok = finished == std::vector<BackgroundJobScheduler::Finished>{{plainId, {0}}};
+    ok &= results.size() == 4;
+    ok &= results[slowId] == std::make_pair(std::vector<int>{128 + SIGKILL, 128 + SIGKILL}, true);
+    ok &= results[fastId] == std::make_pair(std::vector<int>{0}, false);
+    ok &= results[chainId] == std::make_pair(std::vector<int>{0}, false);
+    ok &= chainedId != 0 && results[chainedId] == std::make_pair(std::vector<int>{0}, false);
+    ok &= elapsed.count() >= 0.1 && elapsed.count() < 2;
+
+    // Reap の timeoutMs は、ジョブの制限時間より短ければそちらを優先する
+    scheduler.Launch(sleepJob, {}, record, std::chrono::milliseconds(300));
+    const auto reapStart = std::chrono::steady_clock::now();
+    ok &= scheduler.Reap(50).empty() && scheduler.PendingCount() == 1;
+    const std::chrono::duration<double> reapElapsed = std::chrono::steady_clock::now() - reapStart;
+    ok &= reapElapsed.count() >= 0.05 && reapElapsed.count() < 0.25;
+    scheduler.WaitAll();
+    ok &= results.size() == 5 && results.rbegin()->second.second;
+
+    if (!ok)
+    {
+        fprintf(stderr, "ジョブの制限時間テスト失敗, %f 秒, %f 秒\n", elapsed.count(), reapElapsed.count());
+        return;
+    }
+
+    // OK
+    printf("ジョブの制限時間テスト成功\n");
+}
+
+// RunBatch が行の順に結果を返し、読み込む行の数を制限することをテストする
+void TestRunBatch(const bool ordered)
+{
+    // 先頭の行だけを遅くし、後ろの行が先に終わるようにする
+    std::vector<std::string> lines = {"sleep 0.3"};
+    for (int i = 1; i < 40; i++)
+    {
+        lines.push_back("echo " + std::to_string(i));
+    }
+
+    BatchOptions options;
+    options.parallelism = 4;
+    options.window = 8;
+    options.ordered = ordered;
+    size_t readCount = 0;
+    // nextLine はワーカーから、onResult は呼び出し元のスレッドから呼ばれる
+    std::atomic<size_t> emittedCount{0};
+    size_t readBeforeFirstResult = 0;
+    std::vector<size_t> indices;
+    bool ok = true;
+    const auto count = RunBatch(
+        [&](std::string &line) {
+            if (readCount == lines.size())
+            {
+                return false;
+            }
+            line = lines[readCount++];
+            if (emittedCount == 0)
+            {
+                readBeforeFirstResult = readCount;
+            }
+            return true;
+        },
+        [&](BatchResult &&result) {
+            emittedCount++;
+            indices.push_back(result.index);
+            const auto expectOutput = result.index == 0 ? "" : std::to_string(result.index) + "\n";
+            ok = ok && result.error.empty() && result.statuses == std::vector<int>{0} && result.output.View() == expectOutput;
+        },
+        options);
+
+    // 行の順の場合は、先頭の行が終わるまで window 個より先を読み込まない
+    // RunBatch が先頭の行の結果を取り出してから onResult を呼ぶまでの間に、ワーカーが次の 1 行を読み込むことはある
+    std::vector<size_t> sortedIndices = indices;
+    std::sort(sortedIndices.begin(), sortedIndices.end());
+    bool orderOk = ordered ? std::is_sorted(indices.begin(), indices.end()) && readBeforeFirstResult <= options.window + 1 : indices.front() != 0;
+    if (!ok || count != lines.size() || !orderOk || sortedIndices.back() != lines.size() - 1 ||
+        std::adjacent_find(sortedIndices.begin(), sortedIndices.end()) != sortedIndices.end())
+    {
+        fprintf(stderr, "バッチ実行テスト失敗, ordered = %d\n", ordered);
+        return;
+    }
+
+    // OK
+    printf("バッチ実行テスト成功, ordered = %d\n", ordered);
+}
+
+// nextLine が投げた例外を、RunBatch を呼んだスレッドで受け取れることをテストする
+void TestRunBatchNextLineError()
+{
+    size_t readCount = 0;
+    bool thrown = false;
+    try
+    {
+        RunBatch(
+            [&](std::string &line) {
+                if (readCount == 3)
+                {
+                    throw std::logic_error("nextLine error");
+                }
+                line = "echo " + std::to_string(readCount++);
+                return true;
+            },
+            [](BatchResult &&) {});
+    }
+    catch (const std::logic_error &e)
+    {
+        thrown = std::string(e.what()) == "nextLine error";
+    }
+    if (!thrown)
+    {
+        fprintf(stderr, "バッチ実行の例外テスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("バッチ実行の例外テスト成功\n");
+}
+
+// RunBatch がジョブの標準入力を /dev/null にし、<LIST_OP> を含む行を実行しないことをテストする
+void TestRunBatchInput()
+{
+    // 呼び出し元の標準入力をパイプにし、ジョブが読んでしまうとパイプのデータが出力に現れるようにする
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) != 0)
+    {
+        fprintf(stderr, "バッチ実行の入力テスト失敗, pipe2 に失敗しました\n");
+        return;
+    }
+    const int savedStdin = dup(STDIN_FILENO);
+    dup2(pipeFds[0], STDIN_FILENO);
+    close(pipeFds[0]);
+    const std::string data = "stdin data\n";
+    const bool written = write(pipeFds[1], data.data(), data.size()) == static_cast<ssize_t>(data.size());
+    close(pipeFds[1]);
+
+    const std::vector<std::string> lines = {"cat", "cat -", "echo a; echo b", "true && echo c"};
+    size_t readCount = 0;
+    std::vector<BatchResult> results;
+    RunBatch(
+        [&](std::string &line) {
+            if (readCount == lines.size())
+            {
+                return false;
+            }
+            line = lines[readCount++];
+            return true;
+        },
+        [&](BatchResult &&result) { results.push_back(std::move(result)); });
+
+    // ジョブに読まれていなければ、パイプのデータは残っている
+    std::string rest(data.size(), '\0');
+    const bool restOk = read(STDIN_FILENO, rest.data(), rest.size()) == static_cast<ssize_t>(data.size()) && rest == data;
+    dup2(savedStdin, STDIN_FILENO);
+    close(savedStdin);
+
+    bool ok = written && restOk && results.size() == lines.size();
+    for (size_t i = 0; ok && i < results.size(); i++)
+    {
+        auto &result = results[i];
+        ok = result.index == i;
+        if (i < 2)
+        {
+            ok = ok && result.error.empty() && result.statuses == std::vector<int>{0} && result.output.View().empty();
+        }
+        else
+        {
+            ok = ok && !result.error.empty() && result.statuses.empty() && result.output.View().empty();
+        }
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "バッチ実行の入力テスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("バッチ実行の入力テスト成功\n");
+}
+
+// ZygotePool のヘルパーと、ヘルパーが足りない場合の posix_spawn で、同じ結果になることをテストする
+void TestZygotePool()
+{
+    const auto tempDir = MakeTempDirectory();
+    const auto outPath = (tempDir / "out.txt").string();
+    bool ok = true;
+    try
+    {
+        // zygote を起動する前から開いているパイプも、ヘルパーに引き継がれない
+        int pipeFds[2];
+        if (pipe(pipeFds) != 0)
+        {
+            throw std::runtime_error(std::string("pipe に失敗しました, ") + strerror(errno));
+        }
+        ZygotePool pool(2);
+        int laterPipeFds[2];
+        if (pipe2(laterPipeFds, O_CLOEXEC) != 0)
+        {
+            throw std::runtime_error(std::string("pipe2 に失敗しました, ") + strerror(errno));
+        }
+
+        // 待機中のヘルパーがいる場合といない場合の両方で実行する
+        const auto run = [&](const std::string &line, const std::vector<int> &expectStatuses, const std::string &expectContent) {
+            StringToBeParsed str(line);
+            const auto job = ParseJob(str);
+            for (int i = 0; i < 2; i++)
+            {
+                const bool helperAvailable = pool.IdleCount() > 0;
+                const auto statuses = ZygotePool::Wait(pool.Launch(job));
+                if (helperAvailable != (i == 0) || statuses != expectStatuses || (!expectContent.empty() && ReadFile(outPath) != expectContent))
+                {
+                    fprintf(stderr, "ZygotePool テスト失敗, \"%s\", i = %d\n", line.c_str(), i);
+                    ok = false;
+                }
+                // 1 回目はヘルパーを使い切り、2 回目は posix_spawn で起動する
+                while (i == 0 && pool.IdleCount() > 0)
+                {
+                    ZygotePool::Wait(pool.Launch(Job()));
+                }
+            }
+            pool.Replenish();
+        };
+
+        run("echo hello > " + outPath, {0}, "hello\n");
+        run("printf abc | tr a-z A-Z > " + outPath, {0, 0}, "ABC");
+        run("no_such_command_syntaxanalysis", {127}, "");
+        run("sh -c 'exit 3' | sh -c 'exit 5'", {3, 5}, "");
+
+        // 引数のないコマンドは、起動できなかったものとして 127 になる
+        Job emptyFirstJob;
+        emptyFirstJob.commands.emplace_back();
+        emptyFirstJob.commands.emplace_back().args.emplace_back("true");
+        for (int i = 0; i < 2; i++)
+        {
+            ok = ok && ZygotePool::Wait(pool.Launch(emptyFirstJob)) == std::vector<int>{127, 0};
+            ok = ok && ZygotePool::Wait(pool.Launch(emptyFirstJob)) == std::vector<int>{127, 0};
+            ok = ok && ZygotePool::Wait(pool.Launch(emptyFirstJob)) == std::vector<int>{127, 0};
+            pool.Replenish();
+        }
+
+        // リダイレクト先を開けない場合は、どちらの場合も同じ例外を投げる
+        StringToBeParsed badStr("echo a > " + (tempDir / "missing" / "out.txt").string());
+        const auto badJob = ParseJob(badStr);
+        std::string errors[2];
+        for (auto &error : errors)
+        {
+            try
+            {
+                ZygotePool::Wait(pool.Launch(badJob));
+            }
+            catch (const std::runtime_error &e)
+            {
+                error = e.what();
+            }
+        }
+        ok = ok && !errors[0].empty() && errors[0] == errors[1] && pool.IdleCount() == 0;
+
+        // ヘルパーが書き込み側を持っていなければ、書き込み側を閉じると読み込み側は終わりに達する
+        pool.Replenish();
+        close(pipeFds[1]);
+        close(laterPipeFds[1]);
+        char c;
+        ok = ok && read(pipeFds[0], &c, 1) == 0 && read(laterPipeFds[0], &c, 1) == 0;
+        close(pipeFds[0]);
+        close(laterPipeFds[0]);
+    }
+    catch (const std::runtime_error &e)
+    {
+        fprintf(stderr, "ZygotePool テスト失敗, %s\n", e.what());
+        ok = false;
+    }
+    std::filesystem::remove_all(tempDir);
+    if (!ok)
+    {
+        fprintf(stderr, "ZygotePool テスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("ZygotePool テスト成功\n");
+}
+
+// 組み込みコマンドで実行した結果が、外部コマンドで実行した結果と一致することをテストする
+void TestExecuteJobWithBuiltins()
+{
+    const auto tempDir = MakeTempDirectory();
+    const auto inPath = (tempDir / "in.txt").string();
+    const auto outPath = (tempDir / "out.txt").string();
+    const auto teePath = (tempDir / "tee.txt").string();
+    {
+        // パイプの容量より大きくして、途中で読み込みをやめる場合も調べる
+        std::ofstream in(inPath);
+        for (int i = 0; i < 100000; i++)
+        {
+            in << "line " << i << (i % 3 == 0 ? " foo\n" : " bar  baz\n");
+        }
+        in << "last line without newline foo";
+    }
+
+    const std::vector<std::string> lines = {
+        "cat " + inPath + " | grep foo | wc -l > " + outPath,
+        "cat " + inPath + " | head -n 3 > " + outPath,
+        "cat " + inPath + " | grep -v foo | tee " + teePath + " | wc > " + outPath,
+        "cat " + inPath + " | sort | head -n 2 > " + outPath,
+        "printf 'a b\\nc' | wc -w > " + outPath,
+        "cat " + inPath + " " + inPath + " | wc -c > " + outPath,
+        "cat " + inPath + " | grep zzz > " + outPath,
+        "cat " + inPath + " | tail -n 1 | grep foo > " + outPath,
+        "cat no_such_file_syntaxanalysis > " + outPath,
+        "yes | head -n 5 > " + outPath,
+        "cat " + inPath + " | head -n 0 > " + outPath,
+    };
+    for (const auto &line : lines)
+    {
+        StringToBeParsed str(line);
+        const auto job = ParseJob(str);
+        ExecOptions builtinOptions;
+        builtinOptions.builtins = true;
+
+        std::vector<int> statuses[2];
+        std::string outputs[2];
+        std::string teeOutputs[2];
+        for (int i = 0; i < 2; i++)
+        {
+            std::filesystem::remove(teePath);
+            statuses[i] = i == 0 ? ExecuteJob(job) : ExecuteJob(job, builtinOptions);
+            outputs[i] = ReadFile(outPath);
+            teeOutputs[i] = ReadFile(teePath);
+        }
+        if (statuses[0] != statuses[1] || outputs[0] != outputs[1] || teeOutputs[0] != teeOutputs[1])
+        {
+            fprintf(stderr, "組み込みコマンドテスト失敗, \"%s\"\n", line.c_str());
+            std::filesystem::remove_all(tempDir);
+            return;
+        }
+    }
+
+    // 組み込みコマンドが遅い前のコマンドを待つ間に、CPU を使い続けないことをテストする
+    {
+        StringToBeParsed str("sleep 0.3 | cat | cat | wc -c > " + outPath);
+        ExecOptions builtinOptions;
+        builtinOptions.builtins = true;
+        rusage before{};
+        rusage after{};
+        getrusage(RUSAGE_SELF, &before);
+        const auto statuses = ExecuteJob(ParseJob(str), builtinOptions);
+        getrusage(RUSAGE_SELF, &after);
+        const auto cpuTime = [](const rusage &usage) {
+            return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+                   std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+        };
+        if (statuses != std::vector<int>{0, 0, 0, 0} || cpuTime(after) - cpuTime(before) > std::chrono::milliseconds(100))
+        {
+            fprintf(stderr, "組み込みコマンドの待機テスト失敗\n");
+            std::filesystem::remove_all(tempDir);
+            return;
+        }
+    }
+    std::filesystem::remove_all(tempDir);
+
+    // OK
+    printf("組み込みコマンドテスト成功\n");
+}
+
+// in を実行し、終了ステータスとリダイレクト先の内容をテストする
+void TestExecuteJob(const std::string &in, const std::vector<int> expectStatuses, const std::string &expectRedirectContent)
+{
+    StringToBeParsed str(in.c_str());
+    const auto job = ParseJob(str);
+
+    std::vector<int> testeeStatuses;
+    try
+    {
+        testeeStatuses = ExecuteJob(job);
+    }
+    catch (const std::runtime_error &e)
+    {
+        fprintf(stderr, "実行テスト失敗, \"%s\", %s\n", in.c_str(), e.what());
+        return;
+    }
+
+    if (testeeStatuses != expectStatuses)
+    {
+        fprintf(stderr, "終了ステータステスト失敗, \"%s\"\n", in.c_str());
+        return;
+    }
+
+    if (!job.redirectFilename.empty() && ReadFile(job.redirectFilename.c_str()) != expectRedirectContent)
+    {
+        fprintf(stderr, "リダイレクト先の内容テスト失敗, \"%s\"\n", in.c_str());
+        return;
+    }
+
+    // OK
+    printf("実行テスト成功, \"%s\"\n", in.c_str());
+}
+
+// 引数が空のコマンドは起動できなかったものとして 127 になることをテストする
+void TestExecuteJobEmptyArgs()
+{
+    Job job;
+    job.commands.emplace_back();
+    job.commands.emplace_back();
+    job.commands.back().args.emplace_back("true");
+
+    // 組み込みコマンドを使う場合は、組み込みコマンドと同じジョブの中に引数のないコマンドがある場合もテストする
+    Job builtinJob;
+    builtinJob.commands.emplace_back();
+    builtinJob.commands.emplace_back();
+    builtinJob.commands.back().args.emplace_back("cat");
+    ExecOptions builtinOptions;
+    builtinOptions.builtins = true;
+
+    std::vector<int> testeeStatuses;
+    std::vector<int> builtinStatuses;
+    std::vector<int> builtinOnlyEmptyStatuses;
+    try
+    {
+        testeeStatuses = ExecuteJob(job);
+        builtinStatuses = ExecuteJob(builtinJob, builtinOptions);
+        builtinOnlyEmptyStatuses = ExecuteJob(job, builtinOptions);
+    }
+    catch (const std::runtime_error &e)
+    {
+        fprintf(stderr, "空の引数の実行テスト失敗, %s\n", e.what());
+        return;
+    }
+
+    if (testeeStatuses != std::vector<int>{127, 0} || builtinStatuses != std::vector<int>{127, 0} ||
+        builtinOnlyEmptyStatuses != std::vector<int>{127, 0})
+    {
+        fprintf(stderr, "空の引数の終了ステータステスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("空の引数の実行テスト成功\n");
+}
+
+// in の出力を取得し、終了ステータスと出力をテストする
+// リダイレクトが指定されている場合は、リダイレクト先にも同じ内容が書き込まれることをテストする
+void TestCaptureJob(const std::string &in, const std::vector<int> expectStatuses, const std::string &expectOutput)
+{
+    StringToBeParsed str(in.c_str());
+    const auto job = ParseJob(str);
+
+    try
+    {
+        auto result = CaptureJob(job);
+        if (result.statuses != expectStatuses)
+        {
+            fprintf(stderr, "出力取得の終了ステータステスト失敗, \"%s\"\n", in.c_str());
+            return;
+        }
+        if (result.output.View() != expectOutput)
+        {
+            fprintf(stderr, "出力取得テスト失敗, \"%s\"\n", in.c_str());
+            return;
+        }
+        if (!job.redirectFilename.empty() && ReadFile(job.redirectFilename.c_str()) != expectOutput)
+        {
+            fprintf(stderr, "出力取得のリダイレクト先テスト失敗, \"%s\"\n", in.c_str());
+            return;
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        fprintf(stderr, "出力取得テスト失敗, \"%s\", %s\n", in.c_str(), e.what());
+        return;
+    }
+
+    // OK
+    printf("出力取得テスト成功, \"%s\"\n", in.c_str());
+}
+
+// ParseJobCache が同じ Job を共有し、ヒット数を数えることをテストする
+void TestParseJobCache()
+{
+    ParseJobCache cache(2);
+    const auto a1 = cache.Parse("cmd1 aaa | cmd2 > out.txt");
+    const auto a2 = cache.Parse("cmd1 aaa | cmd2 > out.txt");
+    const auto b = cache.Parse("cmd3");
+    if (a1 != a2 || a1->commands.size() != 2 || a1->redirectFilename != "out.txt" || b->commands.size() != 1)
+    {
+        fprintf(stderr, "パースキャッシュテスト失敗\n");
+        return;
+    }
+    if (cache.Hits() != 1 || cache.Misses() != 2)
+    {
+        fprintf(stderr, "パースキャッシュのヒット数テスト失敗\n");
+        return;
+    }
+
+    // 上限を超えると最も長く使われていないものが削除される
+    cache.Parse("cmd4");
+    if (cache.Parse("cmd1 aaa | cmd2 > out.txt") == a1 || cache.Misses() != 4)
+    {
+        fprintf(stderr, "パースキャッシュの削除テスト失敗\n");
+        return;
+    }
+
+    // 複数のスレッドから同時に使う
+    ParseJobCache sharedCache(128);
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 10000; i++)
+            {
+                const auto line = "cmd" + std::to_string(i % 200) + " arg | sort";
+                const auto job = sharedCache.Parse(line);
+                ok = ok && job->commands.size() == 2 && std::string_view(job->commands[0].args[0]) == "cmd" + std::to_string(i % 200);
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    if (!ok || sharedCache.Hits() + sharedCache.Misses() != 40000)
+    {
+        fprintf(stderr, "パースキャッシュの並行テスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("パースキャッシュテスト成功\n");
+}
+
+// PathCache の検索結果と、ディレクトリが変更されたときの破棄をテストする
+void TestPathCache()
+{
+    const auto tempDir = MakeTempDirectory();
+    const auto oldPath = std::string(getenv("PATH"));
+    setenv("PATH", (tempDir.string() + ":" + oldPath).c_str(), 1);
+
+    const auto script = tempDir / "syntaxanalysis_cmd";
+    const auto writeScript = [&](const int status) {
+        std::ofstream(script) << "#!/bin/sh\nexit " << status << "\n";
+        std::filesystem::permissions(script, std::filesystem::perms::owner_all);
+    };
+
+    PathCache cache;
+    ExecOptions options;
+    options.pathCache = &cache;
+    StringToBeParsed str("syntaxanalysis_cmd");
+    const auto job = ParseJob(str);
+
+    bool ok = true;
+    ok &= cache.Lookup("syntaxanalysis_cmd").empty();
+    ok &= !cache.Lookup("sh").empty();
+    ok &= cache.Lookup("./a/b") == "./a/b";
+
+    // 見つからなかったコマンドを作成すると見つかるようになる
+    writeScript(3);
+    ok &= cache.Lookup("syntaxanalysis_cmd") == script.string();
+    ok &= ExecuteJob(job, options) == std::vector<int>{3};
+
+    // 削除すると見つからなくなる
+    std::filesystem::remove(script);
+    ok &= cache.Lookup("syntaxanalysis_cmd").empty();
+    ok &= ExecuteJob(job, options) == std::vector<int>{127};
+
+    // $PATH を変更すると検索し直す
+    writeScript(4);
+    ok &= cache.Lookup("syntaxanalysis_cmd") == script.string();
+    setenv("PATH", oldPath.c_str(), 1);
+    ok &= cache.Lookup("syntaxanalysis_cmd").empty();
+
+    // 存在しないディレクトリを後から作っても見つかるようになる
+    const auto missingDir = tempDir / "missing" / "bin";
+    setenv("PATH", (missingDir.string() + ":" + oldPath).c_str(), 1);
+    ok &= cache.Lookup("syntaxanalysis_cmd").empty();
+    std::filesystem::create_directories(missingDir);
+    ok &= cache.Lookup("syntaxanalysis_cmd").empty();
+    std::filesystem::rename(script, missingDir / "syntaxanalysis_cmd");
+    ok &= cache.Lookup("syntaxanalysis_cmd") == (missingDir / "syntaxanalysis_cmd").string();
+    setenv("PATH", oldPath.c_str(), 1);
+
+    std::filesystem::remove_all(tempDir);
+    if (!ok)
+    {
+        fprintf(stderr, "PATH キャッシュテスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("PATH キャッシュテスト成功\n");
+}
+
+// 各コマンドの統計と、合計を定期的に書き込むことをテストする
+void TestJobStats()
+{
+    const auto tempDir = MakeTempDirectory();
+    const auto outPath = (tempDir / "out.txt").string();
+    JobStats stats;
+    ExecOptions options;
+    options.stats = &stats;
+
+    // 合計を書き込む先のパイプ
+    int dumpPipe[2];
+    if (pipe2(dumpPipe, O_CLOEXEC) != 0)
+    {
+        fprintf(stderr, "統計テスト失敗, pipe2\n");
+        return;
+    }
+
+    std::vector<int> executed, captured, missing;
+    {
+        JobStatsDumper dumper(stats, dumpPipe[1], std::chrono::milliseconds(10));
+        StringToBeParsed pipeStr(("head -c 1000000 /dev/urandom | wc -c > " + outPath).c_str());
+        executed = ExecuteJob(ParseJob(pipeStr), options);
+        StringToBeParsed captureStr("head -c 3000 /dev/zero");
+        captured = CaptureJob(ParseJob(captureStr), options).statuses;
+        StringToBeParsed missingStr("no_such_command_syntaxanalysis | true");
+        missing = ExecuteJob(ParseJob(missingStr), options);
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+    close(dumpPipe[1]);
+    std::string dumped;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(dumpPipe[0], buf, sizeof(buf))) > 0)
+    {
+        dumped.append(buf, n);
+    }
+    close(dumpPipe[0]);
+
+    const auto stages = stats.Stages();
+    const auto totals = stats.Totals();
+    bool ok = executed == std::vector<int>{0, 0} && captured == std::vector<int>{0} && missing == std::vector<int>{127, 0};
+    ok &= ReadFile(outPath) == "1000000\n";
+    ok &= stages.size() == 5 && totals.jobs == 3 && totals.stages == 5;
+    if (ok)
+    {
+        // パイプを流れたバイト数は、前のコマンドの wchar と後ろのコマンドの rchar に含まれる
+        // rchar はローダーが読むファイルなども含むので、下限だけを調べる
+        ok &= stages[0].job == 0 && stages[0].index == 0 && stages[0].command == "head" && stages[0].pid > 0;
+        ok &= stages[0].wcharBytes == 1000000 && stages[0].rcharBytes >= 1000000;
+        ok &= stages[1].job == 0 && stages[1].index == 1 && stages[1].command == "wc" && stages[1].rcharBytes >= 1000000;
+        ok &= stages[0].wall.count() > 0 && stages[1].wall >= stages[0].wall;
+        ok &= stages[0].userCpu + stages[0].systemCpu > std::chrono::microseconds::zero() && stages[0].maxRssKb > 0;
+        ok &= stages[2].job == 1 && stages[2].wcharBytes == 3000;
+        ok &= stages[3].job == 2 && stages[3].pid == -1 && stages[3].status == 127 && stages[4].status == 0;
+        ok &= totals.wcharBytes >= 1003000 && totals.maxRssKb == std::max({stages[0].maxRssKb, stages[1].maxRssKb, stages[2].maxRssKb, stages[4].maxRssKb});
+    }
+
+    // 定期的に書き込み、最後の行は最後の合計になる
+    const auto lines = std::count(dumped.begin(), dumped.end(), '\n');
+    const auto lastLine = dumped.substr(dumped.rfind('\n', dumped.size() - 2) + 1);
+    ok &= lines >= 2 && lastLine.rfind("{\"jobs\":3,\"stages\":5,", 0) == 0;
+
+    // 取り出すと空になり、合計は残る
+    ok &= stats.TakeStages().size() == 5 && stats.Stages().empty() && stats.Totals().stages == 5;
+
+    std::filesystem::remove_all(tempDir);
+    if (!ok)
+    {
+        fprintf(stderr, "統計テスト失敗, %s\n", dumped.c_str());
+        return;
+    }
+
+    // OK
+    printf("統計テスト成功\n");
+}
+
+#ifdef SYNTAXANALYSIS_TRACE
+// 記録した区間を Chrome の trace event 形式で書き出すことをテストする
+void TestTrace()
+{
+    const auto tempDir = MakeTempDirectory();
+    const auto tracePath = (tempDir / "trace.json").string();
+
+    StringToBeParsed str("true | true");
+    const auto pids = SpawnJob(ParseJob(str), STDOUT_FILENO);
+    const auto statuses = WaitJob(pids);
+    // 別のスレッドの区間と、エスケープが必要な文字列
+    std::thread([] { TRACE_SPAN_DETAIL("test", "thread \"span\"", "a\\b"); }).join();
+
+    bool ok = statuses == std::vector<int>{0, 0} && trace::WriteJson(tracePath.c_str());
+    const auto json = ok ? ReadFile(tracePath) : std::string();
+    const auto contains = [&](const std::string &s) { return json.find(s) != std::string::npos; };
+    ok &= json.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0) == 0 && json.size() >= 2 && json.substr(json.size() - 2) == "}\n";
+    ok &= contains("\"cat\":\"parse\",\"name\":\"ParseJob\",\"dur\":");
+    ok &= contains("\"name\":\"SpawnCommand\",\"dur\":") && contains("\"args\":{\"detail\":\"true\"}");
+    ok &= contains("\"name\":\"thread \\\"span\\\"\",\"dur\":") && contains("\"args\":{\"detail\":\"a\\\\b\"}");
+
+    // 各コマンドの区間は、起動したところで始まり回収したところで終わる
+    for (const auto pid : pids)
+    {
+        char id[32];
+        snprintf(id, sizeof(id), "\"id\":\"0x%llx\"", static_cast<unsigned long long>(pid));
+        ok &= contains("\"name\":\"stage\"," + std::string(id) + ",\"args\":{\"detail\":\"true\"}");
+        ok &= contains("{\"ph\":\"e\"") && json.find(id) != json.rfind(id);
+    }
+
+    std::filesystem::remove_all(tempDir);
+    if (!ok)
+    {
+        fprintf(stderr, "トレーステスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("トレーステスト成功\n");
+}
+#endif
+
+void TestExecCache()
+{
+    const auto tempDir = MakeTempDirectory();
+    const auto inPath = (tempDir / "in.txt").string();
+    const auto fixedPath = (tempDir / "fixed.txt").string();
+    const auto logPath = (tempDir / "log.txt").string();
+    const auto outPath = (tempDir / "out.txt").string();
+    std::ofstream(inPath) << "first\n";
+    std::ofstream(fixedPath) << "first\n";
+
+    // 標準入力の内容が決まらないとキャッシュを使わないので、/dev/null にする
+    const int nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    ExecCache cache(tempDir / "cache");
+    ExecOptions options;
+    options.execCache = &cache;
+    options.stdinFd = nullFd;
+    const auto capture = [&](const std::string &line, const ExecOptions &captureOptions) {
+        StringToBeParsed str(line.c_str());
+        auto result = CaptureJob(ParseJob(str), captureOptions);
+        return std::make_pair(result.statuses, std::string(result.output.View()));
+    };
+    const auto logLines = [&] {
+        const auto log = ReadFile(logPath);
+        return std::count(log.begin(), log.end(), '\n');
+    };
+
+    bool ok = true;
+
+    // 2 回目はプロセスを起動せずに、出力と終了ステータスを再現する
+    const auto line = "sh -c \"echo run >> " + logPath + "; cat " + fixedPath + "; exit 3\"";
+    const auto expect = std::make_pair(std::vector<int>{3}, std::string("first\n"));
+    ok &= capture(line, options) == expect;
+    ok &= capture(line, options) == expect;
+    ok &= logLines() == 1 && cache.Hits() == 1 && cache.Misses() == 1;
+
+    // 引数が指すファイルの内容が変わるとキーが変わる
+    const auto catLine = "cat " + inPath;
+    ok &= capture(catLine, options).second == "first\n";
+    std::ofstream(inPath) << "other\n";
+    ok &= capture(catLine, options).second == "other\n";
+    ok &= capture(catLine, options).second == "other\n";
+    ok &= cache.Hits() == 2 && cache.Misses() == 3;
+
+    // 内容が同じでも更新日時が変わるとキーが変わる
+    const auto mtime = std::filesystem::last_write_time(inPath);
+    std::filesystem::last_write_time(inPath, mtime - std::chrono::hours(1));
+    ok &= capture(catLine, options).second == "other\n";
+    ok &= cache.Hits() == 2 && cache.Misses() == 4;
+
+    // 存在しないファイルを作成するとキーが変わる
+    const auto missingPath = (tempDir / "missing.txt").string();
+    ok &= capture("cat " + missingPath, options).first == std::vector<int>{1};
+    std::ofstream(missingPath) << "created\n";
+    ok &= capture("cat " + missingPath, options) == std::make_pair(std::vector<int>{0}, std::string("created\n"));
+
+    // ヒットした場合もリダイレクト先に書き込む
+    StringToBeParsed redirectStr((catLine + " > " + outPath).c_str());
+    const auto redirectJob = ParseJob(redirectStr);
+    ok &= ExecuteJob(redirectJob, options) == std::vector<int>{0} && ReadFile(outPath) == "other\n";
+    const auto hits = cache.Hits();
+    std::filesystem::remove(outPath);
+    ok &= ExecuteJob(redirectJob, options) == std::vector<int>{0} && ReadFile(outPath) == "other\n";
+    std::filesystem::remove(outPath);
+    ok &= CaptureJob(redirectJob, options).output.View() == "other\n" && ReadFile(outPath) == "other\n";
+    ok &= cache.Hits() == hits + 2;
+
+    // 別のインスタンスからも同じディレクトリの結果を使える
+    ExecCache reopened(tempDir / "cache");
+    ExecOptions reopenedOptions;
+    reopenedOptions.execCache = &reopened;
+    reopenedOptions.stdinFd = nullFd;
+    ok &= capture(line, reopenedOptions) == expect && logLines() == 1 && reopened.Hits() == 1;
+
+    // 壊れた結果は無視して実行し直す
+    for (const auto &entry : std::filesystem::directory_iterator(tempDir / "cache"))
+    {
+        std::filesystem::resize_file(entry.path(), 3);
+    }
+    ok &= capture(line, reopenedOptions) == expect && logLines() == 2 && reopened.Hits() == 1;
+    ok &= capture(line, reopenedOptions) == expect && logLines() == 2 && reopened.Hits() == 2;
+
+    // 標準入力が通常のファイルなら、内容と読み込み位置をキーに混ぜる
+    const auto stdinPath = (tempDir / "stdin.txt").string();
+    std::ofstream(stdinPath) << "a\nb\n";
+    const int stdinFd = open(stdinPath.c_str(), O_RDONLY | O_CLOEXEC);
+    ExecOptions stdinOptions = options;
+    stdinOptions.stdinFd = stdinFd;
+    const auto stdinHits = cache.Hits();
+    const auto stdinMisses = cache.Misses();
+    ok &= capture("wc -l", stdinOptions).second == "2\n";
+    lseek(stdinFd, 0, SEEK_SET);
+    ok &= capture("wc -l", stdinOptions).second == "2\n";
+    // 読み込み位置が変わると、同じファイルでもキーが変わる
+    lseek(stdinFd, 2, SEEK_SET);
+    ok &= capture("wc -l", stdinOptions).second == "1\n";
+    std::ofstream(stdinPath) << "a\nb\nc\n";
+    lseek(stdinFd, 0, SEEK_SET);
+    ok &= capture("wc -l", stdinOptions).second == "3\n";
+    ok &= cache.Hits() == stdinHits + 1 && cache.Misses() == stdinMisses + 3;
+    close(stdinFd);
+
+    // 標準入力がパイプならキャッシュを使わずに毎回実行する
+    for (const auto input : {"x\n", "x\ny\n"})
+    {
+        int pipeFds[2];
+        ok &= pipe2(pipeFds, O_CLOEXEC) == 0;
+        ok &= write(pipeFds[1], input, strlen(input)) == static_cast<ssize_t>(strlen(input));
+        close(pipeFds[1]);
+        ExecOptions pipeOptions = options;
+        pipeOptions.stdinFd = pipeFds[0];
+        ok &= capture("wc -l", pipeOptions).second == std::to_string(std::count(input, input + strlen(input), '\n')) + "\n";
+        close(pipeFds[0]);
+    }
+    ok &= cache.Hits() == stdinHits + 1 && cache.Misses() == stdinMisses + 3;
+
+    close(nullFd);
+    std::filesystem::remove_all(tempDir);
+    if (!ok)
+    {
+        fprintf(stderr, "実行結果キャッシュテスト失敗\n");
+        return;
+    }
+
+    // OK
+    printf("実行結果キャッシュテスト成功\n");
+}
+
+// ベンチマークの結果を 1 行の JSON オブジェクトとして出力する
+// 文字列のエスケープは JsonWriter を使う
+void PrintBenchResult(const std::string_view name, const std::vector<std::pair<const char *, double>> &metrics)
+{
+    // printf で出力した内容より後ろに書き込む
+    fflush(stdout);
+    JsonWriter writer(STDOUT_FILENO, 4096);
+    writer.Raw("{\"name\":");
+    writer.String(name);
+    for (const auto &[key, value] : metrics)
+    {
+        char number[32];
+        snprintf(number, sizeof(number), "%.6g", value);
+        writer.Raw(",");
+        writer.String(key);
+        writer.Raw(":");
+        writer.Raw(number);
+    }
+    writer.Raw("}\n");
+    writer.Flush();
+}
+
+// 計測した処理の結果が使われないために、処理ごと最適化で取り除かれることを防ぐ
+// 値を読み込んだものとしてコンパイラに扱わせるだけで、何も出力しない
+template <typename T>
+void DoNotOptimize(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// f を iterations 回実行し、1 回あたりの時間、1 秒あたりの実行回数、1 回あたりの確保回数を出力する
+template <typename F>
+void Benchmark(const std::string_view name, const size_t iterations, F f)
+{
+    const auto allocations = g_allocationCount.load();
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        f();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    PrintBenchResult(name, {{"ns_per_op", ns / iterations},
+                            {"ops_per_sec", iterations * 1e9 / ns},
+                            {"allocations_per_op", static_cast<double>(g_allocationCount.load() - allocations) / iterations}});
+}
+
+// ParseJob のベンチマーク用の入力
+struct BenchCorpus final
+{
+    std::string name;
+    std::vector<std::string> lines;
+};
+
+std::vector<BenchCorpus> GenerateBenchCorpora()
+{
+    BenchRandom random;
+    const std::vector<std::string> words = {"grep", "sort", "-v", "/dev/null", "uniq", "-c", "awk", "'{print $1}'", "head", "-n", "20", "xargs", "wc", "-l", "cut", "-d:", "-f1"};
+    const auto word = [&] { return words[random.Next(words.size())]; };
+
+    std::vector<BenchCorpus> corpora;
+
+    // 短いコマンド
+    corpora.push_back({"short", {}});
+    for (int i = 0; i < 100000; i++)
+    {
+        corpora.back().lines.push_back(word() + " " + word() + (i % 3 == 0 ? " | " + word() : ""));
+    }
+
+    // とても長いパイプライン
+    corpora.push_back({"long_pipeline", {}});
+    for (int i = 0; i < 100; i++)
+    {
+        std::string line = word();
+        for (int stage = 0; stage < 500; stage++)
+        {
+            line += " " + word() + " | " + word();
+        }
+        corpora.back().lines.push_back(line);
+    }
+
+    // とても多い引数
+    corpora.push_back({"huge_args", {}});
+    for (int i = 0; i < 100; i++)
+    {
+        std::string line = "rm -f";
+        for (int arg = 0; arg < 5000; arg++)
+        {
+            line += " /tmp/build/obj" + std::to_string(random.Next(100000)) + ".o";
+        }
+        corpora.back().lines.push_back(line);
+    }
+
+    // 大量の空白
+    corpora.push_back({"whitespace", {}});
+    for (int i = 0; i < 20000; i++)
+    {
+        std::string line;
+        for (int token = 0; token < 8; token++)
+        {
+            line += std::string(1 + random.Next(32), ' ') + word() + std::string(random.Next(32), ' ') + (token % 3 == 2 ? "|" : "");
+        }
+        corpora.back().lines.push_back(line);
+    }
+
+    // リダイレクトの多い行
+    corpora.push_back({"redirect_heavy", {}});
+    for (int i = 0; i < 100000; i++)
+    {
+        corpora.back().lines.push_back(word() + " " + word() + (i % 2 == 0 ? " | " + word() : "") + " >" + std::string(random.Next(3), ' ') + "/var/log/out" + std::to_string(i % 100) + ".log" + (i % 5 == 0 ? " > ignored" : ""));
+    }
+
+    // クォーテーションの多い行
+    corpora.push_back({"quote_heavy", {}});
+    for (int i = 0; i < 50000; i++)
+    {
+        corpora.back().lines.push_back("git commit -m \"fix: handle 'quoted' | piped args " + std::to_string(i) + "\" --author='A \\\"B\\\" <a@b>' e\\ f | grep -v \"x y\" > 'out file.txt'");
+    }
+
+    return corpora;
+}
+
+// corpus のすべての行を parse でパースし、行数、バイト数、1 行あたりの確保回数を出力する
+template <typename F>
+void BenchmarkCorpus(const std::string_view name, const BenchCorpus &corpus, F parse)
+{
+    size_t bytes = 0;
+    for (const auto &line : corpus.lines)
+    {
+        bytes += line.size();
+    }
+
+    // 短すぎると計測の誤差が大きいので、一定時間以上繰り返す
+    size_t lines = 0;
+    const auto allocations = g_allocationCount.load();
+    const auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{};
+    do
+    {
+        for (const auto &line : corpus.lines)
+        {
+            parse(line);
+        }
+        lines += corpus.lines.size();
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < 0.2);
+
+    const double repeat = static_cast<double>(lines) / corpus.lines.size();
+    PrintBenchResult(std::string(name) + "/" + corpus.name, {{"lines", static_cast<double>(corpus.lines.size())},
+                                                             {"bytes", static_cast<double>(bytes)},
+                                                             {"lines_per_sec", lines / elapsed.count()},
+                                                             {"bytes_per_sec", bytes * repeat / elapsed.count()},
+                                                             {"allocations_per_line", static_cast<double>(g_allocationCount.load() - allocations) / lines}});
+}
+
+// パースに関するベンチマーク
+void RunParseBenchmarks()
+{
+    const auto corpora = GenerateBenchCorpora();
+    for (const auto &corpus : corpora)
+    {
+        BenchmarkCorpus("ParseJob", corpus, [](const std::string &line) {
+            StringToBeParsed str(line);
+            const auto job = ParseJob(str);
+        });
+    }
+
+    // 1000 件ごとにまとめて解放する
+    for (const auto &corpus : corpora)
+    {
+        std::pmr::monotonic_buffer_resource mono;
+        int count = 0;
+        BenchmarkCorpus("ParseJob/monotonic_buffer_resource", corpus, [&](const std::string &line) {
+            StringToBeParsed str(line);
+            {
+                const auto job = ParseJob(str, &mono);
+            }
+            if (++count % 1000 == 0)
+            {
+                mono.release();
+            }
+        });
+    }
+
+    // 同じ StringToBeParsed と Job を再利用してパースする
+    for (const auto &corpus : corpora)
+    {
+        StringToBeParsed str("");
+        Job job;
+        BenchmarkCorpus("ParseJob reusing Job", corpus, [&](const std::string &line) {
+            str.Assign(line);
+            ParseJob(str, job);
+        });
+    }
+
+    // コマンド名だけが必要な場合に、Job を作らずに通知を受ける場合と比較する
+    struct FirstWordVisitor : JobVisitorBase
+    {
+        void OnCommandBegin() { first = true; };
+        void OnArg(std::string_view arg)
+        {
+            if (first)
+            {
+                hash ^= std::hash<std::string_view>()(arg);
+                first = false;
+            }
+        };
+
+        bool first = false;
+        size_t hash = 0;
+    };
+    for (const auto &corpus : corpora)
+    {
+        FirstWordVisitor visitor;
+        const auto parseEvents = [&](const std::string &line) {
+            StringToBeParsed str(line);
+            ParseJobEvents(str, visitor);
+        };
+        size_t hash = 0;
+        const auto parseJob = [&](const std::string &line) {
+            StringToBeParsed str(line);
+            for (const auto &cmd : ParseJob(str).commands)
+            {
+                hash ^= std::hash<std::string_view>()(cmd.args[0]);
+            }
+        };
+        BenchmarkCorpus("ParseJobEvents first words", corpus, parseEvents);
+        BenchmarkCorpus("ParseJob first words", corpus, parseJob);
+
+        // 同じ結果が得られていることを確認する
+        visitor.hash = 0;
+        hash = 0;
+        for (const auto &line : corpus.lines)
+        {
+            parseEvents(line);
+            parseJob(line);
+        }
+        if (hash != visitor.hash)
+        {
+            fprintf(stderr, "ParseJobEvents と ParseJob の結果が一致しません\n");
+        }
+    }
+
+    // 数 MB の 1 行を直列と並列でパースする
+    std::string hugeLine;
+    for (int stage = 0; stage < 20000; stage++)
+    {
+        hugeLine += "sed -e 's/a|b/c/' --expression=\"s/x > y/z/\" file" + std::to_string(stage) + ".txt | ";
+    }
+    hugeLine += "cat > out.txt";
+    Benchmark("ParseJob huge pipeline line " + std::to_string(hugeLine.size()) + " bytes", 10, [&] {
+        StringToBeParsed str(hugeLine);
+        const auto job = ParseJob(str);
+    });
+    Benchmark("ParseJobParallel huge pipeline line " + std::to_string(hugeLine.size()) + " bytes, " + std::to_string(std::thread::hardware_concurrency()) + " threads", 10, [&] {
+        const auto job = ParseJobParallel(hugeLine);
+    });
+
+    // シェルの履歴のような入力で、文字列を共有した場合のメモリと比較の速さを調べる
+    // よく使われるコマンドと引数ほど多く現れるようにする
+    {
+        const std::vector<std::string> commands = {"git", "ls", "cd", "grep", "cat", "sort", "uniq", "make", "vim", "docker", "kubectl", "ssh", "find", "awk", "sed", "head", "tail", "wc", "xargs", "curl"};
+        const std::vector<std::string> args = {"-v", "-l", "-la", "-r", "-n", "status", "log", "--oneline", "/dev/null", "-c", "build", "test", "-f", "pods", "get", "-i", "src/", "README.md", "origin", "main", "-rn", "10"};
+        BenchRandom random;
+        const auto zipf = [&](const size_t n) { return std::min(random.Next(n), random.Next(n)); };
+        std::vector<Job> history;
+        for (int i = 0; i < 200000; i++)
+        {
+            std::string line;
+            const auto stages = 1 + zipf(4);
+            for (size_t stage = 0; stage < stages; stage++)
+            {
+                line += (stage == 0 ? "" : " | ") + commands[zipf(commands.size())];
+                const auto argCount = zipf(5);
+                for (size_t a = 0; a < argCount; a++)
+                {
+                    line += " " + (random.Next(10) == 0 ? "file" + std::to_string(random.Next(5000)) + ".txt" : args[zipf(args.size())]);
+                }
+            }
+            if (random.Next(8) == 0)
+            {
+                line += " > /dev/null";
+            }
+            StringToBeParsed str(line);
+            history.push_back(ParseJob(str));
+        }
+
+        StringInterner interner;
+        std::vector<InternedJob> interned;
+        Benchmark("InternJob shell history", history.size(), [&] { interned.push_back(InternJob(history[interned.size()], interner)); });
+
+        // std::string が SSO に収まらない場合だけヒープを使うので、その分も含めて比較する
+        size_t heapBytes = 0;
+        for (const auto &job : history)
+        {
+            for (const auto &cmd : job.commands)
+            {
+                for (const auto &arg : cmd.args)
+                {
+                    heapBytes += arg.size() > 15 ? arg.capacity() + 1 : 0;
+                }
+            }
+        }
+        // 節約できたバイト数は、表やチャンクの余りも含めた StringInterner の使用量を引いて求める
+        const auto footprintBytes = static_cast<double>(interner.FootprintBytes());
+        PrintBenchResult("StringInterner shell history", {{"requested_bytes", static_cast<double>(interner.RequestedBytes())},
+                                                          {"stored_bytes", static_cast<double>(interner.StoredBytes())},
+                                                          {"footprint_bytes", footprintBytes},
+                                                          {"saved_bytes", static_cast<double>(interner.RequestedBytes()) - footprintBytes},
+                                                          {"string_heap_bytes_without_interning", static_cast<double>(heapBytes)},
+                                                          {"unique_strings", static_cast<double>(interner.Count())}});
+
+        // 隣り合う Job が等しいか調べる
+        size_t equalCount = 0;
+        size_t index = 0;
+        Benchmark("Job equality by string comparison", history.size() - 1, [&] {
+            const auto &a = history[index];
+            const auto &b = history[++index];
+            equalCount += a.redirectFilename == b.redirectFilename && a.commands.size() == b.commands.size() &&
+                          std::equal(a.commands.begin(), a.commands.end(), b.commands.begin(), [](const Command &x, const Command &y) { return x.args == y.args; });
+        });
+        size_t internedEqualCount = 0;
+        index = 0;
+        Benchmark("InternedJob equality by pointer comparison", interned.size() - 1, [&] {
+            internedEqualCount += interned[index] == interned[index + 1];
+            index++;
+        });
+        if (equalCount != internedEqualCount)
+        {
+            fprintf(stderr, "InternedJob の比較結果が一致しません\n");
+        }
+    }
+
+    // バイナリ形式からの読み出しを、文字列をパースし直す場合と比較する
+    for (const auto &corpus : corpora)
+    {
+        std::string encoded;
+        for (const auto &line : corpus.lines)
+        {
+            StringToBeParsed str(line);
+            AppendEncodedJob(ParseJob(str), encoded);
+        }
+
+        size_t argBytes = 0;
+        EncodedJobReader reader(encoded);
+        EncodedJob encodedJob;
+        BenchmarkCorpus("EncodedJobReader", corpus, [&](const std::string &) {
+            if (!reader.Next(encodedJob))
+            {
+                reader = EncodedJobReader(encoded);
+                reader.Next(encodedJob);
+            }
+            for (const auto &cmd : encodedJob)
+            {
+                for (const auto arg : cmd)
+                {
+                    argBytes += arg.size();
+                }
+            }
+        });
+        BenchmarkCorpus("ParseJob + iterate", corpus, [&](const std::string &line) {
+            StringToBeParsed str(line);
+            for (const auto &cmd : ParseJob(str).commands)
+            {
+                for (const auto &arg : cmd.args)
+                {
+                    argBytes += arg.size();
+                }
+            }
+        });
+        DoNotOptimize(argBytes);
+    }
+
+    // json コマンドと同じ処理で、入力と出力のスループットを MB/s で計測する
+    const int nullFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    for (const auto &corpus : corpora)
+    {
+        std::string text;
+        for (const auto &line : corpus.lines)
+        {
+            text += line;
+            text += '\n';
+        }
+        const int inFd = memfd_create("syntaxanalysis_bench", MFD_CLOEXEC);
+        if (inFd == -1 || write(inFd, text.data(), text.size()) != static_cast<ssize_t>(text.size()))
+        {
+            fprintf(stderr, "JSON のベンチマークの入力を作成できませんでした\n");
+            break;
+        }
+
+        size_t repeat = 0;
+        size_t outBytes = 0;
+        const auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{};
+        do
+        {
+            lseek(inFd, 0, SEEK_SET);
+            outBytes += WriteJobsAsJson(inFd, nullFd);
+            repeat++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < 0.2);
+        close(inFd);
+
+        PrintBenchResult("WriteJobsAsJson/" + corpus.name, {{"input_mb_per_sec", text.size() * repeat / 1e6 / elapsed.count()},
+                                                            {"output_mb_per_sec", outBytes / 1e6 / elapsed.count()},
+                                                            {"lines_per_sec", corpus.lines.size() * repeat / elapsed.count()}});
+    }
+    close(nullFd);
+
+    // Job のハッシュ値を、文字列に戻してからハッシュ値を計算する場合と比較する
+    for (const auto &corpus : corpora)
+    {
+        std::vector<Job> jobs;
+        for (const auto &line : corpus.lines)
+        {
+            StringToBeParsed str(line);
+            jobs.push_back(ParseJob(str));
+        }
+
+        size_t index = 0;
+        uint64_t sum = 0;
+        Benchmark("HashJob/" + corpus.name, jobs.size(), [&] { sum += HashJob(jobs[index++ % jobs.size()]); });
+        std::string text;
+        Benchmark("stringify + std::hash/" + corpus.name, jobs.size(), [&] {
+            const auto &job = jobs[index++ % jobs.size()];
+            text.clear();
+            for (const auto &cmd : job.commands)
+            {
+                text += text.empty() ? "" : " | ";
+                for (const auto &arg : cmd.args)
+                {
+                    text += arg;
+                    text += ' ';
+                }
+            }
+            text += "> ";
+            text += job.redirectFilename;
+            sum += std::hash<std::string>()(text);
+        });
+
+        // 重複を取り除くときのように、隣り合う Job を比較する
+        std::vector<HashedJob> hashedJobs;
+        for (const auto &job : jobs)
+        {
+            hashedJobs.emplace_back(job);
+        }
+        size_t equalCount = 0;
+        index = 0;
+        Benchmark("Job operator==/" + corpus.name, jobs.size() - 1, [&] {
+            equalCount += jobs[index] == jobs[index + 1];
+            index++;
+        });
+        index = 0;
+        Benchmark("HashedJob operator==/" + corpus.name, jobs.size() - 1, [&] {
+            equalCount += hashedJobs[index] == hashedJobs[index + 1];
+            index++;
+        });
+        DoNotOptimize(sum);
+        DoNotOptimize(equalCount);
+    }
+
+    // クォーテーションの多い入力で、マスクの作成を比較する
+    std::string quoted;
+    for (int i = 0; i < 20000; i++)
+    {
+        quoted += "git commit -m \"fix: handle 'quoted' | piped args\" --author='A \\\"B\\\" <a@b>' e\\ f | grep -v \"x y\" > 'out file.txt' ";
+    }
+    Benchmark("BuildQuoteMasks quote-heavy 2.3MB", 20, [&] { BuildQuoteMasks(quoted); });
+    Benchmark("BuildQuoteMasksScalar quote-heavy 2.3MB", 20, [&] { BuildQuoteMasksScalar(quoted); });
+    std::string longQuoted;
+    for (int i = 0; i < 20000; i++)
+    {
+        longQuoted += "\"long quoted argument with | and > that spans many bytes, " + std::to_string(i) + "\" ";
+    }
+    Benchmark("BuildQuoteMasks long double-quoted args", 20, [&] { BuildQuoteMasks(longQuoted); });
+    Benchmark("BuildQuoteMasksScalar long double-quoted args", 20, [&] { BuildQuoteMasksScalar(longQuoted); });
+
+    // cron や CI のように同じ行が繰り返し現れる入力で、キャッシュとパースを比較する
+    // 行の 90% は 100 種類の頻出する行、残りは毎回異なる行にする
+    BenchCorpus repeated{"repeated", {}};
+    for (int i = 0; i < 100000; i++)
+    {
+        if (i % 10 == 0)
+        {
+            repeated.lines.push_back("rsync -a /srv/data/" + std::to_string(i) + " backup:/data | tee -a sync.log > /dev/null");
+        }
+        else
+        {
+            repeated.lines.push_back("/usr/local/bin/job" + std::to_string(i * 7 % 100) + " --quiet | logger -t cron");
+        }
+    }
+    BenchmarkCorpus("ParseJob", repeated, [](const std::string &line) {
+        StringToBeParsed str(line);
+        const auto job = ParseJob(str);
+    });
+    ParseJobCache cache(1024);
+    BenchmarkCorpus("ParseJobCache", repeated, [&](const std::string &line) { const auto job = cache.Parse(line); });
+    PrintBenchResult("ParseJobCache/repeated", {{"hit_rate", cache.HitRate()}});
+}
+
+// ジョブの実行に関するベンチマーク
+void RunExecBenchmarks()
+{
+    // bash を起動して実行する場合と比較する
+    StringToBeParsed pipeline("true | true | true");
+    const auto job = ParseJob(pipeline);
+    Benchmark("ExecuteJob \"true | true | true\"", 2000, [&] { ExecuteJob(job); });
+
+    Job bashJob;
+    bashJob.commands.emplace_back();
+    bashJob.commands.back().args = {"bash", "-c", "true | true | true"};
+    Benchmark("ExecuteJob \"bash -c 'true | true | true'\"", 2000, [&] { ExecuteJob(bashJob); });
+
+    // 統計を集める場合と集めない場合を比較する
+    // 起動する側で増えるのは時刻を 1 回読むことだけなので、それも測る
+    {
+        JobStats stats;
+        ExecOptions statsOptions;
+        statsOptions.stats = &stats;
+        for (int round = 0; round < 2; round++)
+        {
+            Benchmark("ExecuteJob \"true | true | true\" (stats baseline)", 2000, [&] { ExecuteJob(job); });
+            Benchmark("ExecuteJob \"true | true | true\" with JobStats", 2000, [&] { ExecuteJob(job, statsOptions); });
+            stats.TakeStages();
+        }
+        Benchmark("JobStats launch path (steady_clock::now)", 1000000, [&] { std::chrono::steady_clock::now(); });
+        // 終了を待つ側で増える処理のうち、/proc/<pid>/io の読み込みを測る
+        uint64_t rcharBytes = 0, wcharBytes = 0;
+        Benchmark("ReadProcIo", 100000, [&] { ReadProcIo(getpid(), rcharBytes, wcharBytes); });
+    }
+
+    // 64 個のジョブを '&' で同時に実行する場合と、';' で順番に実行する場合を比較する
+    for (const auto *op : {" & ", " ; "})
+    {
+        std::string line = "sleep 0.01";
+        for (int i = 1; i < 64; i++)
+        {
+            line += op + std::string("sleep 0.01");
+        }
+        StringToBeParsed listStr(line);
+        const auto list = ParseCommandList(listStr);
+        Benchmark(std::string("RunCommandList 64 x \"sleep 0.01\" joined by '") + op[1] + "'", 5, [&] { RunCommandList(list); });
+    }
+
+    // 1 万個の短いジョブを同時に起動し、pidfd と epoll で回収する場合と、起動した順に waitpid で待つ場合を比較する
+    {
+        // pidfd を 1 万個開けるように、ファイルディスクリプタの上限を引き上げる
+        rlimit oldLimit;
+        getrlimit(RLIMIT_NOFILE, &oldLimit);
+        rlimit limit = oldLimit;
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+        // 上限が小さい環境では、使える数だけ起動する
+        const size_t jobCount = std::min<size_t>(10000, limit.rlim_cur > 256 ? limit.rlim_cur - 256 : 0);
+
+        StringToBeParsed trueStr("true");
+        const auto trueJob = ParseJob(trueStr);
+        for (const bool withTimeout : {false, true})
+        {
+            BackgroundJobScheduler scheduler;
+            size_t completed = 0;
+            const auto onComplete = [&](size_t, std::vector<int> &&, bool) { completed++; };
+            const auto timeout = withTimeout ? std::chrono::milliseconds(60000) : std::chrono::milliseconds::zero();
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < jobCount; i++)
+            {
+                scheduler.Launch(trueJob, {}, onComplete, timeout);
+            }
+            const auto launched = std::chrono::steady_clock::now();
+            const auto maxPending = scheduler.PendingCount();
+            scheduler.WaitAll();
+            const auto end = std::chrono::steady_clock::now();
+            const std::chrono::duration<double> launchTime = launched - start;
+            const std::chrono::duration<double> reapTime = end - launched;
+            PrintBenchResult(std::string("BackgroundJobScheduler ") + std::to_string(jobCount) + " x \"true\"" + (withTimeout ? " with timeouts" : ""),
+                             {{"jobs_per_sec", completed / (launchTime + reapTime).count()},
+                              {"launch_sec", launchTime.count()},
+                              {"reap_sec", reapTime.count()},
+                              {"max_pending", static_cast<double>(maxPending)}});
+        }
+        {
+            std::vector<std::vector<pid_t>> pids;
+            pids.reserve(jobCount);
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < jobCount; i++)
+            {
+                pids.push_back(SpawnJob(trueJob, STDOUT_FILENO));
+            }
+            const auto launched = std::chrono::steady_clock::now();
+            for (const auto &jobPids : pids)
+            {
+                WaitJob(jobPids);
+            }
+            const auto end = std::chrono::steady_clock::now();
+            const std::chrono::duration<double> launchTime = launched - start;
+            const std::chrono::duration<double> reapTime = end - launched;
+            PrintBenchResult("SpawnJob + WaitJob " + std::to_string(jobCount) + " x \"true\"",
+                             {{"jobs_per_sec", jobCount / (launchTime + reapTime).count()}, {"launch_sec", launchTime.count()}, {"reap_sec", reapTime.count()}});
+        }
+
+        // 制限時間を過ぎてから、強制終了したジョブの onComplete が呼ばれるまでの遅延を測る
+        // 起動し終わる前に制限時間を過ぎないように、制限時間は長めにする
+        {
+            constexpr size_t sleepCount = 1000;
+            constexpr auto timeout = std::chrono::seconds(3);
+            StringToBeParsed sleepStr("sleep 10");
+            const auto sleepJob = ParseJob(sleepStr);
+            BackgroundJobScheduler scheduler;
+            std::vector<double> latencies;
+            std::vector<std::chrono::steady_clock::time_point> deadlines;
+            for (size_t i = 0; i < sleepCount; i++)
+            {
+                deadlines.push_back(std::chrono::steady_clock::now() + timeout);
+                scheduler.Launch(sleepJob, {}, [&](size_t id, std::vector<int> &&, bool) {
+                    latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - deadlines[id]).count());
+                }, timeout);
+            }
+            const auto waitStart = std::chrono::steady_clock::now();
+            scheduler.WaitAll();
+            std::sort(latencies.begin(), latencies.end());
+            if (waitStart > deadlines.front())
+            {
+                fprintf(stderr, "起動に時間がかかり、制限時間を過ぎてから待ち始めました\n");
+            }
+            PrintBenchResult("BackgroundJobScheduler timeout of 1000 x \"sleep 10\"",
+                             {{"p50_us", latencies[latencies.size() / 2]}, {"p99_us", latencies[latencies.size() * 99 / 100]}});
+        }
+        setrlimit(RLIMIT_NOFILE, &oldLimit);
+    }
+
+    // 同じジョブのファイルを、RunBatch と xargs -P で実行する場合を比較する
+    {
+        const auto batchDir = MakeTempDirectory();
+        const auto jobsPath = batchDir / "jobs.txt";
+        constexpr size_t jobCount = 2000;
+        {
+            std::ofstream jobsFile(jobsPath);
+            for (size_t i = 0; i < jobCount; i++)
+            {
+                jobsFile << "echo " << i << " | cat\n";
+            }
+        }
+        for (const unsigned parallelism : {1u, 4u})
+        {
+            std::ifstream jobsFile(jobsPath);
+            BatchOptions options;
+            options.parallelism = parallelism;
+            size_t outBytes = 0;
+            auto start = std::chrono::steady_clock::now();
+            RunBatch([&](std::string &line) { return static_cast<bool>(std::getline(jobsFile, line)); },
+                     [&](BatchResult &&result) { outBytes += result.output.Size(); }, options);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            PrintBenchResult("RunBatch -P " + std::to_string(parallelism), {{"jobs_per_sec", jobCount / elapsed.count()}, {"output_bytes", static_cast<double>(outBytes)}});
+
+            // xargs は各行を sh -c で実行する
+            Job xargsJob;
+            xargsJob.commands.emplace_back();
+            const auto xargsLine = "xargs -P " + std::to_string(parallelism) + " -d '\\n' -I{} sh -c {} < " + jobsPath.string() + " > /dev/null";
+            xargsJob.commands.back().args = {"sh", "-c", xargsLine.c_str()};
+            start = std::chrono::steady_clock::now();
+            ExecuteJob(xargsJob);
+            elapsed = std::chrono::steady_clock::now() - start;
+            PrintBenchResult("xargs -P " + std::to_string(parallelism) + " sh -c", {{"jobs_per_sec", jobCount / elapsed.count()}});
+        }
+        std::filesystem::remove_all(batchDir);
+    }
+
+    // CPU を使い続けるスレッドを動かしながら、ZygotePool と posix_spawn で起動する遅延の p50 と p99 を比較する
+    // ZygotePool::Launch はヘルパーが起動を終えるまで待つので、ヘルパーが CPU を割り当てられるまでの時間も含む
+    {
+        StringToBeParsed trueStr("true");
+        const auto trueJob = ParseJob(trueStr);
+        constexpr size_t launchCount = 2000;
+        const auto printLatency = [](const std::string &name, std::vector<double> &latencies) {
+            std::sort(latencies.begin(), latencies.end());
+            PrintBenchResult(name, {{"p50_us", latencies[latencies.size() / 2] / 1e3}, {"p99_us", latencies[latencies.size() * 99 / 100] / 1e3}});
+        };
+
+        ZygotePool pool(64);
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> load;
+        for (int i = 0; i < 2; i++)
+        {
+            load.emplace_back([&] {
+                volatile uint64_t x = 0;
+                while (!stop.load(std::memory_order_relaxed))
+                {
+                    x = x + 1;
+                }
+            });
+        }
+
+        std::vector<double> latencies;
+        for (size_t i = 0; i < launchCount; i++)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const auto pids = SpawnJob(trueJob, STDOUT_FILENO);
+            latencies.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+            WaitJob(pids);
+        }
+        printLatency("SpawnJob \"true\" under load", latencies);
+
+        // ヘルパーの補充は計測から除く
+        latencies.clear();
+        std::chrono::duration<double> replenishTime{};
+        for (size_t i = 0; i < launchCount; i++)
+        {
+            if (pool.IdleCount() == 0)
+            {
+                const auto replenishStart = std::chrono::steady_clock::now();
+                pool.Replenish();
+                replenishTime += std::chrono::steady_clock::now() - replenishStart;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            auto launched = pool.Launch(trueJob);
+            latencies.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+            ZygotePool::Wait(std::move(launched));
+        }
+        printLatency("ZygotePool::Launch \"true\" under load", latencies);
+        PrintBenchResult("ZygotePool::Replenish per helper under load", {{"us_per_helper", replenishTime.count() * 1e6 / launchCount}});
+
+        stop = true;
+        for (auto &thread : load)
+        {
+            thread.join();
+        }
+    }
+
+    // 長い $PATH の最後にあるコマンドを検索する
+    {
+        const auto pathDir = MakeTempDirectory();
+        const auto oldPath = std::string(getenv("PATH"));
+        std::string longPath;
+        for (int i = 0; i < 64; i++)
+        {
+            const auto dir = pathDir / std::to_string(i);
+            std::filesystem::create_directory(dir);
+            longPath += dir.string() + ":";
+        }
+        longPath += oldPath;
+        setenv("PATH", longPath.c_str(), 1);
+
+        Benchmark("FindExecutable \"true\" with 64 extra PATH entries (cold)", 20000, [&] { FindExecutable("true", longPath); });
+        PathCache pathCache;
+        Benchmark("PathCache::Lookup \"true\" with 64 extra PATH entries (warm)", 20000, [&] { pathCache.Lookup("true"); });
+        ExecOptions cachedOptions;
+        cachedOptions.pathCache = &pathCache;
+        Benchmark("ExecuteJob \"true | true | true\" with 64 extra PATH entries", 2000, [&] { ExecuteJob(job); });
+        Benchmark("ExecuteJob \"true | true | true\" with 64 extra PATH entries and PathCache", 2000, [&] { ExecuteJob(job, cachedOptions); });
+
+        setenv("PATH", oldPath.c_str(), 1);
+        std::filesystem::remove_all(pathDir);
+    }
+
+    // 組み込みコマンドをスレッドで実行する場合と、段ごとにプロセスを起動する場合を比較する
+    {
+        const auto builtinDir = MakeTempDirectory();
+        const auto bigPath = (builtinDir / "big.txt").string();
+        const auto smallPath = (builtinDir / "small.txt").string();
+        {
+            std::ofstream bigFile(bigPath);
+            for (int i = 0; i < 400000; i++)
+            {
+                bigFile << "line " << i << (i % 7 == 0 ? " foo" : " bar") << " lorem ipsum dolor sit amet\n";
+            }
+            std::ofstream smallFile(smallPath);
+            smallFile << "foo\nbar\n";
+        }
+        ExecOptions builtinOptions;
+        builtinOptions.builtins = true;
+        // 名前には一時ディレクトリを含めず、実行ごとに比較できるようにする
+        const std::tuple<std::string, std::string, size_t> lines[] = {
+            {"cat big.txt | grep foo | wc -l", "cat " + bigPath + " | grep foo | wc -l > /dev/null", 20},
+            {"cat big.txt | head -n 10", "cat " + bigPath + " | head -n 10 > /dev/null", 200},
+            {"cat small.txt | grep foo | wc -l", "cat " + smallPath + " | grep foo | wc -l > /dev/null", 2000},
+        };
+        for (const auto &[name, line, iterations] : lines)
+        {
+            StringToBeParsed builtinStr(line.c_str());
+            const auto builtinJob = ParseJob(builtinStr);
+            Benchmark("ExecuteJob \"" + name + "\"", iterations, [&] { ExecuteJob(builtinJob); });
+            Benchmark("ExecuteJob \"" + name + "\" with builtins", iterations, [&] { ExecuteJob(builtinJob, builtinOptions); });
+        }
+        std::filesystem::remove_all(builtinDir);
+    }
+
+    // 実行結果キャッシュにヒットした場合の遅延と、ディスク上の索引を引くコストを測る
+    {
+        const auto cacheDir = MakeTempDirectory();
+        const auto smallPath = (cacheDir / "small.txt").string();
+        const auto bigPath = (cacheDir / "big.txt").string();
+        std::ofstream(smallPath) << "foo\nbar\n";
+        std::ofstream(bigPath) << std::string(16 << 20, 'x');
+        // 更新された直後のファイルはハッシュ値を再利用しないので、少し待つ
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+        // 標準入力の内容が決まらないとキャッシュを使わないので、/dev/null にする
+        const int nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        ExecCache cache(cacheDir / "cache");
+        ExecOptions cacheOptions;
+        cacheOptions.execCache = &cache;
+        cacheOptions.stdinFd = nullFd;
+        uint64_t key;
+        StringToBeParsed smallStr(("cat " + smallPath + " | wc -l").c_str());
+        const auto smallJob = ParseJob(smallStr);
+        CaptureJob(smallJob, cacheOptions);
+        Benchmark("CaptureJob \"cat small.txt | wc -l\"", 2000, [&] { CaptureJob(smallJob); });
+        Benchmark("CaptureJob \"cat small.txt | wc -l\" with ExecCache hit", 20000, [&] { CaptureJob(smallJob, cacheOptions); });
+        Benchmark("ExecCache::Key \"cat small.txt | wc -l\"", 20000, [&] { cache.Key(smallJob, nullFd, key); });
+        // 実行ファイルの検索が大きな割合を占めるので、PathCache を使う場合も測る
+        PathCache cachePathCache;
+        cacheOptions.pathCache = &cachePathCache;
+        Benchmark("CaptureJob \"cat small.txt | wc -l\" with ExecCache hit and PathCache", 20000, [&] { CaptureJob(smallJob, cacheOptions); });
+        Benchmark("ExecCache::Key \"cat small.txt | wc -l\" with PathCache", 20000, [&] { cache.Key(smallJob, nullFd, key, &cachePathCache); });
+
+        StringToBeParsed bigStr(("cat " + bigPath).c_str());
+        const auto bigJob = ParseJob(bigStr);
+        Benchmark("ExecCache::Key \"cat big.txt\" 16MB (warm)", 20000, [&] { cache.Key(bigJob, nullFd, key); });
+        Benchmark("ExecCache::Key \"cat big.txt\" 16MB (cold)", 20, [&] {
+            ExecCache coldCache(cacheDir / "cache");
+            coldCache.Key(bigJob, nullFd, key);
+        });
+
+        // 索引はディレクトリなので、保存されている件数が多い場合も測る
+        auto stored = CaptureJob(smallJob);
+        constexpr uint64_t entryCount = 10000;
+        for (uint64_t i = 0; i < entryCount; i++)
+        {
+            cache.Store(i, stored);
+        }
+        key = 0;
+        Benchmark("ExecCache::Lookup hit with 10000 entries", 20000, [&] {
+            CaptureResult result;
+            cache.Lookup(key++ % entryCount, result);
+        });
+        Benchmark("ExecCache::Lookup miss with 10000 entries", 20000, [&] {
+            CaptureResult result;
+            cache.Lookup(entryCount + key++, result);
+        });
+        close(nullFd);
+        std::filesystem::remove_all(cacheDir);
+    }
+
+    // 大きな出力を取得する速度を GB/s で出力する
+    const auto tempDir = MakeTempDirectory();
+    constexpr size_t outputSize = 256 << 20;
+    const auto captureLine = "head -c " + std::to_string(outputSize) + " /dev/zero";
+    for (const auto &line : {captureLine, captureLine + " > " + (tempDir / "out.bin").string()})
+    {
+        StringToBeParsed captureStr(line.c_str());
+        const auto captureJob = ParseJob(captureStr);
+        const auto start = std::chrono::steady_clock::now();
+        const auto result = CaptureJob(captureJob);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        PrintBenchResult("CaptureJob \"" + line + "\"", {{"gb_per_sec", result.output.Size() / elapsed.count() / 1e9}});
+    }
+    std::filesystem::remove_all(tempDir);
+}
+
+// group が空の場合はすべてのベンチマークを実行する
+// 結果は 1 行に 1 つの JSON オブジェクトで出力する
+// 不明な group の場合は false を返す
+bool RunBenchmarks(const std::string_view group)
+{
+    if (group != "" && group != "parse" && group != "exec")
+    {
+        return false;
+    }
+    if (group == "" || group == "parse")
+    {
+        RunParseBenchmarks();
+    }
+    if (group == "" || group == "exec")
+    {
+        RunExecBenchmarks();
+    }
+    return true;
+}
+
+// "batch [-P 並列数] [--tag] [ファイル]" を実行する
+// 標準入力かファイルの各行を並列に実行し、出力を行の順に標準出力へ書き出す
+// --tag を指定すると終了した順に書き出し、出力の各行の先頭に 1 から始まる行番号とタブを付ける
+// すべての行の最後のコマンドが 0 で終了した場合は EXIT_SUCCESS を返す
+int RunBatchCommand(const int argc, char *argv[])
+{
+    BatchOptions options;
+    const char *path = nullptr;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+        {
+            options.parallelism = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (strcmp(argv[i], "--tag") == 0)
+        {
+            options.ordered = false;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    std::ifstream file;
+    if (path != nullptr)
+    {
+        file.open(path);
+        if (!file)
+        {
+            fprintf(stderr, "ファイルを開けませんでした, %s\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+    std::istream &in = path != nullptr ? file : std::cin;
+
+    size_t failedCount = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const auto count = RunBatch([&](std::string &line) { return static_cast<bool>(std::getline(in, line)); },
+                                [&](BatchResult &&result) {
+                                    if (!result.error.empty())
+                                    {
+                                        fprintf(stderr, "%zu 行目を実行できませんでした, %s\n", result.index + 1, result.error.c_str());
+                                    }
+                                    if (!result.error.empty() || (!result.statuses.empty() && result.statuses.back() != 0))
+                                    {
+                                        failedCount++;
+                                    }
+
+                                    auto output = result.output.View();
+                                    if (options.ordered)
+                                    {
+                                        fwrite(output.data(), 1, output.size(), stdout);
+                                        return;
+                                    }
+                                    while (!output.empty())
+                                    {
+                                        const auto lineEnd = std::min(output.find('\n'), output.size() - 1);
+                                        printf("%zu\t", result.index + 1);
+                                        fwrite(output.data(), 1, lineEnd + 1, stdout);
+                                        // 行番号を付けた行が混ざらないように、'\n' のない最後の行も改行する
+                                        if (output[lineEnd] != '\n')
+                                        {
+                                            putchar('\n');
+                                        }
+                                        output.remove_prefix(lineEnd + 1);
+                                    }
+                                },
+                                options);
+    fflush(stdout);
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fprintf(stderr, "%zu 行を %.3f 秒で実行しました, 失敗 %zu 行\n", count, elapsed.count(), failedCount);
+    return failedCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+    // ZygotePool が zygote として起動した場合は、ヘルパーの fork だけを行う
+    if (argc == 3 && strcmp(argv[1], "zygote") == 0)
+    {
+        return ZygotePool::RunZygote(atoi(argv[2]));
+    }
+
+    // SYNTAXANALYSIS_TRACE を定義してビルドした場合は、終了時にトレースを書き出す
+    TRACE_SESSION();
+
+    // "bench" を指定された場合はベンチマークを実行する
+    // "bench parse" や "bench exec" で一部だけを実行できる
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+    {
+        if (!RunBenchmarks(argc >= 3 ? argv[2] : ""))
+        {
+            fprintf(stderr, "不明なベンチマークです, %s\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // "json" を指定された場合は、標準入力かファイルの各行をパースして JSON で出力する
+    if (argc >= 2 && strcmp(argv[1], "json") == 0)
+    {
+        const int inFd = argc >= 3 ? open(argv[2], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+        if (inFd == -1)
+        {
+            fprintf(stderr, "ファイルを開けませんでした, %s, %s\n", argv[2], strerror(errno));
+            return EXIT_FAILURE;
+        }
+        try
+        {
+            WriteJobsAsJson(inFd, STDOUT_FILENO);
+        }
+        catch (const std::runtime_error &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // "batch" を指定された場合は、標準入力かファイルの各行を並列に実行する
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0)
+    {
+        return RunBatchCommand(argc, argv);
+    }
+
+    // 連続したスペースやトークンの間にスペースが出現する
+    TestParseJob("cmd1 aaa    bbb     | cmd2 |cmd3|cmd4 xxx>out.txt", {{"cmd1", "aaa", "bbb"}, {"cmd2"}, {"cmd3"}, {"cmd4", "xxx"}}, "out.txt");
+    TestParseJob(" cmd1 > out.txt", {{"cmd1"}}, "out.txt");
+
+    // パイプの右側にコマンドが存在しない
+    TestParseJob("cmd1|", {{"cmd1"}}, "");
+
+    // パイプの右側にリダイレクトが来る
+    TestParseJob("cmd1|>out.txt", {{"cmd1"}}, "out.txt");
+    TestParseJob("cmd1| > out.txt", {{"cmd1"}}, "out.txt");
+
+    // パイプの左側にコマンドが存在しない
+    TestParseJob("|cmd1", {{"cmd1"}}, "");
+
+    // パイプの左側にリダイレクトが来るとそこで読み込みは終わる
+    TestParseJob("cmd1>out.txt|cmd2", {{"cmd1"}}, "out.txt");
     TestParseJob("cmd1 > out.txt|cmd2", {{"cmd1"}}, "out.txt");
 
     // コマンドは存在せずリダイレクトのみ
@@ -264,5 +8392,161 @@ int main()
     // 空文字列
     TestParseJob("", {}, "");
 
+    // クォーテーションとエスケープ
+    TestParseJob("echo 'a b' \"c|d\" e\\ f > 'out file.txt'", {{"echo", "a b", "c|d", "e f"}}, "out file.txt");
+    TestParseJob("echo '' \"\" x''y", {{"echo", "", "", "xy"}}, "");
+    TestParseJob("echo \"a\\\"b\" \"a\\\\b\" \"a\\nb\" 'a\\b'", {{"echo", "a\"b", "a\\b", "a\\nb", "a\\b"}}, "");
+    TestParseJob("echo 'it'\\''s' a\\|b a\\>b|wc", {{"echo", "it's", "a|b", "a>b"}, {"wc"}}, "");
+    TestParseJob("echo \"'\" '\"' \\' \\\"", {{"echo", "'", "\"", "'", "\""}}, "");
+    TestParseJob("echo \"unterminated | grep > x", {{"echo", "unterminated | grep > x"}}, "");
+    TestParseJob("grep -e \"a very long pattern that crosses the 64 byte block boundary | > \" | sort>\"o u t\"",
+                 {{"grep", "-e", "a very long pattern that crosses the 64 byte block boundary | > "}, {"sort"}}, "o u t");
+    TestBuildQuoteMasks();
+
+    // 同じ Job の容量を再利用してパースする
+    TestParseJobReuse();
+
+    // Job を作らずにパースした内容を通知する
+    TestParseJobEvents("cmd1 aaa    bbb     | cmd2 |cmd3|cmd4 xxx>out.txt");
+    TestParseJobEvents("|cmd1|| > out.txt|cmd2");
+    TestParseJobEvents("echo 'a b' \"c|d\" e\\ f '' > 'out file.txt'");
+    TestParseJobEvents("cmd1 | cmd2 && cmd3; cmd4");
+    TestParseJobEvents("");
+
+    // コンパイル時にパースする
+    TestParseStaticJob();
+
+    // メモリを確保せずにパースする
+    TestParseJobFixed();
+
+    // 長い行を並列にパースする
+    TestParseJobParallel();
+
+    // 同じ文字列を共有する
+    TestStringInterner();
+
+    // バイナリ形式
+    TestEncodedJob();
+
+    // JSON 出力
+    TestWriteJobsAsJson();
+
+    // Job のハッシュ値と比較
+    TestHashJob("cmd1 aaa    bbb", "cmd1 aaa bbb", true);
+    TestHashJob(" cmd1 aaa|cmd2>out.txt", "cmd1 aaa | cmd2 > out.txt", true);
+    TestHashJob("cmd1 'aaa' \"bbb\"", "cmd1 aaa bbb", true);
+    TestHashJob("cmd1 'aaa bbb'", "cmd1 aaa bbb", false);
+    TestHashJob("cmd1 aaa | bbb", "cmd1 aaa bbb", false);
+    TestHashJob("cmd1 aaa > bbb", "cmd1 aaa bbb", false);
+    TestHashJob("cmd1 ab c", "cmd1 a bc", false);
+    TestHashJob("cmd1 '' | x", "cmd1 | x", false);
+
+    // <LIST>
+    TestParseCommandList("cmd1 aaa; cmd2", {{{{"cmd1", "aaa"}}, "", ListOperator::Sequence}, {{{"cmd2"}}, "", ListOperator::None}});
+    TestParseCommandList("cmd1 && cmd2 | cmd3 || cmd4 > out.txt &", {{{{"cmd1"}}, "", ListOperator::And},
+                                                                     {{{"cmd2"}, {"cmd3"}}, "", ListOperator::Or},
+                                                                     {{{"cmd4"}}, "out.txt", ListOperator::Background}});
+    TestParseCommandList("cmd1&cmd2&&cmd3||cmd4;", {{{{"cmd1"}}, "", ListOperator::Background},
+                                                    {{{"cmd2"}}, "", ListOperator::And},
+                                                    {{{"cmd3"}}, "", ListOperator::Or},
+                                                    {{{"cmd4"}}, "", ListOperator::Sequence}});
+    TestParseCommandList("echo 'a;b' \"c&d\" e\\|\\|f x\\;y", {{{{"echo", "a;b", "c&d", "e||f", "x;y"}}, "", ListOperator::None}});
+    TestParseCommandList("cmd1 > out.txt | ignored ; cmd2", {{{{"cmd1"}}, "out.txt", ListOperator::Sequence}, {{{"cmd2"}}, "", ListOperator::None}});
+    TestParseCommandList("cmd1 ||| cmd2", {{{{"cmd1"}}, "", ListOperator::Or}, {{{"cmd2"}}, "", ListOperator::None}});
+    TestParseCommandList("; ; cmd1 ;; && cmd2", {{{{"cmd1"}}, "", ListOperator::Sequence}, {{{"cmd2"}}, "", ListOperator::None}});
+    TestParseCommandList("", {});
+    TestParseJob("cmd1 aaa && cmd2", {{"cmd1", "aaa"}}, "");
+    TestParseJob("cmd1 || cmd2 > out.txt", {{"cmd1"}}, "");
+    TestParseJob("cmd1 > out.txt; cmd2", {{"cmd1"}}, "out.txt");
+
+    // 分割されて届く入力をパースする
+    TestJobStreamParser({
+        "cmd1 aaa    bbb     | cmd2 |cmd3|cmd4 xxx>out.txt",
+        " cmd1 > out.txt",
+        "cmd1|",
+        "cmd1|>out.txt",
+        "|cmd1",
+        "cmd1>out.txt|cmd2",
+        "cmd1 > out.txt|cmd2",
+        "| > out.txt",
+        "cmd1 >| out.txt",
+        "",
+        "echo 'a b' \"c|d\" e\\ f > 'out file.txt'",
+        "echo '' \"\" x''y",
+        "echo \"a\\\"b\" \"a\\\\b\" \"a\\nb\" 'a\\b' \"x\\",
+        "echo 'it'\\''s' a\\|b a\\>b|wc",
+        "echo \"unterminated | grep > x",
+        "echo trailing\\",
+        "cmd1 aaa; cmd2",
+        "cmd1|| cmd2",
+        "cmd1 | cmd2 && cmd3 > out.txt",
+        "echo 'a;b' \"c&d\" e\\|\\|f > x & cmd2",
+        "cmd1 |",
+    });
+
+    // pmr のアロケータでパースする
+    TestParseJobPmr("cmd1 aaa bbb | cmd2 ccc > out.txt");
+
+    // パース結果をキャッシュする
+    TestParseJobCache();
+
+    // パースしたジョブを実行する
+    const auto tempDir = MakeTempDirectory();
+    const auto outPath = (tempDir / "out.txt").string();
+    TestExecuteJob("echo hello world | tr a-z A-Z > " + outPath, {0, 0}, "HELLO WORLD\n");
+    TestExecuteJob("printf abc|cat|cat|cat>" + outPath, {0, 0, 0, 0}, "abc");
+    TestExecuteJob("true | false", {0, 1}, "");
+    TestExecuteJob("no_such_command_syntaxanalysis | true", {127, 0}, "");
+    TestExecuteJob("> " + outPath, {}, "");
+    TestExecuteJobEmptyArgs();
+
+    // <LIST> を実行する
+    TestRunCommandList("false && echo a > " + outPath + "; true || echo b > " + outPath + "; false || echo c > " + outPath, {{1}, {}, {0}, {}, {1}, {0}},
+                       outPath, "c\n");
+    TestRunCommandList("true && false && echo a > " + outPath + " || echo b > " + outPath, {{0}, {1}, {}, {0}}, outPath, "b\n");
+    TestRunCommandList("echo 'a;b' \"c&&d\" e\\|\\|f > " + outPath, {{0}}, outPath, "a;b c&&d e||f\n");
+    TestRunCommandList("false && echo a > " + outPath + " || echo b > " + outPath + " & true", {{1}, {}, {0}, {0}}, outPath, "b\n");
+    TestRunCommandListBackground();
+    TestBackgroundJobSchedulerTimeout();
+
+    // 複数の行を並列に実行する
+    TestRunBatch(true);
+    TestRunBatch(false);
+    TestRunBatchInput();
+    TestRunBatchNextLineError();
+
+    // 事前に fork したヘルパーで実行する
+    TestZygotePool();
+
+    // 組み込みコマンドをスレッドで実行する
+    TestExecuteJobWithBuiltins();
+
+    // コマンドの検索結果をキャッシュする
+    TestPathCache();
+
+    // 決定的なジョブの実行結果をキャッシュする
+    TestExecCache();
+
+    // 実行したコマンドの統計を集める
+    TestJobStats();
+
+#ifdef SYNTAXANALYSIS_TRACE
+    // 処理の区間を記録して書き出す
+    TestTrace();
+#endif
+
+    // 実行したジョブの出力を取得する
+    TestCaptureJob("echo hello world | tr a-z A-Z", {0, 0}, "HELLO WORLD\n");
+    TestCaptureJob("echo hello world | tr a-z A-Z > " + outPath, {0, 0}, "HELLO WORLD\n");
+    std::string yes;
+    for (int i = 0; i < 100000; i++)
+    {
+        yes += "abc\n";
+    }
+    TestCaptureJob("yes abc | head -n 100000", {128 + SIGPIPE, 0}, yes);
+    TestCaptureJob("yes abc | head -n 100000 > " + outPath, {128 + SIGPIPE, 0}, yes);
+    TestCaptureJob("false", {1}, "");
+    std::filesystem::remove_all(tempDir);
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,262 @@
+// 処理の区間を記録し、Chrome や Perfetto で表示できる JSON で書き出す
+// SYNTAXANALYSIS_TRACE を定義してビルドした場合だけ記録し、定義しない場合はマクロが何も生成しない
+//
+// 使い方
+//   TRACE_SESSION();                                 main の先頭に置く。終了時に $SYNTAXANALYSIS_TRACE_FILE (省略時は trace.json) に書き出す
+//   TRACE_SPAN("parse", "ParseJob");                 スコープを抜けるまでの区間
+//   TRACE_SPAN_DETAIL("exec", "SpawnCommand", arg);  区間に文字列を添える
+//   TRACE_ASYNC_BEGIN("exec", "stage", id, arg);     別の場所で終わる区間。id で TRACE_ASYNC_END と対応させる
+//   TRACE_ASYNC_END("exec", "stage", id);
+//
+// category と name は文字列リテラルなど、書き出すまで有効な文字列にする
+// 記録はスレッドごとのバッファに追加するだけで、ロックを取らない
+// バッファが一杯になった後の区間は捨て、書き出すときに捨てた数も出力する
+#pragma once
+
+#ifdef SYNTAXANALYSIS_TRACE
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace trace
+{
+struct Event final
+{
+    // 'X' は長さのある区間、'b' と 'e' は id で対応する区間の始まりと終わり
+    char phase;
+    const char *category;
+    const char *name;
+    // 記録したときに切り詰めてコピーする
+    char detail[32];
+    int64_t startNs;
+    int64_t durationNs;
+    uint64_t id;
+};
+
+// 1 つのスレッドが書き込み、WriteJson が読み込む
+// 書き込む側は count を release で増やし、読み込む側は acquire で読んだ数だけ読む
+// 短いスレッドが多くてもメモリを使いすぎないように、区間はチャンクに分けて必要になってから確保する
+struct Buffer final
+{
+    static constexpr size_t ChunkSize = 1024;
+    static constexpr size_t Capacity = ChunkSize * 64;
+
+    explicit Buffer(const long tid) : tid(tid){};
+
+    Event &At(const size_t index) { return chunks[index / ChunkSize][index % ChunkSize]; };
+
+    const long tid;
+    std::array<std::unique_ptr<Event[]>, Capacity / ChunkSize> chunks;
+    std::atomic<size_t> count{0};
+    std::atomic<size_t> dropped{0};
+};
+
+// すべてのスレッドのバッファ
+// スレッドが終了しても書き出せるように、プロセスが終了するまで破棄しない
+struct Registry final
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
+inline Registry &GetRegistry()
+{
+    static Registry *registry = new Registry;
+    return *registry;
+}
+
+inline int64_t Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 呼び出したスレッドのバッファを返す
+// ロックを取るのはスレッドごとに最初の 1 回だけ
+inline Buffer &ThreadBuffer()
+{
+    thread_local Buffer *buffer = nullptr;
+    if (buffer == nullptr)
+    {
+        auto &registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.buffers.push_back(std::make_unique<Buffer>(static_cast<long>(syscall(SYS_gettid))));
+        buffer = registry.buffers.back().get();
+    }
+    return *buffer;
+}
+
+inline void Record(const char phase, const char *category, const char *name, const std::string_view detail, const int64_t startNs, const int64_t durationNs,
+                   const uint64_t id)
+{
+    auto &buffer = ThreadBuffer();
+    const auto index = buffer.count.load(std::memory_order_relaxed);
+    if (index == Buffer::Capacity)
+    {
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (index % Buffer::ChunkSize == 0)
+    {
+        // チャンクのポインタも count を増やすまでは読み込まれない
+        buffer.chunks[index / Buffer::ChunkSize].reset(new Event[Buffer::ChunkSize]);
+    }
+    auto &event = buffer.At(index);
+    event.phase = phase;
+    event.category = category;
+    event.name = name;
+    const auto length = std::min(detail.size(), sizeof(event.detail) - 1);
+    if (length > 0)
+    {
+        memcpy(event.detail, detail.data(), length);
+    }
+    event.detail[length] = '\0';
+    event.startNs = startNs;
+    event.durationNs = durationNs;
+    event.id = id;
+    buffer.count.store(index + 1, std::memory_order_release);
+}
+
+// 作成してから破棄するまでを 1 つの区間として記録する
+class Span final
+{
+public:
+    Span(const char *category, const char *name, const std::string_view detail = {})
+        : m_category(category), m_name(name), m_detail(detail), m_startNs(Now()){};
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+    ~Span() { Record('X', m_category, m_name, m_detail, m_startNs, Now() - m_startNs, 0); };
+
+private:
+    const char *m_category;
+    const char *m_name;
+    // 区間の終わりまで参照先が有効でなければならない
+    std::string_view m_detail;
+    int64_t m_startNs;
+};
+
+inline void WriteJsonString(FILE *file, const char *s)
+{
+    fputc('"', file);
+    for (; *s != '\0'; s++)
+    {
+        const auto c = static_cast<unsigned char>(*s);
+        if (c == '"' || c == '\\')
+        {
+            fputc('\\', file);
+            fputc(c, file);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(file, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// 記録した区間を Chrome の trace event 形式の JSON で書き出す
+// 書き出している間も他のスレッドは記録を続けられ、その時点までの区間を書き出す
+// 書き出せた場合は true を返す
+inline bool WriteJson(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    const auto pid = static_cast<long>(getpid());
+    size_t dropped = 0;
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    auto &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const auto &buffer : registry.buffers)
+    {
+        const auto count = buffer->count.load(std::memory_order_acquire);
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto &event = buffer->At(i);
+            fprintf(file, "%s\n{\"ph\":\"%c\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"cat\":", first ? "" : ",", event.phase, pid, buffer->tid, event.startNs / 1e3);
+            first = false;
+            WriteJsonString(file, event.category);
+            fprintf(file, ",\"name\":");
+            WriteJsonString(file, event.name);
+            if (event.phase == 'X')
+            {
+                fprintf(file, ",\"dur\":%.3f", event.durationNs / 1e3);
+            }
+            else
+            {
+                fprintf(file, ",\"id\":\"0x%llx\"", static_cast<unsigned long long>(event.id));
+            }
+            if (event.detail[0] != '\0')
+            {
+                fprintf(file, ",\"args\":{\"detail\":");
+                WriteJsonString(file, event.detail);
+                fputc('}', file);
+            }
+            fputc('}', file);
+        }
+    }
+    fprintf(file, "\n],\"otherData\":{\"dropped_events\":\"%zu\"}}\n", dropped);
+    return fclose(file) == 0;
+}
+
+// 破棄するときに $SYNTAXANALYSIS_TRACE_FILE に書き出す
+// 書き出せない場合は標準エラー出力に表示する
+class Session final
+{
+public:
+    Session() = default;
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+    ~Session()
+    {
+        const char *path = getenv("SYNTAXANALYSIS_TRACE_FILE");
+        if (path == nullptr || path[0] == '\0')
+        {
+            path = "trace.json";
+        }
+        if (!WriteJson(path))
+        {
+            fprintf(stderr, "トレースを書き出せませんでした, %s\n", path);
+        }
+    };
+};
+} // namespace trace
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SESSION() trace::Session TRACE_CONCAT(traceSession, __LINE__)
+#define TRACE_SPAN(category, name) trace::Span TRACE_CONCAT(traceSpan, __LINE__)(category, name)
+#define TRACE_SPAN_DETAIL(category, name, detail) trace::Span TRACE_CONCAT(traceSpan, __LINE__)(category, name, detail)
+#define TRACE_ASYNC_BEGIN(category, name, id, detail) trace::Record('b', category, name, detail, trace::Now(), 0, static_cast<uint64_t>(id))
+#define TRACE_ASYNC_END(category, name, id) trace::Record('e', category, name, {}, trace::Now(), 0, static_cast<uint64_t>(id))
+
+#else
+
+#define TRACE_SESSION() ((void)0)
+#define TRACE_SPAN(category, name) ((void)0)
+#define TRACE_SPAN_DETAIL(category, name, detail) ((void)0)
+#define TRACE_ASYNC_BEGIN(category, name, id, detail) ((void)0)
+#define TRACE_ASYNC_END(category, name, id) ((void)0)
+
+#endif